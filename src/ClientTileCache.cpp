@@ -0,0 +1,99 @@
+#include "Common.h"
+#include "Metrics.h"
+#include "ClientTileCache.h"
+#include "Protocol.h"
+#include "VMControllers/Common/VNCClient.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& HitsMetric = Metrics::Get("client_tile_cache_hits_total");
+	static Metrics::Metric& MissesMetric = Metrics::Get("client_tile_cache_misses_total");
+	static Metrics::Metric& SavedBytesMetric = Metrics::Get("client_tile_cache_saved_bytes_total");
+	static Metrics::Metric& DroppedMetric = Metrics::Get("screen_updates_dropped_total");
+
+	bool ClientTileCache::Cacheable(const VNCRegion& region) {
+		switch(region.region_type) {
+			case VNCClientOptions::OutputRegionType::JpegRegion:
+			case VNCClientOptions::OutputRegionType::PngRegion:
+			case VNCClientOptions::OutputRegionType::QoiRegion:
+				break;
+			default:
+				return false;
+		}
+
+		return region.cacheable && (uint32)region.width * region.height <= MaxTileArea;
+	}
+
+	ClientTileCache::SendResult ClientTileCache::Send(WSSession& session, std::shared_ptr<VNCRegion> region, const WebsocketServer::shared_message_type& full) {
+		std::lock_guard<std::mutex> l(lock);
+
+		const uint64 queued = session.GetLinkStats().queued_bytes;
+		auto result = SendResult::Sent;
+
+		if(dropping) {
+			if(queued > WSSession::ResumeQueuedBytes) {
+				DroppedMetric.Add();
+				return SendResult::Dropped;
+			}
+
+			dropping = false;
+			result = SendResult::Resumed;
+		} else if(queued > WSSession::MaxQueuedBytes) {
+			// The refresh the user gets once the session catches up supersedes everything queued.
+			// The client won't get the tiles the dropped updates stored, so start the model over.
+			dropping = true;
+			entries.clear();
+			index.clear();
+			session.DropQueued();
+
+			DroppedMetric.Add();
+			return SendResult::Dropped;
+		}
+
+		if(!Cacheable(*region)) {
+			session.Send(full);
+			return result;
+		}
+
+		uint16 slot;
+
+		if(Lookup(region->content, slot)) {
+			auto message = Protocol::SerializeCachedTile(slot, region->x, region->y);
+
+			HitsMetric.Add();
+			SavedBytesMetric.Add(full->Size() - message->Size());
+			session.Send(message);
+		} else {
+			// Only the small store op is per user
+			MissesMetric.Add();
+			session.Send(full);
+			session.Send(Protocol::SerializeStoreTile(slot, region->x, region->y, region->width, region->height));
+		}
+
+		return result;
+	}
+
+	bool ClientTileCache::Lookup(const TileKey& key, uint16& slot) {
+		auto it = index.find(key);
+
+		if(it != index.end()) {
+			entries.splice(entries.begin(), entries, it->second);
+			slot = it->second->slot;
+			return true;
+		}
+
+		if(entries.size() < Slots) {
+			slot = (uint16)entries.size();
+		} else {
+			// Reuse the slot of the least recently used tile
+			slot = entries.back().slot;
+			index.erase(entries.back().key);
+			entries.pop_back();
+		}
+
+		entries.push_front({ key, slot });
+		index[key] = entries.begin();
+		return false;
+	}
+
+}
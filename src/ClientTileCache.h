@@ -0,0 +1,79 @@
+#pragma once
+#include "Common.h"
+#include "WebsocketServer.h"
+#include "VMControllers/Common/TileCache.h"
+#include <list>
+#include <unordered_map>
+
+namespace CollabVM {
+
+	struct VNCRegion;
+
+	// Model of the tiles a client holds in its tile cache,
+	// so tiles it has already been sent can be drawn from there instead of sent again.
+	//
+	// The client has Slots numbered slots. Tiles are sent as the same update everyone watching is sent,
+	// followed by a StoreTileOp naming the slot the client should keep them in,
+	// and drawn again with CachedTileOp (see schema/screen.fbs).
+	// The server picks every slot, evicting the least recently used tile,
+	// so the client never has to make an eviction decision of its own to stay in sync.
+	//
+	// Every screen update a user is sent goes through here, so this is also where
+	// updates are dropped while their session is too far behind (see WSSession::MaxQueuedBytes).
+	struct ClientTileCache {
+
+		// What Send() did with an update
+		enum class SendResult : byte {
+			Sent,
+
+			// The session is too far behind, so the update was dropped
+			Dropped,
+
+			// The session caught up after updates were dropped.
+			// The update was sent, but the user needs a refresh of their stream.
+			Resumed
+		};
+
+		// Amount of slots a client keeps
+		constexpr static uint16 Slots = 256;
+
+		// Largest tile kept, in pixels.
+		// This bounds the client's cache to Slots * MaxTileArea pixels.
+		constexpr static uint32 MaxTileArea = EncodedTileCache::MaxTileArea;
+
+		// Returns true if a region can be sent through the cache.
+		static bool Cacheable(const VNCRegion& region);
+
+		// Send a screen update to a session, as a reference to a slot if the client has its tile,
+		// or storing it in a slot if it doesn't.
+		// full is the update serialized as usual, shared by everyone it's sent to.
+		//
+		// Once the session is past WSSession::MaxQueuedBytes, the updates it has queued are dropped,
+		// and so is every update after, until it catches up to WSSession::ResumeQueuedBytes.
+		SendResult Send(WSSession& session, std::shared_ptr<VNCRegion> region, const WebsocketServer::shared_message_type& full);
+
+	private:
+
+		// Find the slot of a tile, marking it as recently used.
+		// If the client doesn't have the tile, a slot is picked for it and false is returned.
+		// Requires lock
+		bool Lookup(const TileKey& key, uint16& slot);
+
+		struct Entry {
+			TileKey key;
+			uint16 slot;
+		};
+
+		// Held while sending too, so messages go out in the order the model changed in
+		std::mutex lock;
+
+		// Locked by lock.
+		// Most recently used tiles are at the front.
+		std::list<Entry> entries;
+		std::unordered_map<TileKey, std::list<Entry>::iterator, TileKeyHasher> index;
+
+		// Whether updates are being dropped. Locked by lock
+		bool dropping = false;
+	};
+
+}
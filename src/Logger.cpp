@@ -1,8 +1,8 @@
-#include "Common.h"
-#include "Logger.h"
-
-namespace CollabVM {
-
-	bool Logger::AllowVerbose = false;
-
+#include "Common.h"
+#include "Logger.h"
+
+namespace CollabVM {
+
+	bool Logger::AllowVerbose = false;
+
 }
\ No newline at end of file
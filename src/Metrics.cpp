@@ -0,0 +1,39 @@
+#include "Common.h"
+#include "Metrics.h"
+#include <sstream>
+
+namespace CollabVM::Metrics {
+
+	// Metrics are looked up from static initializers in other files,
+	// so the registry is created on first use instead of being a global.
+	struct Registry {
+		std::mutex lock;
+
+		// std::map never moves its nodes,
+		// so references handed out by Get() stay valid.
+		std::map<std::string, Metric> metrics;
+	};
+
+	static Registry& GetRegistry() {
+		static Registry registry;
+		return registry;
+	}
+
+	Metric& Get(const std::string& name) {
+		auto& registry = GetRegistry();
+		std::lock_guard<std::mutex> lock(registry.lock);
+		return registry.metrics[name];
+	}
+
+	std::string Dump() {
+		auto& registry = GetRegistry();
+		std::lock_guard<std::mutex> lock(registry.lock);
+		std::ostringstream ss;
+
+		for(auto& [name, metric] : registry.metrics)
+			ss << name << ' ' << metric.Get() << '\n';
+
+		return ss.str();
+	}
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "Common.h"
+#include <atomic>
+
+namespace CollabVM::Metrics {
+
+	// A named value exported by the server,
+	// used to size hosts and find bottlenecks.
+	//
+	// Counters only ever go up, gauges can go either way.
+	// Both are plain atomics, so they are cheap enough to update on hot paths.
+	struct Metric {
+
+		inline void Add(int64 amount = 1) {
+			value.fetch_add(amount, std::memory_order_relaxed);
+		}
+
+		inline void Sub(int64 amount = 1) {
+			value.fetch_sub(amount, std::memory_order_relaxed);
+		}
+
+		inline void Set(int64 newValue) {
+			value.store(newValue, std::memory_order_relaxed);
+		}
+
+		// Raise the value to newValue if it's larger.
+		// Useful for high-water marks.
+		inline void Max(int64 newValue) {
+			int64 current = value.load(std::memory_order_relaxed);
+			while(newValue > current && !value.compare_exchange_weak(current, newValue, std::memory_order_relaxed));
+		}
+
+		inline int64 Get() const {
+			return value.load(std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<int64> value { 0 };
+	};
+
+	// Get (creating if it doesn't exist) the metric with the given name.
+	// The returned reference stays valid for the lifetime of the process,
+	// so callers should look metrics up once and keep the reference around.
+	Metric& Get(const std::string& name);
+
+	// Dump all metrics as text, one "name value" pair per line, sorted by name.
+	std::string Dump();
+
+}
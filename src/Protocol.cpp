@@ -1,44 +1,255 @@
-#include <Common.h>
-
-#ifdef _WIN32
-// Windows headers are garbage, 
-// and clobber Flatbuffers functions...
-// Moral of the story,
-// this is why the A/W naming system shouldn't have ever existed,
-// and this is why Windows headers are regarded as garbage.
-#undef GetMessage
-#endif
-
-#include <WebsocketServer.h>
-
-#include <collabvm_generated.h>
-
-namespace CollabVM::Protocol {
-
-	MessageT DeserializeMessage(std::shared_ptr<WSMessage> ws_message) {
-		MessageT message;
-		auto buffer = ws_message->buffer.data().data();
-
-		GetMessage(buffer)->UnPackTo(&message);
-
-		return message;
-	}
-
-	std::vector<byte> SerializeMessage(MessageT& message) {
-		std::vector<byte> managed;
-		flatbuffers::FlatBufferBuilder builder(1024);
-
-		// TODO: Verify that only one message component exists.
-		// More than one = error out, since that's an invalid state.
-		builder.Finish(Message::Pack(builder, &message));
-
-		// Copy the flatbuffer buffer into another buffer that we manage
-		managed.resize(builder.GetSize());
-		memcpy((byte*)&managed[0], (byte*)builder.GetBufferPointer(), builder.GetSize());
-
-		// Once buffer builder goes out of scope the memory is deleted
-		// so return our managed byte array instead
-		return managed;
-	}
-
+#include <Common.h>
+
+#ifdef _WIN32
+// Windows headers are garbage, 
+// and clobber Flatbuffers functions...
+// Moral of the story,
+// this is why the A/W naming system shouldn't have ever existed,
+// and this is why Windows headers are regarded as garbage.
+#undef GetMessage
+#endif
+
+#include <WebsocketServer.h>
+#include <Metrics.h>
+
+#include <collabvm_generated.h>
+#include <Protocol.h>
+#include <VMControllers/Common/VNCClient.h>
+
+namespace CollabVM::Protocol {
+
+	static Metrics::Metric& RejectedMetric = Metrics::Get("messages_rejected_total");
+
+	// Only written before any messages are read
+	static ParseLimits parseLimits;
+
+	void SetParseLimits(const ParseLimits& limits) {
+		parseLimits = limits;
+	}
+
+	const Message* VerifyMessage(const WSMessage& ws_message) {
+		auto data = ws_message.buffer.data();
+		auto buffer = static_cast<const uint8_t*>(data.data());
+
+		// Every offset in the message is checked to stay inside the buffer,
+		// so handlers can read tables straight out of it.
+		if(!ws_message.binary || data.size() == 0 || data.size() > parseLimits.max_size) {
+			RejectedMetric.Add();
+			return nullptr;
+		}
+
+		flatbuffers::Verifier verifier(buffer, data.size(), parseLimits.max_depth, parseLimits.max_tables);
+
+		if(!VerifyMessageBuffer(verifier)) {
+			RejectedMetric.Add();
+			return nullptr;
+		}
+
+		return GetMessage(buffer);
+	}
+
+	// Pooled buffers for message builders.
+	// Builders give their buffer away to every message they finish (see Detach()),
+	// so the buffers come back here when the last session is done with the message,
+	// instead of each message allocating a new one.
+	class MessageBufferPool : public flatbuffers::Allocator {
+		static Metrics::Metric& HitsMetric;
+		static Metrics::Metric& MissesMetric;
+		static Metrics::Metric& PooledBytesMetric;
+
+		// Buffers are pooled by size, in powers of two from 1KB to 1MB.
+		// Bigger buffers aren't pooled.
+		constexpr static std::size_t MinSizeLog2 = 10;
+		constexpr static std::size_t MaxSizeLog2 = 20;
+
+		// Most buffers kept of each size
+		constexpr static std::size_t MaxPooled = 32;
+
+		std::mutex lock;
+		std::vector<uint8_t*> free[MaxSizeLog2 - MinSizeLog2 + 1];
+		std::size_t pooled_bytes = 0;
+
+		constexpr static std::size_t SizeClass(std::size_t size) {
+			std::size_t log2 = MinSizeLog2;
+			while(((std::size_t)1 << log2) < size && log2 <= MaxSizeLog2)
+				log2++;
+			return log2;
+		}
+
+	   public:
+		// Never destroyed, since thread-local builders and queued messages can outlive static objects.
+		static MessageBufferPool& Get() {
+			static auto* pool = new MessageBufferPool();
+			return *pool;
+		}
+
+		uint8_t* allocate(size_t size) override {
+			const auto size_class = SizeClass(size);
+			if(size_class > MaxSizeLog2)
+				return new uint8_t[size];
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				auto& list = free[size_class - MinSizeLog2];
+				if(!list.empty()) {
+					auto* buffer = list.back();
+					list.pop_back();
+					pooled_bytes -= (std::size_t)1 << size_class;
+					PooledBytesMetric.Set(pooled_bytes);
+					HitsMetric.Add();
+					return buffer;
+				}
+			}
+
+			MissesMetric.Add();
+			return new uint8_t[(std::size_t)1 << size_class];
+		}
+
+		void deallocate(uint8_t* buffer, size_t size) override {
+			const auto size_class = SizeClass(size);
+			if(size_class <= MaxSizeLog2) {
+				std::lock_guard<std::mutex> guard(lock);
+				auto& list = free[size_class - MinSizeLog2];
+				if(list.size() < MaxPooled) {
+					list.push_back(buffer);
+					pooled_bytes += (std::size_t)1 << size_class;
+					PooledBytesMetric.Set(pooled_bytes);
+					return;
+				}
+			}
+
+			delete[] buffer;
+		}
+	};
+
+	Metrics::Metric& MessageBufferPool::HitsMetric = Metrics::Get("message_buffer_pool_hits_total");
+	Metrics::Metric& MessageBufferPool::MissesMetric = Metrics::Get("message_buffer_pool_misses_total");
+	Metrics::Metric& MessageBufferPool::PooledBytesMetric = Metrics::Get("message_buffer_pool_bytes");
+
+	// Get this thread's builder, ready for a new message.
+	// Builders are reused instead of being set up again for every message,
+	// and take their buffers from the pool.
+	inline flatbuffers::FlatBufferBuilder& GetBuilder() {
+		thread_local flatbuffers::FlatBufferBuilder builder(1024, &MessageBufferPool::Get());
+		builder.Clear();
+		return builder;
+	}
+
+	// A shared message holding the buffer of the builder that made it,
+	// so the two are one allocation.
+	struct BuiltMessage : WSSharedMessage {
+		flatbuffers::DetachedBuffer buffer;
+	};
+
+	// A built message with an encoded image as its payload
+	struct ImageMessage : BuiltMessage {
+		std::shared_ptr<const OutputBuffer> image;
+	};
+
+	// Take the finished message out of a builder, as a shared message.
+	// The builder's buffer becomes the message, so it's never copied on its way to the socket,
+	// and goes back to the pool when the message is freed.
+	template<class T = BuiltMessage>
+	inline std::shared_ptr<T> Detach(flatbuffers::FlatBufferBuilder& builder) {
+		auto shared = std::make_shared<T>();
+		shared->buffer = builder.Release();
+		shared->data = net::buffer(shared->buffer.data(), shared->buffer.size());
+		return shared;
+	}
+
+	std::vector<byte> SerializeMessage(MessageT& message) {
+		auto& builder = GetBuilder();
+
+		// TODO: Verify that only one message component exists.
+		// More than one = error out, since that's an invalid state.
+		builder.Finish(Message::Pack(builder, &message));
+
+		// Copy the flatbuffer buffer into another buffer that we manage
+		return std::vector<byte>(builder.GetBufferPointer(), builder.GetBufferPointer() + builder.GetSize());
+	}
+
+	WebsocketServer::shared_message_type SerializeSharedMessage(MessageT& message) {
+		auto& builder = GetBuilder();
+		builder.Finish(Message::Pack(builder, &message));
+		return Detach(builder);
+	}
+
+	WebsocketServer::shared_message_type SerializeAddUserMessage(std::string_view username) {
+		auto& builder = GetBuilder();
+		auto op = CreateAdduserOp(builder, builder.CreateString(username.data(), username.size()));
+
+		MessageBuilder message(builder);
+		message.add_which(MessageType::adduser);
+		message.add_adduser(op);
+		builder.Finish(message.Finish());
+
+		return Detach(builder);
+	}
+
+	inline ScreenCodec CodecFor(VNCClientOptions::OutputRegionType type) {
+		switch(type) {
+			case VNCClientOptions::OutputRegionType::PngRegion:
+				return ScreenCodec::Png;
+			case VNCClientOptions::OutputRegionType::QoiRegion:
+				return ScreenCodec::Qoi;
+			case VNCClientOptions::OutputRegionType::JpegRegion:
+			default:
+				return ScreenCodec::Jpeg;
+		}
+	}
+
+	// Finish a screen message holding the given op, as a shared message.
+	// Screen updates can be dropped (see WSSession::DropQueued()).
+	template<class T = BuiltMessage>
+	inline std::shared_ptr<T> FinishScreenMessage(flatbuffers::FlatBufferBuilder& builder, ScreenOp type, flatbuffers::Offset<void> op) {
+		FinishSizePrefixedScreenMessageBuffer(builder, CreateScreenMessage(builder, type, op));
+
+		auto shared = Detach<T>(builder);
+		shared->droppable = true;
+		return shared;
+	}
+
+	WebsocketServer::shared_message_type SerializeScreenUpdate(std::shared_ptr<VNCRegion> region) {
+		auto& builder = GetBuilder();
+
+		switch(region->region_type) {
+			case VNCClientOptions::OutputRegionType::CopyRegion: {
+				auto op = CreateCopyOp(builder, region->src_x, region->src_y, region->x, region->y, region->width, region->height);
+				return FinishScreenMessage(builder, ScreenOp::CopyOp, op.Union());
+			}
+
+			case VNCClientOptions::OutputRegionType::FillRegion: {
+				auto op = CreateFillOp(builder, region->x, region->y, region->width, region->height, region->color);
+				return FinishScreenMessage(builder, ScreenOp::FillOp, op.Union());
+			}
+
+			default: {
+				auto op = CreateRectOp(builder, CodecFor(region->region_type), region->x, region->y, region->width, region->height, (uint32)region->Data().size());
+				auto shared = FinishScreenMessage<ImageMessage>(builder, ScreenOp::RectOp, op.Union());
+
+				// Only the header is built. The encoded image is written to the socket after it
+				// straight from the region's buffer, which the message keeps alive.
+				if(region->shared_data)
+					shared->image = region->shared_data;
+				else
+					shared->image = std::shared_ptr<const OutputBuffer>(region, &region->data);
+
+				shared->payload = net::buffer(shared->image->data(), shared->image->size());
+				return shared;
+			}
+		}
+	}
+
+	WebsocketServer::shared_message_type SerializeStoreTile(uint16 slot, uint16 x, uint16 y, uint16 width, uint16 height) {
+		auto& builder = GetBuilder();
+		auto op = CreateStoreTileOp(builder, slot, x, y, width, height);
+		return FinishScreenMessage(builder, ScreenOp::StoreTileOp, op.Union());
+	}
+
+	WebsocketServer::shared_message_type SerializeCachedTile(uint16 slot, uint16 x, uint16 y) {
+		auto& builder = GetBuilder();
+		auto op = CreateCachedTileOp(builder, slot, x, y);
+		return FinishScreenMessage(builder, ScreenOp::CachedTileOp, op.Union());
+	}
+
 }
\ No newline at end of file
@@ -1,25 +1,75 @@
-#include <Common.h>
-#include <collabvm_generated.h>
-#include <WebsocketServer.h>
-
-
-namespace CollabVM::Protocol {
-
-	// Read a message from a WebSocket message buffer.
-	CollabVM::MessageT DeserializeMessage(std::shared_ptr<CollabVM::WSMessage> message);
-
-	// Serialize message to a byte array.
-	std::vector<CollabVM::byte> SerializeMessage(CollabVM::MessageT& message);
-
-
-	// INLINE PROTOCOL MESSAGE BUILDS HERE!!!
-
-	inline static CollabVM::MessageT BuildAddUserMessage(std::string username) {
-		MessageT m;
-		m.which = CollabVM::MessageType::adduser;
-		m.adduser = std::make_unique<AdduserOpT>();
-		m.adduser->username = username;
-		return m;
-	}
-
+#pragma once
+#include <Common.h>
+#include <collabvm_generated.h>
+#include <screen_generated.h>
+#include <WebsocketServer.h>
+
+namespace CollabVM {
+	struct VNCRegion;
+}
+
+namespace CollabVM::Protocol {
+
+	// Limits inbound messages are verified against.
+	// Anything past them is treated as an invalid message.
+	struct ParseLimits {
+		// Largest message, in bytes
+		std::size_t max_size = 64 * 1024;
+
+		// Deepest nesting of tables
+		uint32 max_depth = 16;
+
+		// Most tables in one message
+		uint32 max_tables = 256;
+	};
+
+	// Set the limits inbound messages are verified against.
+	// Call before any messages are read.
+	void SetParseLimits(const ParseLimits& limits);
+
+	// Verify an inbound message, without unpacking it.
+	// Returns the message's root table, or nullptr if the buffer isn't a valid message within the limits.
+	// The table points into the message's buffer, so it's only valid while the message is.
+	const CollabVM::Message* VerifyMessage(const CollabVM::WSMessage& message);
+
+	// Serialize message to a byte array.
+	std::vector<CollabVM::byte> SerializeMessage(CollabVM::MessageT& message);
+
+	// Serialize message once into a shared message,
+	// which can then be sent to any amount of users.
+	WebsocketServer::shared_message_type SerializeSharedMessage(CollabVM::MessageT& message);
+
+	// Serializers for messages sent often enough to skip building a MessageT.
+	// These build the message straight from their arguments.
+
+	WebsocketServer::shared_message_type SerializeAddUserMessage(std::string_view username);
+
+	// Screen messages.
+	//
+	// Screen messages aren't Messages: each is a ScreenMessage, the root table of schema/screen.fbs,
+	// with its own file identifier. Encoded images aren't in the table,
+	// but sent right after it as the message's payload, so they're never copied.
+
+	// Serialize a screen update region into a shared message.
+	// This happens once per region, no matter how many users are watching.
+	WebsocketServer::shared_message_type SerializeScreenUpdate(std::shared_ptr<VNCRegion> region);
+
+	// Serialize keeping the pixels on the client's screen in a rectangle in its tile cache.
+	// This is all that's built per user for a tile they don't have: the update itself is shared.
+	WebsocketServer::shared_message_type SerializeStoreTile(uint16 slot, uint16 x, uint16 y, uint16 width, uint16 height);
+
+	// Serialize drawing a tile from the client's tile cache.
+	WebsocketServer::shared_message_type SerializeCachedTile(uint16 slot, uint16 x, uint16 y);
+
+
+	// INLINE PROTOCOL MESSAGE BUILDS HERE!!!
+
+	inline static CollabVM::MessageT BuildAddUserMessage(std::string username) {
+		MessageT m;
+		m.which = CollabVM::MessageType::adduser;
+		m.adduser = std::make_unique<AdduserOpT>();
+		m.adduser->username = username;
+		return m;
+	}
+
 }
\ No newline at end of file
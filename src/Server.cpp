@@ -1,243 +1,298 @@
-#include "Server.h"
-#include "User.h"
-
-// Protocol functions
-#include "Protocol.h"
-
-namespace CollabVM {
-	
-	Server::~Server() {
-		IPDataCleanupTimer.cancel();
-	}
-
-	void Server::Start(tcp::endpoint& ep) {
-		logger.verbose("Starting processing thread before WebSockets");
-		WorkThread = std::thread(&Server::ProcessActions, this);
-		StartIPDataTimer();
-
-		BaseServer::Start(ep);
-		
-		// Start the WebSocket server loop and wait for the work thread to end
-		WorkThread.join();
-	}
-
-	void Server::Stop() {
-		StopWorking = true;
-		BaseServer::Stop();
-	}
-
-
-	bool Server::OnVerify(BaseServer::handle_type handle) {
-
-		auto subprotocols = handle->GetSubprotocols();
-
-		// Only allow "cvm2" subprotocol
-		for(auto subprotocol : subprotocols) {
-			if(subprotocol == "cvm2") {
-				auto addr = handle->GetAddress();
-
-				if(FindIPData(addr) == nullptr)
-					CreateIPData(addr);
-
-				std::shared_ptr<IPData> data = FindIPData(addr);
-
-				data->connection_count++;
-
-				return true;
-			}
-		}
-
-		return false;
-	}
-
-	void Server::OnOpen(BaseServer::handle_type handle) {
-		AddWork(std::make_shared<ConnectionAddWork>(handle));
-	}
-
-	void Server::OnMessage(BaseServer::handle_type handle, BaseServer::message_type message) {
-		// Return immediately if the message isn't a binary message, since we don't care for
-		// text WS messages.
-		if(!message->binary)
-			return;
-
-		AddWork(std::make_shared<WSMessageWork>(handle, message));
-	}
-
-	void Server::OnClose(BaseServer::handle_type handle) {
-		AddWork(std::make_shared<ConnectionRemoveWork>(handle));
-	}
-
-	std::shared_ptr<IPData> Server::FindIPData(net::ip::address& address) {
-		std::lock_guard<std::mutex> lock(IPDataLock);
-
-		if(address.is_v4()) {
-			auto v4addr = address.to_v4();
-			auto it = ipv4data.find(v4addr.to_uint());
-
-			if (it == ipv4data.end())
-				return nullptr;
-
-			return it->second;
-		} else if(address.is_v6()) {
-			auto v6addr = address.to_v6();
-
-			if(v6addr.is_v4_mapped()) {
-				auto v4addr = address.to_v6().to_v4();
-				auto it = ipv4data.find(v4addr.to_uint());
-
-				if (it == ipv4data.end())
-					return nullptr;
-
-				return it->second;
-			} else {
-				auto it = ipv6data.find(v6addr.to_bytes());
-
-				if (it == ipv6data.end())
-					return nullptr;
-
-				return it->second;
-			}
-		}
-		return nullptr;
-	}
-
-	void Server::CreateIPData(net::ip::address& address) {
-		std::lock_guard<std::mutex> lock(IPDataLock);
-
-		if(address.is_v4()) {
-			auto v4addr = address.to_v4();
-			uint32 ip = v4addr.to_uint();
-
-			ipv4data[ip] = std::make_shared<IPData>(address);
-		} else if(address.is_v6()) {
-			auto v6addr = address.to_v6();
-
-			if(v6addr.is_v4_mapped()) {
-				auto v4addr = address.to_v6().to_v4();
-				uint32 ip = v4addr.to_uint();
-				ipv4data[ip] = std::make_shared<IPData>(address);
-			} else {
-				auto ip = v6addr.to_bytes();
-				ipv6data[ip] = std::make_shared<IPData>(address);
-			}
-
-		}
-	}
-
-	void Server::CleanupIPData() {
-		std::lock_guard<std::mutex> lock(IPDataLock);
-		
-		auto ipv4it = ipv4data.begin();
-		while(ipv4it != ipv4data.end()) {
-			auto ipData = ipv4it->second;
-
-			if(ipData) {
-				if(ipData->SafeToDelete()) {
-					logger.verbose("Erasing IPData for ", ipData->str() , " @ ", &ipData);
-
-					auto addr = ipData->address;
-					ipv4data.erase(ipv4data.find(addr.to_v4().to_uint()));
-					ipv4it = ipv4data.begin();
-					continue;
-				}
-			}
-			ipv4it++;
-		}
-
-		auto ipv6it = ipv6data.begin();
-		while(ipv6it != ipv6data.end()) {
-			auto ipData = ipv6it->second;
-
-			if(ipData) {
-				if(ipData->SafeToDelete()) {
-					logger.verbose("Erasing IPData for ", ipData->str() , " @ ", &ipData);
-
-					auto addr = ipData->address;
-					ipv6data.erase(ipv6data.find(addr.to_v6().to_bytes()));
-					ipv6it = ipv6data.begin();
-					continue;
-				}
-			}
-			ipv6it++;
-		}
-
-		// Call StartIPDataTimer() again so we keep being called
-		StartIPDataTimer();
-	}
-
-	void Server::ProcessActions() {
-		logger.verbose("Work thread started");
-
-		while(!StopWorking) {
-			std::unique_lock<std::mutex> lock(WorkLock);
-
-			if(StopWorking == true)
-				break;
-
-			while(work.empty())
-				WorkReady.wait(lock);
-
-			std::shared_ptr<IWork> action = work.front();
-			work.pop_front();
-
-			// Process work based on what work type it is.
-			switch(action->type) {
-				case WorkType::AddConnection: {
-					std::lock_guard<std::mutex> lock(UsersLock);
-					ConnectionAddWork* add = (ConnectionAddWork*)action.get();
-					auto address = add->handle->GetAddress();
-
-					std::shared_ptr<IPData> data = FindIPData(address);
-					
-					// create user structure
-					users[add->handle] = std::make_shared<User>(add->handle, data);
-					logger.info("User Connected (IP: ", data->str(), ")");
-				} break;
-					
-				case WorkType::RemoveConnection: {
-					std::lock_guard<std::mutex> lock(UsersLock);
-					ConnectionRemoveWork* remove = (ConnectionRemoveWork*)action.get();
-					auto it = users.find(remove->handle);
-
-					if(it == users.end())
-						break; // stop but still free the action memory
-
-					std::shared_ptr<IPData> data = FindIPData(it->second->ipData->address);
-
-					// decrement connection count in IPData
-					if(data)
-						data->connection_count--;
-
-					logger.info("User Disconnect (IP: ", it->second->ipData->str(), ")");
-
-					// TODO (when vms work): disconnect user from vms so that reference count drops down to just work thread
-					// so that it becomes possible to delete when reset is called and/or we become the thread that deletes it
-
-					users.erase(it);
-					remove->handle.reset();
-				} break;
-
-				case WorkType::Message: {
-					WSMessageWork* msg = (WSMessageWork*)action.get();
-					auto user = users.find(msg->handle)->second;
-
-					// try to deserialize a message..
-					auto message = Protocol::DeserializeMessage(msg->message);
-					
-
-					msg->message.reset();
-				} break;
-
-				default:
-					logger.verbose("Work type ", (int)action->type, " not implemented");
-					break;
-			}
-
-			// delete memory to avoid leaks
-			// (we end up being the only one who owns the memory, so we get to delete it)
-			action.reset();
-		}
-	}
-
-
+#include "Server.h"
+#include "User.h"
+#include <charconv>
+
+// Protocol functions
+#include "Protocol.h"
+
+namespace CollabVM {
+	
+	Server::~Server() {
+		IPDataCleanupTimer.cancel();
+	}
+
+	void Server::Start(tcp::endpoint& ep) {
+		logger.verbose("Starting ", shards.size(), " work threads before WebSockets");
+		for(auto& shard : shards)
+			shard->thread = std::thread(&Server::ProcessActions, this, std::ref(*shard));
+
+		StartIPDataTimer();
+
+		BaseServer::Start(ep);
+		
+		// Start the WebSocket server loop and wait for the work threads to end
+		for(auto& shard : shards)
+			shard->thread.join();
+	}
+
+	void Server::Stop() {
+		StopWorking = true;
+
+		for(auto& shard : shards)
+			shard->work.Interrupt();
+
+		BaseServer::Stop();
+	}
+
+
+	bool Server::OnVerify(BaseServer::handle_type handle) {
+
+		auto subprotocols = handle->GetSubprotocols();
+
+		// Only allow "cvm2" subprotocol
+		for(auto subprotocol : subprotocols) {
+			if(subprotocol == "cvm2") {
+				auto addr = handle->GetAddress();
+
+				if(FindIPData(addr) == nullptr)
+					CreateIPData(addr);
+
+				std::shared_ptr<IPData> data = FindIPData(addr);
+
+				data->connection_count++;
+
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void Server::OnOpen(BaseServer::handle_type handle) {
+		AddWork(ShardFor(handle), ConnectionAddWork { handle });
+	}
+
+	bool Server::OnHttpGet(beast::string_view target, http::response<http::string_body>& response) {
+		constexpr beast::string_view Prefix = "/vm/";
+		constexpr beast::string_view Suffix = "/thumb.jpg";
+
+		if(!target.starts_with(Prefix) || !target.ends_with(Suffix) || target.size() <= Prefix.size() + Suffix.size())
+			return false;
+
+		auto idString = target.substr(Prefix.size(), target.size() - Prefix.size() - Suffix.size());
+		int id = 0;
+		auto [end, ec] = std::from_chars(idString.data(), idString.data() + idString.size(), id);
+
+		if(ec != std::errc() || end != idString.data() + idString.size())
+			return false;
+
+		std::shared_ptr<VMController> vm;
+
+		{
+			std::lock_guard<std::mutex> lock(VMLock);
+			auto it = vms.find(id);
+
+			if(it != vms.end())
+				vm = it->second;
+		}
+
+		if(!vm) {
+			response.result(http::status::not_found);
+			response.body() = "Not Found";
+			return true;
+		}
+
+		// The thumbnail is encoded ahead of time by the VM's VNC client,
+		// so serving it is just a copy.
+		auto thumbnail = vm->GetThumbnail();
+
+		if(!thumbnail) {
+			response.result(http::status::service_unavailable);
+			response.set(http::field::retry_after, "2");
+			response.body() = "No thumbnail yet";
+			return true;
+		}
+
+		response.set(http::field::content_type, "image/jpeg");
+		response.set(http::field::cache_control, "max-age=2");
+		response.body().assign(thumbnail->Data().begin(), thumbnail->Data().end());
+		return true;
+	}
+
+	void Server::OnMessage(BaseServer::handle_type handle, BaseServer::message_type message) {
+		// Return immediately if the message isn't a binary message, since we don't care for
+		// text WS messages.
+		if(!message->binary)
+			return;
+
+		AddWork(ShardFor(handle), WSMessageWork { handle, std::move(message) });
+	}
+
+	void Server::OnClose(BaseServer::handle_type handle) {
+		AddWork(ShardFor(handle), ConnectionRemoveWork { handle });
+	}
+
+	std::shared_ptr<IPData> Server::FindIPData(net::ip::address& address) {
+		std::lock_guard<std::mutex> lock(IPDataLock);
+
+		if(address.is_v4()) {
+			auto v4addr = address.to_v4();
+			auto it = ipv4data.find(v4addr.to_uint());
+
+			if (it == ipv4data.end())
+				return nullptr;
+
+			return it->second;
+		} else if(address.is_v6()) {
+			auto v6addr = address.to_v6();
+
+			if(v6addr.is_v4_mapped()) {
+				auto v4addr = address.to_v6().to_v4();
+				auto it = ipv4data.find(v4addr.to_uint());
+
+				if (it == ipv4data.end())
+					return nullptr;
+
+				return it->second;
+			} else {
+				auto it = ipv6data.find(v6addr.to_bytes());
+
+				if (it == ipv6data.end())
+					return nullptr;
+
+				return it->second;
+			}
+		}
+		return nullptr;
+	}
+
+	void Server::CreateIPData(net::ip::address& address) {
+		std::lock_guard<std::mutex> lock(IPDataLock);
+
+		if(address.is_v4()) {
+			auto v4addr = address.to_v4();
+			uint32 ip = v4addr.to_uint();
+
+			ipv4data[ip] = std::make_shared<IPData>(address);
+		} else if(address.is_v6()) {
+			auto v6addr = address.to_v6();
+
+			if(v6addr.is_v4_mapped()) {
+				auto v4addr = address.to_v6().to_v4();
+				uint32 ip = v4addr.to_uint();
+				ipv4data[ip] = std::make_shared<IPData>(address);
+			} else {
+				auto ip = v6addr.to_bytes();
+				ipv6data[ip] = std::make_shared<IPData>(address);
+			}
+
+		}
+	}
+
+	void Server::CleanupIPData() {
+		std::lock_guard<std::mutex> lock(IPDataLock);
+		
+		auto ipv4it = ipv4data.begin();
+		while(ipv4it != ipv4data.end()) {
+			auto ipData = ipv4it->second;
+
+			if(ipData) {
+				if(ipData->SafeToDelete()) {
+					logger.verbose("Erasing IPData for ", ipData->str() , " @ ", &ipData);
+
+					auto addr = ipData->address;
+					ipv4data.erase(ipv4data.find(addr.to_v4().to_uint()));
+					ipv4it = ipv4data.begin();
+					continue;
+				}
+			}
+			ipv4it++;
+		}
+
+		auto ipv6it = ipv6data.begin();
+		while(ipv6it != ipv6data.end()) {
+			auto ipData = ipv6it->second;
+
+			if(ipData) {
+				if(ipData->SafeToDelete()) {
+					logger.verbose("Erasing IPData for ", ipData->str() , " @ ", &ipData);
+
+					auto addr = ipData->address;
+					ipv6data.erase(ipv6data.find(addr.to_v6().to_bytes()));
+					ipv6it = ipv6data.begin();
+					continue;
+				}
+			}
+			ipv6it++;
+		}
+
+		// Call StartIPDataTimer() again so we keep being called
+		StartIPDataTimer();
+	}
+
+	void Server::ProcessActions(WorkShard& shard) {
+		logger.verbose("Work thread ", shard.index, " started");
+
+		// Reused, so draining doesn't allocate once it's grown to fit a batch
+		std::vector<Work> batch;
+
+		while(!StopWorking) {
+			// Take everything that's queued in one go,
+			// and only sleep once there's nothing left.
+			batch.clear();
+			if(shard.work.Drain(batch) == 0) {
+				shard.work.Wait();
+				continue;
+			}
+
+			for(auto& work : batch)
+				ProcessAction(shard, work);
+		}
+	}
+
+	void Server::OnUserMessage(User& user, const CollabVM::Message& message) {
+		// Handlers get the typed table of their message (e.g message.adduser()),
+		// which is only valid during the call.
+		switch(message.which()) {
+			default:
+				logger.verbose("Message ", EnumNameMessageType(message.which()), " not handled yet");
+				break;
+		}
+	}
+
+	void Server::ProcessAction(WorkShard& shard, Work& work) {
+		// Process work based on which record it holds.
+		if(auto add = std::get_if<ConnectionAddWork>(&work)) {
+			auto address = add->handle->GetAddress();
+
+			std::shared_ptr<IPData> data = FindIPData(address);
+			
+			// create user structure
+			shard.users[add->handle] = std::make_shared<User>(add->handle, data);
+			logger.info("User Connected (IP: ", data->str(), ")");
+		} else if(auto remove = std::get_if<ConnectionRemoveWork>(&work)) {
+			auto it = shard.users.find(remove->handle);
+
+			if(it != shard.users.end()) {
+				std::shared_ptr<IPData> data = FindIPData(it->second->ipData->address);
+
+				// decrement connection count in IPData
+				if(data)
+					data->connection_count--;
+
+				logger.info("User Disconnect (IP: ", it->second->ipData->str(), ")");
+
+				// Take the user off their VM, so the VM doesn't keep them alive.
+				// The VM's user list has its own lock, since its VNC client broadcasts from other threads.
+				if(auto vm = it->second->vm)
+					vm->Leave(it->second);
+
+				shard.users.erase(it);
+			}
+		} else if(auto msg = std::get_if<WSMessageWork>(&work)) {
+			auto it = shard.users.find(msg->handle);
+
+			if(it != shard.users.end()) {
+				// Handlers read the message in place, so it's verified first
+				if(auto message = Protocol::VerifyMessage(*msg->message))
+					OnUserMessage(*it->second, *message);
+				else
+					logger.verbose("Dropping invalid message from ", it->second->ipData->str());
+			}
+		}
+
+		// Release what the record holds now; the message goes back to its pool
+		work = std::monostate();
+	}
+
 }
\ No newline at end of file
@@ -1,155 +1,160 @@
-#pragma once
-#include "Common.h"
-#include "User.h"
-#include "WebsocketServer.h"
-#include "Logger.h"
-#include "VMControllers/Common/VMController.h"
-
-namespace CollabVM {
-	
-	enum class WorkType {
-		AddConnection,
-		RemoveConnection,
-		Message
-	};
-
-	// Interface that work follows.
-	struct IWork {
-		// Which work type.
-		// If you're adding work, make sure to add a value to the above WorkType enum
-		WorkType type;
-
-		IWork(WorkType t)
-			: type(t) {
-		
-		}
-	};
-	
-	struct ConnectionAddWork : public IWork {
-		WebsocketServer::handle_type handle;
-
-		ConnectionAddWork(WebsocketServer::handle_type handle) 
-			: IWork(WorkType::AddConnection), handle(handle) {
-		}
-
-	};	
-
-	struct ConnectionRemoveWork : public IWork {
-		WebsocketServer::handle_type handle;
-
-		ConnectionRemoveWork(WebsocketServer::handle_type handle) 
-			: IWork(WorkType::RemoveConnection), handle(handle) {
-		}
-
-	};
-
-	struct WSMessageWork : public IWork {
-		WebsocketServer::handle_type handle;
-		WebsocketServer::message_type message;
-
-		WSMessageWork(WebsocketServer::handle_type handle, WebsocketServer::message_type message)
-			: IWork(WorkType::Message), handle(handle), message(message) {
-		
-		}
-	
-	};
-
-	struct Server : public WebsocketServer {
-		typedef WebsocketServer BaseServer;
-
-		inline Server(net::io_service& ioc)
-			: BaseServer(ioc),
-			IPDataCleanupTimer(ioc) {
-			
-		}
-
-		~Server();
-
-		void Start(tcp::endpoint& ep);
-
-		void Stop();
-
-		bool OnVerify(BaseServer::handle_type handle);
-
-		void OnOpen(BaseServer::handle_type handle);
-
-		void OnMessage(BaseServer::handle_type handle, BaseServer::message_type message);
-
-		void OnClose(BaseServer::handle_type handle);
-
-		// Shorthand to add work to the work queue
-		inline void AddWork(std::shared_ptr<IWork> newWork) {
-			// Only add action to the work queue if
-			// the work to add isn't nullptr
-			if(newWork) {
-				// TODO: This lock needs to somehow be re-added. Otherwise,
-				// things might fall down and go boom
-
-				//std::lock_guard<std::mutex> lock(WorkLock);
-
-				work.push_back(newWork);
-				WorkReady.notify_one();
-			}
-		}
-
-	private:
-		void ProcessActions();
-
-		std::shared_ptr<IPData> FindIPData(net::ip::address& address);
-
-		void CreateIPData(net::ip::address& address);
-
-		void CleanupIPData();
-
-		//void OnVMControllerStateChange();
-
-		inline void StartIPDataTimer() {
-			IPDataCleanupTimer.expires_after(net::steady_timer::duration(IPDataTimeout));
-			IPDataCleanupTimer.async_wait(std::bind(&Server::CleanupIPData, this));
-		}
-
-		// TODO figure out how to make these constexpr
-
-		// Timeout in seconds when the IPData will be cleaned up.
-		const std::chrono::seconds IPDataTimeout = std::chrono::seconds(5);
-
-
-		// Thread performing work.
-		std::thread WorkThread;
-
-		std::mutex WorkLock;
-
-		std::condition_variable WorkReady;
-
-		bool StopWorking = false;
-
-		// deque of work
-		// locked by workLock
-		std::deque<std::shared_ptr<IWork>> work;
-
-		
-		std::mutex IPDataLock;
-
-		net::steady_timer IPDataCleanupTimer;
-
-
-		// IPv4 IPData
-		std::map<uint64, std::shared_ptr<IPData>> ipv4data;
-		
-		// IPv6 IPData
-		std::map<std::array<byte, 16>, std::shared_ptr<IPData>> ipv6data;
-
-		
-		std::mutex UsersLock;
-
-		// Map of handles to users
-		std::map<WebsocketServer::handle_type, std::shared_ptr<User>> users;
-
-		std::mutex VMLock;
-		std::map<int, std::shared_ptr<VMController>> vms;
-
-		// logger
-		Logger logger = Logger::GetLogger("CollabVMServer");
-	};
-
+#pragma once
+#include "Common.h"
+#include "User.h"
+#include "WebsocketServer.h"
+#include "Logger.h"
+#include "WorkQueue.h"
+#include <variant>
+#include "VMControllers/Common/VMController.h"
+
+namespace CollabVM {
+	
+	// Work records.
+	//
+	// These are stored in place in a shard's work queue, so queueing work doesn't allocate;
+	// incoming messages are moved in, and go back to their pool once the work is done.
+
+	struct ConnectionAddWork {
+		WebsocketServer::handle_type handle;
+	};
+
+	struct ConnectionRemoveWork {
+		WebsocketServer::handle_type handle;
+	};
+
+	struct WSMessageWork {
+		WebsocketServer::handle_type handle;
+		WebsocketServer::message_type message;
+	};
+
+	// A unit of work. std::monostate is an empty record.
+	// If you're adding work, add its record here and handle it in Server::ProcessAction().
+	typedef std::variant<std::monostate, ConnectionAddWork, ConnectionRemoveWork, WSMessageWork> Work;
+
+	// A work thread, and the state only it touches.
+	//
+	// Work is split over shards by connection (see Server::ShardFor()),
+	// so each user is only ever touched by one work thread.
+	// VM work is not sharded: users of one VM can be on any shard,
+	// so VM controllers keep their own locks (see VMController).
+	struct WorkShard {
+		// Most work items waiting before AddWork() pushes back on the io threads
+		constexpr static std::size_t QueueSize = 64 * 1024;
+
+		inline WorkShard(std::size_t index)
+			: index(index),
+			work(QueueSize, "work_queue", "{shard=\"" + std::to_string(index) + "\"}") {
+
+		}
+
+		const std::size_t index;
+
+		// Work queued by the io threads
+		WorkQueue<Work> work;
+
+		std::thread thread;
+
+		// Users whose connections belong to this shard.
+		// Only touched by thread, so it needs no lock.
+		std::map<WebsocketServer::handle_type, std::shared_ptr<User>> users;
+	};
+
+	struct Server : public WebsocketServer {
+		typedef WebsocketServer BaseServer;
+
+		// work_threads is the amount of work shards, at least one.
+		inline Server(net::io_service& ioc, std::size_t work_threads = 1)
+			: BaseServer(ioc),
+			IPDataCleanupTimer(ioc) {
+			for(std::size_t i = 0; i < std::max<std::size_t>(work_threads, 1); ++i)
+				shards.push_back(std::make_unique<WorkShard>(i));
+		}
+
+		~Server();
+
+		void Start(tcp::endpoint& ep);
+
+		void Stop();
+
+		bool OnVerify(BaseServer::handle_type handle);
+
+		void OnOpen(BaseServer::handle_type handle);
+
+		void OnMessage(BaseServer::handle_type handle, BaseServer::message_type message);
+
+		void OnClose(BaseServer::handle_type handle);
+
+		// Serves VM thumbnails at /vm/<id>/thumb.jpg
+		bool OnHttpGet(beast::string_view target, http::response<http::string_body>& response) override;
+
+		// Shorthand to add work to a shard's work queue.
+		// Safe to call from any thread; it doesn't take a lock.
+		inline void AddWork(WorkShard& shard, Work&& newWork) {
+			// Only add work to the work queue if
+			// there is any
+			if(!std::holds_alternative<std::monostate>(newWork))
+				shard.work.Push(std::move(newWork));
+		}
+
+		// The shard owning a connection.
+		inline WorkShard& ShardFor(const BaseServer::handle_type& handle) {
+			// Sessions are allocated, so the low bits of the address say little
+			const uint64 key = (uint64)(std::uintptr_t)handle.get() * 0x9E3779B97F4A7C15ull;
+			return *shards[(key >> 32) % shards.size()];
+		}
+
+	private:
+		// Drain a shard's work queue until stopped
+		void ProcessActions(WorkShard& shard);
+
+		void ProcessAction(WorkShard& shard, Work& work);
+
+		// Handle a verified message from a user
+		void OnUserMessage(User& user, const CollabVM::Message& message);
+
+		std::shared_ptr<IPData> FindIPData(net::ip::address& address);
+
+		void CreateIPData(net::ip::address& address);
+
+		void CleanupIPData();
+
+		//void OnVMControllerStateChange();
+
+		inline void StartIPDataTimer() {
+			IPDataCleanupTimer.expires_after(net::steady_timer::duration(IPDataTimeout));
+			IPDataCleanupTimer.async_wait(std::bind(&Server::CleanupIPData, this));
+		}
+
+		// TODO figure out how to make these constexpr
+
+		// Timeout in seconds when the IPData will be cleaned up.
+		const std::chrono::seconds IPDataTimeout = std::chrono::seconds(5);
+
+
+		std::atomic<bool> StopWorking { false };
+
+		// Never resized after construction, so any thread can index it
+		std::vector<std::unique_ptr<WorkShard>> shards;
+
+		
+		std::mutex IPDataLock;
+
+		net::steady_timer IPDataCleanupTimer;
+
+
+		// IPv4 IPData
+		std::map<uint64, std::shared_ptr<IPData>> ipv4data;
+		
+		// IPv6 IPData
+		std::map<std::array<byte, 16>, std::shared_ptr<IPData>> ipv6data;
+
+
+		// Read far more often than it changes (e.g by OnHttpGet())
+		std::mutex VMLock;
+		std::map<int, std::shared_ptr<VMController>> vms;
+
+		// logger
+		Logger logger = Logger::GetLogger("CollabVMServer");
+	};
+
 }
\ No newline at end of file
@@ -1,114 +1,165 @@
-#pragma once
-#include "Common.h"
-#include "WebsocketServer.h"
-#include <collabvm_generated.h> // For UserType
-
-namespace CollabVM {
-
-	// Forward decl
-	struct VMController;
-
-	// Per-IP address data
-	struct IPData {
-		// The IP address.
-		net::ip::address address;
-
-		// Amount of connections from this IP address.
-		uint64 connection_count = 0;
-
-		// more fields here as they're needed
-
-		IPData(net::ip::address& addr)
-			: address(addr) {
-		
-		}
-
-		// returns true if the IPData
-		// is safe to be cleaned up.
-		inline bool SafeToDelete() {
-			return connection_count == 0;
-		}
-
-		inline std::string str() {
-			if (address.is_v4()) {
-
-				return address.to_v4().to_string();
-
-			} else if (address.is_v6()) {
-
-				if(address.to_v6().is_v4_mapped())
-					return address.to_v4().to_string();
-
-				return address.to_v6().to_string();
-			}
-
-			// Just to satisify the compiler honestly
-			return "Error";
-		}
-	};
-
-	// User data structure
-	struct User {
-
-		User(WebsocketServer::handle_type handle, std::shared_ptr<IPData> ipdata)
-			: handle(handle), ipData(ipdata) {
-			type = UserType::Guest;
-		}
-
-		~User() {
-			// release ownership of session handle
-			handle.reset();
-		}
-
-		// handle to session that this user connected with
-		WebsocketServer::handle_type handle;
-
-		// IPData of the user.
-		std::shared_ptr<IPData> ipData;
-
-		// Username of the user
-		std::string username;
-
-		// pointer to VMController user is on,
-		// nullptr if they are not connected
-		std::shared_ptr<VMController> vm;
-
-		UserType type;
-
-
-		// Generates a guest name, if the user didn't join with one
-		static inline std::string GenerateGuestName() {
-
-			// Guest name prefix. Change to your liking
-			constexpr static char NamePrefix[] = "guest";
-
-			// Max ID.
-			constexpr uint64 MaxID = 99999;
-			
-			// made static so that this won't happen every single call
-			// (since that would be slow) and instead on the first call to GenerateGuestName
-			static std::uniform_int_distribution<int> dist(0, MaxID);
-			static std::mt19937 mt(std::chrono::high_resolution_clock::now().time_since_epoch().count());
-
-			auto str = std::to_string(dist(mt));
-
-			std::stringstream ss;
-			ss << NamePrefix << str;
-			
-			// TODO: There's probably a far better way of doing this, 
-			// but it's the most relatively cheapest way and it works,
-			// so whatever.
-
-			// Pad names too small (under or at 3 characters) with additional zeroes 
-			// example `guest202` to `guest20200`
-			if(str.size() <= 3) {
-				const auto pad_count = 5 - str.size();
-				for(int i = 0; i < pad_count; ++i)
-					ss << '0';
-			}
-
-			return ss.str();
-		}
-	};
-
+#pragma once
+#include "Common.h"
+#include "WebsocketServer.h"
+#include "ClientTileCache.h"
+#include <atomic>
+#include <collabvm_generated.h> // For UserType
+
+namespace CollabVM {
+
+	// Forward decl
+	struct VMController;
+
+	// Per-IP address data
+	struct IPData {
+		// The IP address.
+		net::ip::address address;
+
+		// Amount of connections from this IP address.
+		// Changed by io threads and work threads alike
+		std::atomic<uint64> connection_count { 0 };
+
+		// more fields here as they're needed
+
+		IPData(net::ip::address& addr)
+			: address(addr) {
+		
+		}
+
+		// returns true if the IPData
+		// is safe to be cleaned up.
+		inline bool SafeToDelete() {
+			return connection_count == 0;
+		}
+
+		inline std::string str() {
+			if (address.is_v4()) {
+
+				return address.to_v4().to_string();
+
+			} else if (address.is_v6()) {
+
+				if(address.to_v6().is_v4_mapped())
+					return address.to_v4().to_string();
+
+				return address.to_v6().to_string();
+			}
+
+			// Just to satisify the compiler honestly
+			return "Error";
+		}
+	};
+
+	// User data structure
+	struct User {
+
+		User(WebsocketServer::handle_type handle, std::shared_ptr<IPData> ipdata)
+			: handle(handle), ipData(ipdata) {
+			type = UserType::Guest;
+		}
+
+		~User() {
+			// release ownership of session handle
+			handle.reset();
+		}
+
+		// handle to session that this user connected with
+		WebsocketServer::handle_type handle;
+
+		// IPData of the user.
+		std::shared_ptr<IPData> ipData;
+
+		// Username of the user
+		std::string username;
+
+		// pointer to VMController user is on,
+		// nullptr if they are not connected
+		std::shared_ptr<VMController> vm;
+
+		UserType type;
+
+		// Quality tier this user is sent screen updates at.
+		// Locked by the user list of the VM the user is on.
+		QualityTier tier = QualityTier::Medium;
+
+		// Scaled stream this user is sent screen updates on, 0 for full resolution.
+		// Set through VMController::SetUserScale(). Locked like tier
+		byte scale = 0;
+
+		// Tiles this user's client holds.
+		// Tiles are content addressed, so it stays valid across VMs.
+		ClientTileCache tile_cache;
+
+		// Re-evaluate the quality tier from the session's link statistics.
+		// A new tier has to be wanted for a while before the user is moved,
+		// so a single slow write doesn't make the user bounce between tiers.
+		// Returns true if the tier changed. Requires the lock of tier.
+		inline bool UpdateQualityTier() {
+			constexpr auto Hysteresis = std::chrono::seconds(2);
+
+			if(!handle)
+				return false;
+
+			auto now = std::chrono::steady_clock::now();
+			auto wanted = SelectQualityTier(handle->GetLinkStats());
+
+			if(wanted == tier) {
+				wanted_tier = tier;
+				return false;
+			}
+
+			if(wanted != wanted_tier) {
+				wanted_tier = wanted;
+				wanted_since = now;
+				return false;
+			}
+
+			if(now - wanted_since < Hysteresis)
+				return false;
+
+			tier = wanted;
+			return true;
+		}
+
+
+		// Generates a guest name, if the user didn't join with one
+		static inline std::string GenerateGuestName() {
+
+			// Guest name prefix. Change to your liking
+			constexpr static char NamePrefix[] = "guest";
+
+			// Max ID.
+			constexpr uint64 MaxID = 99999;
+			
+			// made static so that this won't happen every single call
+			// (since that would be slow) and instead on the first call to GenerateGuestName
+			static std::uniform_int_distribution<int> dist(0, MaxID);
+			static std::mt19937 mt(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+
+			auto str = std::to_string(dist(mt));
+
+			std::stringstream ss;
+			ss << NamePrefix << str;
+			
+			// TODO: There's probably a far better way of doing this, 
+			// but it's the most relatively cheapest way and it works,
+			// so whatever.
+
+			// Pad names too small (under or at 3 characters) with additional zeroes 
+			// example `guest202` to `guest20200`
+			if(str.size() <= 3) {
+				const auto pad_count = 5 - str.size();
+				for(int i = 0; i < pad_count; ++i)
+					ss << '0';
+			}
+
+			return ss.str();
+		}
+
+	private:
+		// The tier UpdateQualityTier() would like to move to, and since when
+		QualityTier wanted_tier = QualityTier::Medium;
+		std::chrono::steady_clock::time_point wanted_since;
+	};
+
 }
\ No newline at end of file
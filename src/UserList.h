@@ -1,135 +1,147 @@
-#include <Common.h>
-#include <Server.h>
-#include <User.h>
-#include <list>
-
-namespace CollabVM {
-
-	struct UserList {
-
-		template<class Function>
-		inline void AddUser(std::shared_ptr<User> user, Function fun) {
-			std::lock_guard<std::mutex> l(lock);
-			bool duplicate = false;
-
-			ForEach([&](auto it) {
-				if (user == *it) {
-					// duplicate user will be added if this goes through
-					duplicate = true;
-					return false;
-				}
-
-				return true;
-			});
-
-			// return if this will cause a duplicate user
-			if(duplicate)
-				return;
-
-			// insert user
-			users.push_back(user);
-			std::sort(users.begin(), users.end());
-			connected_users++;
-
-			fun(user);
-		}
-
-		inline bool AddUser(std::shared_ptr<User> user) {
-			std::lock_guard<std::mutex> l(lock);
-			bool duplicate = false;
-
-			ForEach([&](auto it) {
-				if (user == *it) {
-					// duplicate user will be added if this goes through
-					duplicate = true;
-					return false;
-				}
-
-				return true;
-			});
-
-			// return if this will cause a duplicate user to be added
-			if(duplicate)
-				return false;
-
-			// insert user
-			users.push_back(user);
-			std::sort(users.begin(), users.end());
-			connected_users++;
-
-			return true;
-		}
-
-		
-		template<class Function>
-		inline void RemoveUser(std::shared_ptr<User> user, Function fun) {
-			std::lock_guard<std::mutex> l(lock);
-
-			ForEach([&](auto it) {
-
-				if (user == *it) {
-					// remove if found
-					(*it).reset();
-					users.erase(it);
-					connected_users--;
-
-					fun();
-					return false;
-				}
-
-				// not found yet
-				return true;
-			});
-		}		
-
-		inline void RemoveUser(std::shared_ptr<User> user) {
-			std::lock_guard<std::mutex> l(lock);
-
-			ForEach([&](auto it) {
-
-				if (user == *it) {
-					// remove if found
-					(*it).reset();
-					users.erase(it);
-					connected_users--;
-
-					return false;
-				}
-
-				// not found yet
-				return true;
-			});
-		}
-	
-		// signature: bool(iterator_type)
-		// return false if you want to stop iterating
-		template<class Function>
-		inline void ForEach(Function callback) {
-			if(users.size() == 0)
-				return;
-
-			// iterate through list stopping if user callback returns false
-			for(auto it = users.begin(); it != users.end(); ++it)
-				if(!callback(it))
-					break;
-		}		
-		
-		// version that acquires users lock
-		// signature: bool(iterator_type)
-		// return false if you want to stop iterating
-		template<class Function>
-		inline void ForEachLock(Function callback) {
-			std::lock_guard<std::mutex> l(lock);
-			ForEach(callback);
-		}
-
-	private:
-
-		std::mutex lock;
-
-		std::list<std::shared_ptr<User>> users;
-
-		uint64 connected_users;
-	};
-
+#pragma once
+#include <Common.h>
+#include <User.h>
+#include <list>
+
+namespace CollabVM {
+
+	struct UserList {
+
+		template<class Function>
+		inline void AddUser(std::shared_ptr<User> user, Function fun) {
+			std::lock_guard<std::mutex> l(lock);
+			bool duplicate = false;
+
+			ForEach([&](auto it) {
+				if (user == *it) {
+					// duplicate user will be added if this goes through
+					duplicate = true;
+					return false;
+				}
+
+				return true;
+			});
+
+			// return if this will cause a duplicate user
+			if(duplicate)
+				return;
+
+			// insert user
+			users.push_back(user);
+			users.sort();
+			connected_users++;
+
+			fun(user);
+		}
+
+		inline bool AddUser(std::shared_ptr<User> user) {
+			std::lock_guard<std::mutex> l(lock);
+			bool duplicate = false;
+
+			ForEach([&](auto it) {
+				if (user == *it) {
+					// duplicate user will be added if this goes through
+					duplicate = true;
+					return false;
+				}
+
+				return true;
+			});
+
+			// return if this will cause a duplicate user to be added
+			if(duplicate)
+				return false;
+
+			// insert user
+			users.push_back(user);
+			users.sort();
+			connected_users++;
+
+			return true;
+		}
+
+		
+		template<class Function>
+		inline void RemoveUser(std::shared_ptr<User> user, Function fun) {
+			std::lock_guard<std::mutex> l(lock);
+
+			ForEach([&](auto it) {
+
+				if (user == *it) {
+					// remove if found
+					(*it).reset();
+					users.erase(it);
+					connected_users--;
+
+					fun();
+					return false;
+				}
+
+				// not found yet
+				return true;
+			});
+		}		
+
+		inline void RemoveUser(std::shared_ptr<User> user) {
+			std::lock_guard<std::mutex> l(lock);
+
+			ForEach([&](auto it) {
+
+				if (user == *it) {
+					// remove if found
+					(*it).reset();
+					users.erase(it);
+					connected_users--;
+
+					return false;
+				}
+
+				// not found yet
+				return true;
+			});
+		}
+	
+		// signature: bool(iterator_type)
+		// return false if you want to stop iterating
+		template<class Function>
+		inline void ForEach(Function callback) {
+			if(users.size() == 0)
+				return;
+
+			// iterate through list stopping if user callback returns false
+			for(auto it = users.begin(); it != users.end(); ++it)
+				if(!callback(it))
+					break;
+		}		
+		
+		// version that acquires users lock
+		// signature: bool(iterator_type)
+		// return false if you want to stop iterating
+		template<class Function>
+		inline void ForEachLock(Function callback) {
+			std::lock_guard<std::mutex> l(lock);
+			ForEach(callback);
+		}
+
+		// Send a shared message to every user in this list.
+		// The message is serialized once by the caller, and
+		// every session only keeps a reference to it.
+		inline void Broadcast(WebsocketServer::shared_message_type message) {
+			ForEachLock([&](auto it) {
+				if((*it)->handle)
+					(*it)->handle->Send(message);
+
+				return true;
+			});
+		}
+
+	private:
+
+		std::mutex lock;
+
+		std::list<std::shared_ptr<User>> users;
+
+		uint64 connected_users = 0;
+	};
+
 }
\ No newline at end of file
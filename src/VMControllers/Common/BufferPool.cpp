@@ -0,0 +1,71 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "BufferPool.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& HitsMetric = Metrics::Get("buffer_pool_hits_total");
+	static Metrics::Metric& MissesMetric = Metrics::Get("buffer_pool_misses_total");
+	static Metrics::Metric& PooledBytesMetric = Metrics::Get("buffer_pool_bytes");
+
+	BufferPool& BufferPool::Get() {
+		static BufferPool pool;
+		return pool;
+	}
+
+	OutputBuffer BufferPool::Acquire(std::size_t capacity) {
+		OutputBuffer buffer;
+
+		{
+			std::lock_guard<std::mutex> l(lock);
+
+			// Prefer the smallest buffer that is big enough,
+			// otherwise take the biggest one and grow it.
+			auto best = buffers.end();
+			for(auto it = buffers.begin(); it != buffers.end(); ++it) {
+				if(best == buffers.end()) {
+					best = it;
+					continue;
+				}
+
+				const bool fits = it->capacity() >= capacity;
+				const bool bestFits = best->capacity() >= capacity;
+
+				if((fits && (!bestFits || it->capacity() < best->capacity())) || (!fits && !bestFits && it->capacity() > best->capacity()))
+					best = it;
+			}
+
+			if(best != buffers.end()) {
+				buffer = std::move(*best);
+				buffers.erase(best);
+				pooled_bytes -= buffer.capacity();
+				PooledBytesMetric.Set(pooled_bytes);
+			}
+		}
+
+		if(buffer.capacity() >= capacity)
+			HitsMetric.Add();
+		else
+			MissesMetric.Add();
+
+		buffer.clear();
+		buffer.reserve(capacity);
+		return buffer;
+	}
+
+	void BufferPool::Release(OutputBuffer&& buffer) {
+		if(buffer.capacity() == 0)
+			return;
+
+		std::lock_guard<std::mutex> l(lock);
+
+		// Let the buffer be freed if the pool is full
+		if(buffers.size() >= MaxBuffers || pooled_bytes + buffer.capacity() > MaxBytes)
+			return;
+
+		pooled_bytes += buffer.capacity();
+		buffers.push_back(std::move(buffer));
+		PooledBytesMetric.Set(pooled_bytes);
+	}
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <Common.h>
+
+namespace CollabVM {
+
+	// Allocator which default-initializes elements instead of value-initializing them,
+	// so resize() doesn't zero bytes an encoder is about to write over anyway.
+	template<class T>
+	struct DefaultInitAllocator : public std::allocator<T> {
+		template<class U>
+		struct rebind {
+			typedef DefaultInitAllocator<U> other;
+		};
+
+		DefaultInitAllocator() noexcept = default;
+
+		template<class U>
+		DefaultInitAllocator(const DefaultInitAllocator<U>&) noexcept {
+
+		}
+
+		template<class U>
+		void construct(U* p) {
+			::new((void*)p) U;
+		}
+
+		template<class U, class... Args>
+		void construct(U* p, Args&&... args) {
+			::new((void*)p) U(std::forward<Args>(args)...);
+		}
+	};
+
+	// Byte buffer encoders write their output into.
+	// Encoders size it to the most they could write, then trim it to what they wrote.
+	typedef std::vector<byte, DefaultInitAllocator<byte>> OutputBuffer;
+
+	// Pool of reusable byte buffers for encoded output.
+	//
+	// Encoded regions live until every session has finished sending them,
+	// so their buffers are returned here afterwards, instead of being freed and
+	// allocated again for the next region.
+	struct BufferPool {
+
+		// Most buffers the pool will hold on to
+		constexpr static std::size_t MaxBuffers = 64;
+
+		// Most bytes of capacity the pool will hold on to
+		constexpr static std::size_t MaxBytes = 32 * 1024 * 1024;
+
+		// Get the process-wide buffer pool.
+		static BufferPool& Get();
+
+		// Get an empty buffer with at least the given capacity.
+		OutputBuffer Acquire(std::size_t capacity);
+
+		// Give a buffer back to the pool.
+		void Release(OutputBuffer&& buffer);
+
+	private:
+		std::mutex lock;
+
+		// Locked by lock
+		std::vector<OutputBuffer> buffers;
+		std::size_t pooled_bytes = 0;
+	};
+
+	// Tracks recent output sizes of an encoder,
+	// to guess how much capacity the next output will need.
+	struct SizeEstimator {
+
+		inline void Record(std::size_t size) {
+			// exponential moving average, weighing the newest size 1/4
+			average = average == 0 ? size : (average * 3 + size) / 4;
+		}
+
+		// Estimate with some headroom, so most outputs fit without growing.
+		inline std::size_t Estimate() const {
+			return std::max<std::size_t>(average + average / 4, 4096);
+		}
+
+	private:
+		std::size_t average = 0;
+	};
+
+}
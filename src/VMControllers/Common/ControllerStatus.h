@@ -1,12 +1,12 @@
-#include <Common.h>
-
-namespace CollabVM {
-
-	enum class ControllerStatus : byte {
-		Stopped,
-		Starting,
-		Started,
-		Resetting
-	};
-
+#include <Common.h>
+
+namespace CollabVM {
+
+	enum class ControllerStatus : byte {
+		Stopped,
+		Starting,
+		Started,
+		Resetting
+	};
+
 }
\ No newline at end of file
@@ -0,0 +1,157 @@
+#include <Common.h>
+#include "DamageRegion.h"
+
+namespace CollabVM {
+
+	void DamageRegion::Resize(uint16 width, uint16 height) {
+		this->width = width;
+		this->height = height;
+		rects.clear();
+	}
+
+	void DamageRegion::Add(int x, int y, int width, int height) {
+		// clip to the surface
+		const int left = std::max(x, 0);
+		const int top = std::max(y, 0);
+		const int right = std::min(x + width, (int)this->width);
+		const int bottom = std::min(y + height, (int)this->height);
+
+		if(right <= left || bottom <= top)
+			return;
+
+		rects.push_back({ (uint16)left, (uint16)top, (uint16)(right - left), (uint16)(bottom - top) });
+
+		// Damage can pile up for a while between frames,
+		// so keep the pending list from growing without bound.
+		if(rects.size() >= MaxPendingRects) {
+			std::vector<Rect> merged;
+			MergeTiles(merged);
+			rects.swap(merged);
+		}
+	}
+
+	void DamageRegion::AddAll() {
+		rects.clear();
+		Add(0, 0, width, height);
+	}
+
+	void DamageRegion::Copy(const CopyRect& move) {
+		const Rect source = move.Source();
+		const int dx = (int)move.dest.x - move.src_x;
+		const int dy = (int)move.dest.y - move.src_y;
+
+		// Adding may coalesce rects, so collect what to add first
+		std::vector<Rect> moved;
+
+		for(auto& rect : rects) {
+			const Rect overlap = rect.Intersect(source);
+
+			if(overlap.Area())
+				moved.push_back(overlap);
+		}
+
+		for(auto& rect : moved)
+			Add(rect.x + dx, rect.y + dy, rect.width, rect.height);
+	}
+
+	std::vector<Rect> DamageRegion::Flush() {
+		std::vector<Rect> out;
+
+		if(rects.empty())
+			return out;
+
+		if(rects.size() > MaxHeuristicRects)
+			MergeTiles(out);
+		else
+			MergeHeuristic(out);
+
+		rects.clear();
+		return out;
+	}
+
+	void DamageRegion::MergeHeuristic(std::vector<Rect>& out) {
+		out = rects;
+
+		// Greedily merge any pair of regions where sending the union
+		// is cheaper than sending both regions on their own,
+		// until there are no such pairs left.
+		bool merged = true;
+		while(merged) {
+			merged = false;
+
+			for(std::size_t i = 0; i < out.size() && !merged; ++i) {
+				for(std::size_t j = i + 1; j < out.size(); ++j) {
+					const Rect both = out[i].Union(out[j]);
+
+					// Overlapping pixels are counted twice here,
+					// so overlapping regions are always merged.
+					if(both.Area() <= out[i].Area() + out[j].Area() + RegionOverhead) {
+						out[i] = both;
+						out.erase(out.begin() + j);
+						merged = true;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	void DamageRegion::MergeTiles(std::vector<Rect>& out) {
+		const uint32 tilesX = (width + TileSize - 1) / TileSize;
+		const uint32 tilesY = (height + TileSize - 1) / TileSize;
+
+		tiles.assign(tilesX * tilesY, 0);
+
+		// mark every tile touched by damage
+		for(auto& rect : rects) {
+			const uint32 tx1 = (rect.Right() - 1) / TileSize;
+			const uint32 ty1 = (rect.Bottom() - 1) / TileSize;
+
+			for(uint32 ty = rect.y / TileSize; ty <= ty1; ++ty)
+				for(uint32 tx = rect.x / TileSize; tx <= tx1; ++tx)
+					tiles[ty * tilesX + tx] = 1;
+		}
+
+		// Turn each row of tiles into horizontal spans,
+		// then grow each span down while the rows below have the exact same span.
+		for(uint32 ty = 0; ty < tilesY; ++ty) {
+			uint32 tx = 0;
+			while(tx < tilesX) {
+				if(!tiles[ty * tilesX + tx]) {
+					tx++;
+					continue;
+				}
+
+				uint32 spanEnd = tx;
+				while(spanEnd < tilesX && tiles[ty * tilesX + spanEnd])
+					spanEnd++;
+
+				auto SpanMatches = [&](uint32 row) {
+					for(uint32 i = tx; i < spanEnd; ++i)
+						if(!tiles[row * tilesX + i])
+							return false;
+
+					// the span must end at the same tile on this row too
+					return spanEnd == tilesX || !tiles[row * tilesX + spanEnd];
+				};
+
+				uint32 rowEnd = ty + 1;
+				while(rowEnd < tilesY && (tx == 0 || !tiles[rowEnd * tilesX + tx - 1]) && SpanMatches(rowEnd)) {
+					// clear the rows we absorb so they don't become spans of their own
+					for(uint32 i = tx; i < spanEnd; ++i)
+						tiles[rowEnd * tilesX + i] = 0;
+					rowEnd++;
+				}
+
+				const uint32 left = tx * TileSize;
+				const uint32 top = ty * TileSize;
+				const uint32 right = std::min<uint32>(spanEnd * TileSize, width);
+				const uint32 bottom = std::min<uint32>(rowEnd * TileSize, height);
+
+				out.push_back({ (uint16)left, (uint16)top, (uint16)(right - left), (uint16)(bottom - top) });
+				tx = spanEnd;
+			}
+		}
+	}
+
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <Common.h>
+
+namespace CollabVM {
+
+	// A rectangle, in surface pixels.
+	struct Rect {
+		uint16 x;
+		uint16 y;
+		uint16 width;
+		uint16 height;
+
+		inline uint32 Area() const {
+			return width * height;
+		}
+
+		inline uint32 Right() const {
+			return x + width;
+		}
+
+		inline uint32 Bottom() const {
+			return y + height;
+		}
+
+		// Returns the smallest rectangle containing both this rectangle and other.
+		inline Rect Union(const Rect& other) const {
+			const uint32 left = std::min(x, other.x);
+			const uint32 top = std::min(y, other.y);
+			const uint32 right = std::max(Right(), other.Right());
+			const uint32 bottom = std::max(Bottom(), other.Bottom());
+			return { (uint16)left, (uint16)top, (uint16)(right - left), (uint16)(bottom - top) };
+		}
+
+		// Returns the overlap of this rectangle and other.
+		// The result has no area if they don't overlap.
+		inline Rect Intersect(const Rect& other) const {
+			const uint32 left = std::max(x, other.x);
+			const uint32 top = std::max(y, other.y);
+			const uint32 right = std::min(Right(), other.Right());
+			const uint32 bottom = std::min(Bottom(), other.Bottom());
+
+			if(right <= left || bottom <= top)
+				return { (uint16)left, (uint16)top, 0, 0 };
+
+			return { (uint16)left, (uint16)top, (uint16)(right - left), (uint16)(bottom - top) };
+		}
+	};
+
+	// A rectangle of pixels moved to another place on the surface,
+	// e.g by scrolling or dragging a window.
+	struct CopyRect {
+		// Where the pixels end up
+		Rect dest;
+
+		// Where the pixels came from
+		uint16 src_x;
+		uint16 src_y;
+
+		inline Rect Source() const {
+			return { src_x, src_y, dest.width, dest.height };
+		}
+	};
+
+	// Accumulates the damage rectangles of a framebuffer update,
+	// and coalesces them into a small set of regions once the update is finished.
+	//
+	// A small amount of rectangles is merged with a cost heuristic,
+	// which keeps the encoded area tight.
+	// If there are too many rectangles for that to be cheap, the damage
+	// is instead rounded out to a tile grid and merged into spans of tiles.
+	struct DamageRegion {
+
+		// Size of a grid tile, in pixels.
+		constexpr static uint16 TileSize = 64;
+
+		// Estimated fixed cost of sending one region
+		// (encoder setup, headers, a WebSocket frame), in pixels.
+		// Two regions are merged if the pixels it adds are cheaper than this.
+		constexpr static uint32 RegionOverhead = 4096;
+
+		// Above this many rectangles, coalesce on the tile grid instead.
+		constexpr static std::size_t MaxHeuristicRects = 64;
+
+		// Once this many rectangles are pending, they're coalesced on the tile grid right away.
+		constexpr static std::size_t MaxPendingRects = 1024;
+
+		// Set the size of the surface that damage is tracked for.
+		// Any pending damage is discarded.
+		void Resize(uint16 width, uint16 height);
+
+		// Add damage. The rectangle is clipped to the surface.
+		void Add(int x, int y, int width, int height);
+
+		// Mark the whole surface as damaged.
+		void AddAll();
+
+		// Carry pending damage along with moved pixels.
+		// Damage within the source of the move is added at the destination as well,
+		// since whoever applies the move copies pixels which haven't been sent yet.
+		void Copy(const CopyRect& move);
+
+		inline bool Empty() const {
+			return rects.empty();
+		}
+
+		// Coalesce the pending damage into a set of regions and clear it.
+		std::vector<Rect> Flush();
+
+	private:
+
+		void MergeHeuristic(std::vector<Rect>& out);
+
+		void MergeTiles(std::vector<Rect>& out);
+
+		uint16 width = 0;
+		uint16 height = 0;
+
+		// Pending damage rectangles, already clipped.
+		std::vector<Rect> rects;
+
+		// Tile grid scratch space (kept around to avoid reallocating it every update)
+		std::vector<byte> tiles;
+	};
+
+}
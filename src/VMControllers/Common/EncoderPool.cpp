@@ -0,0 +1,181 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "EncoderPool.h"
+#include "VNCClient.h"
+
+namespace CollabVM {
+
+	// Metrics
+	static Metrics::Metric& QueueDepthMetric = Metrics::Get("encoder_queue_depth");
+	static Metrics::Metric& QueueHighWaterMetric = Metrics::Get("encoder_queue_high_water");
+	static Metrics::Metric& ThreadsMetric = Metrics::Get("encoder_threads");
+	static Metrics::Metric& JobsMetric = Metrics::Get("encoder_jobs_total");
+	static Metrics::Metric& QueueWaitMetric = Metrics::Get("encoder_queue_wait_us_total");
+	static Metrics::Metric& EncodeTimeMetric = Metrics::Get("encoder_encode_us_total");
+
+	void EncodeStream::Complete(uint64 sequence, std::vector<std::shared_ptr<VNCRegion>>&& regions) {
+		{
+			std::lock_guard<std::mutex> l(lock);
+			finished[sequence] = std::move(regions);
+
+			// Whoever is delivering will get to this result
+			if(delivering)
+				return;
+
+			delivering = true;
+		}
+
+		// Delivering sends to every viewer, so it happens outside of the lock,
+		// where it doesn't hold up the other encoder threads finishing jobs of this stream.
+		// Only this thread delivers until it's done, so results still go out in order.
+		while(true) {
+			ready.clear();
+
+			{
+				std::lock_guard<std::mutex> l(lock);
+
+				auto it = finished.begin();
+				while(it != finished.end() && it->first == next_delivery) {
+					// Jobs which failed to encode still take up a sequence number
+					for(auto& region : it->second)
+						if(region)
+							ready.push_back(std::move(region));
+
+					it = finished.erase(it);
+					next_delivery++;
+				}
+
+				if(ready.empty()) {
+					delivering = false;
+					return;
+				}
+			}
+
+			for(auto& result : ready)
+				if(deliver)
+					deliver(result);
+		}
+	}
+
+	EncoderPool& EncoderPool::Get() {
+		static EncoderPool pool;
+		return pool;
+	}
+
+	EncoderPool::~EncoderPool() {
+		Stop();
+	}
+
+	void EncoderPool::Start(std::size_t thread_count, std::size_t max_queue) {
+		std::lock_guard<std::mutex> l(lock);
+
+		if(!threads.empty())
+			return;
+
+		this->max_queue = std::max<std::size_t>(max_queue, 1);
+		stopping = false;
+
+		for(std::size_t i = 0; i < thread_count; ++i)
+			threads.emplace_back(&EncoderPool::WorkerThread, this);
+
+		ThreadsMetric.Set(thread_count);
+		logger.info("Started ", thread_count, " encoder threads (max queue depth ", this->max_queue, ")");
+	}
+
+	void EncoderPool::Stop() {
+		{
+			std::lock_guard<std::mutex> l(lock);
+			stopping = true;
+		}
+
+		JobReady.notify_all();
+		SpaceReady.notify_all();
+
+		for(auto& thread : threads)
+			if(thread.joinable())
+				thread.join();
+
+		threads.clear();
+		ThreadsMetric.Set(0);
+	}
+
+	void EncoderPool::Submit(std::shared_ptr<EncodeStream> stream, job_type job) {
+		if(!job)
+			return;
+
+		SubmitBatch(stream, [job = std::move(job)](std::vector<std::shared_ptr<VNCRegion>>& regions) {
+			regions.push_back(job());
+		});
+	}
+
+	void EncoderPool::SubmitBatch(std::shared_ptr<EncodeStream> stream, batch_job_type job) {
+		if(!stream || !job)
+			return;
+
+		Job newJob { stream, stream->Reserve(), job, std::chrono::steady_clock::now() };
+
+		{
+			std::unique_lock<std::mutex> l(lock);
+
+			if(!threads.empty() && !stopping) {
+				// Block the submitting thread while the queue is full.
+				// This pushes back on the VNC client instead of growing without bound.
+				SpaceReady.wait(l, [&]() { return jobs.size() < max_queue || stopping; });
+
+				if(!stopping) {
+					jobs.push_back(std::move(newJob));
+					QueueDepthMetric.Set(jobs.size());
+					QueueHighWaterMetric.Max(jobs.size());
+					JobReady.notify_one();
+					return;
+				}
+			}
+		}
+
+		// No threads to run the job on
+		Run(newJob);
+	}
+
+	std::size_t EncoderPool::QueueDepth() {
+		std::lock_guard<std::mutex> l(lock);
+		return jobs.size();
+	}
+
+	void EncoderPool::WorkerThread() {
+		while(true) {
+			Job job;
+
+			{
+				std::unique_lock<std::mutex> l(lock);
+				JobReady.wait(l, [&]() { return !jobs.empty() || stopping; });
+
+				if(jobs.empty())
+					break; // stopping, and nothing left to do
+
+				job = std::move(jobs.front());
+				jobs.pop_front();
+				QueueDepthMetric.Set(jobs.size());
+			}
+
+			SpaceReady.notify_one();
+			Run(job);
+		}
+	}
+
+	void EncoderPool::Run(Job& job) {
+		using namespace std::chrono;
+
+		std::vector<std::shared_ptr<VNCRegion>> regions;
+
+		auto start = steady_clock::now();
+		job.encode(regions);
+		auto end = steady_clock::now();
+
+		JobsMetric.Add();
+		QueueWaitMetric.Add(duration_cast<microseconds>(start - job.queued).count());
+		EncodeTimeMetric.Add(duration_cast<microseconds>(end - start).count());
+
+		job.stream->Complete(job.sequence, std::move(regions));
+	}
+
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <Common.h>
+#include <Logger.h>
+#include <condition_variable>
+
+namespace CollabVM {
+
+	struct VNCRegion;
+
+	// An ordered stream of encoded regions.
+	//
+	// Jobs submitted to the EncoderPool on the same stream may finish in any order,
+	// but their results are always delivered in submission order.
+	// Each VNC client owns one of these.
+	struct EncodeStream {
+		typedef std::function<void(std::shared_ptr<VNCRegion>)> deliver_type;
+
+		inline EncodeStream(deliver_type deliver)
+			: deliver(deliver) {
+
+		}
+
+	private:
+		friend struct EncoderPool;
+
+		// Reserve the next sequence number.
+		// Only called by the thread submitting jobs.
+		inline uint64 Reserve() {
+			return next_sequence++;
+		}
+
+		// Record the regions a job produced, delivering them and any
+		// buffered results that are now next in line.
+		// Results are delivered outside of the lock, by one thread at a time;
+		// if another thread is already delivering, it picks up this result too.
+		void Complete(uint64 sequence, std::vector<std::shared_ptr<VNCRegion>>&& regions);
+
+		deliver_type deliver;
+
+		uint64 next_sequence = 0;
+
+		std::mutex lock;
+
+		// Next sequence number to deliver, results that finished early,
+		// and whether a thread is delivering right now.
+		// Locked by lock.
+		uint64 next_delivery = 0;
+		std::map<uint64, std::vector<std::shared_ptr<VNCRegion>>> finished;
+		bool delivering = false;
+
+		// Results taken out of finished to be delivered.
+		// Only touched by the thread delivering.
+		std::vector<std::shared_ptr<VNCRegion>> ready;
+	};
+
+	// A bounded, process-wide pool of threads encoding regions
+	// for every VNC client, so slow encodes don't stall reading from the VNC server.
+	struct EncoderPool {
+		typedef std::function<std::shared_ptr<VNCRegion>()> job_type;
+
+		// A job which may produce any amount of regions, added to the given vector.
+		// They're delivered one after another, in the order they were added.
+		typedef std::function<void(std::vector<std::shared_ptr<VNCRegion>>&)> batch_job_type;
+
+		// Get the process-wide encoder pool.
+		static EncoderPool& Get();
+
+		~EncoderPool();
+
+		// Start the worker threads.
+		// max_queue bounds how many jobs may be waiting;
+		// Submit() blocks once the queue is full.
+		void Start(std::size_t threads, std::size_t max_queue);
+
+		void Stop();
+
+		// Submit a job for a stream.
+		// If the pool isn't running, the job is encoded on the calling thread.
+		void Submit(std::shared_ptr<EncodeStream> stream, job_type job);
+
+		// Submit a job producing several regions for a stream.
+		void SubmitBatch(std::shared_ptr<EncodeStream> stream, batch_job_type job);
+
+		// Amount of jobs waiting for a thread.
+		std::size_t QueueDepth();
+
+	private:
+
+		struct Job {
+			std::shared_ptr<EncodeStream> stream;
+			uint64 sequence;
+			batch_job_type encode;
+			std::chrono::steady_clock::time_point queued;
+		};
+
+		void WorkerThread();
+
+		void Run(Job& job);
+
+		std::vector<std::thread> threads;
+
+		std::mutex lock;
+
+		// Signalled when a job is queued or the pool stops
+		std::condition_variable JobReady;
+
+		// Signalled when a job is taken off the queue
+		std::condition_variable SpaceReady;
+
+		// Locked by lock
+		std::deque<Job> jobs;
+		std::size_t max_queue = 0;
+		bool stopping = false;
+
+		Logger logger = Logger::GetLogger("EncoderPool");
+	};
+
+}
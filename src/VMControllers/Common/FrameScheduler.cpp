@@ -0,0 +1,46 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "FrameScheduler.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& TicksMetric = Metrics::Get("frame_ticks_total");
+
+	void FrameScheduler::OnInput() {
+		last_input.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+	}
+
+	uint16 FrameScheduler::CurrentFps(std::chrono::steady_clock::time_point now) const {
+		if(!watched)
+			return IdleFps;
+
+		auto input = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(last_input.load(std::memory_order_relaxed)));
+
+		if(now - input < InputBoost)
+			return max_fps;
+
+		return std::max<uint16>(max_fps / 2, 1);
+	}
+
+	bool FrameScheduler::TickDue(std::chrono::steady_clock::time_point now) {
+		if(UntilNextTick(now).count() > 0)
+			return false;
+
+		last_tick = now;
+		TicksMetric.Add();
+		return true;
+	}
+
+	std::chrono::microseconds FrameScheduler::UntilNextTick(std::chrono::steady_clock::time_point now) const {
+		using namespace std::chrono;
+
+		auto interval = microseconds(1000000 / CurrentFps(now));
+		auto elapsed = duration_cast<microseconds>(now - last_tick);
+
+		if(elapsed >= interval)
+			return microseconds(0);
+
+		return interval - elapsed;
+	}
+
+}
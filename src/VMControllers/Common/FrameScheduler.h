@@ -0,0 +1,56 @@
+#pragma once
+#include <Common.h>
+#include <atomic>
+
+namespace CollabVM {
+
+	// Paces how often a VNC client sends frames.
+	//
+	// Damage is gathered between ticks, and only encoded when a tick comes around,
+	// so a guest producing hundreds of updates per second still costs a bounded
+	// amount of encoding. The tick rate adapts to what's going on:
+	//
+	// - Right after user input, ticks run at the maximum rate, so interaction feels responsive.
+	// - Otherwise, ticks run at half the maximum rate.
+	// - With nobody watching, ticks run at IdleFps.
+	struct FrameScheduler {
+
+		// Tick rate when nobody is watching
+		constexpr static uint16 IdleFps = 1;
+
+		// How long after input ticks run at the maximum rate
+		constexpr static std::chrono::milliseconds InputBoost = std::chrono::milliseconds(1000);
+
+		inline void SetMaxFps(uint16 fps) {
+			max_fps = std::max<uint16>(fps, 1);
+		}
+
+		inline void SetWatched(bool watched) {
+			this->watched = watched;
+		}
+
+		// Note that a user just sent input.
+		// Safe to call from any thread.
+		void OnInput();
+
+		// Current tick rate.
+		uint16 CurrentFps(std::chrono::steady_clock::time_point now) const;
+
+		// Returns true (and starts the next tick interval) if a tick is due.
+		bool TickDue(std::chrono::steady_clock::time_point now);
+
+		// Time left until the next tick is due.
+		std::chrono::microseconds UntilNextTick(std::chrono::steady_clock::time_point now) const;
+
+	private:
+
+		uint16 max_fps = 30;
+		bool watched = false;
+
+		std::chrono::steady_clock::time_point last_tick;
+
+		// Time of the last input, as steady_clock ticks since its epoch
+		std::atomic<std::chrono::steady_clock::rep> last_input { 0 };
+	};
+
+}
@@ -0,0 +1,123 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "FrameSnapshots.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& SnapshotBytesCopiedMetric = Metrics::Get("snapshot_bytes_copied_total");
+	static Metrics::Metric& SnapshotsBusyMetric = Metrics::Get("snapshots_busy_total");
+
+	void FrameSnapshots::Resize(Surface& desktop) {
+		snapshots.clear();
+		latest.reset();
+
+		tilesX = (desktop.Width() + TileSize - 1) / TileSize;
+		tilesY = (desktop.Height() + TileSize - 1) / TileSize;
+
+		// Every tile is newer than a new snapshot
+		generation = 1;
+		tiles.assign(tilesX * tilesY, generation);
+	}
+
+	void FrameSnapshots::Damage(int x, int y, int width, int height) {
+		const int right = std::min<int>(x + width, tilesX * TileSize);
+		const int bottom = std::min<int>(y + height, tilesY * TileSize);
+		x = std::max(x, 0);
+		y = std::max(y, 0);
+
+		if(right <= x || bottom <= y)
+			return;
+
+		generation++;
+
+		for(uint32 ty = y / TileSize; ty <= (uint32)(bottom - 1) / TileSize; ++ty)
+			for(uint32 tx = x / TileSize; tx <= (uint32)(right - 1) / TileSize; ++tx)
+				tiles[ty * tilesX + tx] = generation;
+	}
+
+	std::shared_ptr<Surface> FrameSnapshots::Take(Surface& desktop) {
+		if(!desktop.Valid())
+			return nullptr;
+
+		// Snapshots are only read from once taken,
+		// so an up to date one can be shared no matter who holds it
+		if(latest && snapshots[*latest].generation == generation)
+			return snapshots[*latest].surface;
+
+		// Reuse the freshest snapshot nobody holds, since it has the least to copy.
+		// We're the only thread handing out references, so a count of 1 can't go up behind our back.
+		std::optional<std::size_t> free;
+
+		for(std::size_t i = 0; i < snapshots.size(); ++i) {
+			if(snapshots[i].surface.use_count() != 1)
+				continue;
+
+			if(!free || snapshots[i].generation > snapshots[*free].generation)
+				free = i;
+		}
+
+		if(!free) {
+			if(snapshots.size() == MaxSnapshots) {
+				SnapshotsBusyMetric.Add();
+				return nullptr;
+			}
+
+			auto surface = std::make_shared<Surface>(desktop.Width(), desktop.Height(), desktop.Format());
+
+			if(!surface->Valid())
+				return nullptr;
+
+			snapshots.push_back({ surface, 0 });
+			free = snapshots.size() - 1;
+		}
+
+		Sync(desktop, snapshots[*free]);
+		latest = free;
+		return snapshots[*free].surface;
+	}
+
+	std::size_t FrameSnapshots::Bytes() const {
+		std::size_t bytes = 0;
+
+		for(auto& snapshot : snapshots)
+			bytes += snapshot.surface->Capacity();
+
+		return bytes;
+	}
+
+	void FrameSnapshots::Sync(Surface& desktop, Snapshot& snapshot) {
+		auto& surface = *snapshot.surface;
+		const uint32 bpp = BytesPerPixel(desktop.Format());
+
+		for(uint32 ty = 0; ty < tilesY; ++ty) {
+			uint32 tx = 0;
+
+			while(tx < tilesX) {
+				if(tiles[ty * tilesX + tx] <= snapshot.generation) {
+					tx++;
+					continue;
+				}
+
+				// Copy runs of changed tiles a row at a time
+				uint32 end = tx;
+				while(end < tilesX && tiles[ty * tilesX + end] > snapshot.generation)
+					end++;
+
+				const uint32 left = tx * TileSize;
+				const uint32 right = std::min<uint32>(end * TileSize, desktop.Width());
+				const uint32 top = ty * TileSize;
+				const uint32 bottom = std::min<uint32>(top + TileSize, desktop.Height());
+				const uint32 rowSize = (right - left) * bpp;
+
+				for(uint32 row = top; row < bottom; ++row)
+					memcpy(surface.Data() + row * surface.Stride() + left * bpp, desktop.Data() + row * desktop.Stride() + left * bpp, rowSize);
+
+				SnapshotBytesCopiedMetric.Add(rowSize * (bottom - top));
+				tx = end;
+			}
+		}
+
+		snapshot.generation = generation;
+	}
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <Common.h>
+#include "Surface.h"
+#include "DamageRegion.h"
+#include <optional>
+
+namespace CollabVM {
+
+	// Consistent copies of the desktop surface for encoders to read from.
+	//
+	// libvncclient writes into the desktop surface while encoders are still working
+	// on earlier frames, so encoders can't read it directly.
+	// Instead of copying the pixels of every job, a small ring of full-size snapshots is kept.
+	// Taking a snapshot reuses one no job holds anymore, and only copies the tiles
+	// which changed since that snapshot was last brought up to date.
+	//
+	// Snapshots are never written to while a job holds them,
+	// so every job sees exactly the frame it was submitted for.
+	// Only used by the VNC client thread.
+	struct FrameSnapshots {
+
+		constexpr static uint16 TileSize = DamageRegion::TileSize;
+
+		// Most snapshots kept (triple buffering)
+		constexpr static std::size_t MaxSnapshots = 3;
+
+		// Start over for a resized desktop surface.
+		// Snapshots jobs still hold stay alive until they finish.
+		void Resize(Surface& desktop);
+
+		// Record that pixels of the desktop surface changed.
+		void Damage(int x, int y, int width, int height);
+
+		// Get a snapshot of the desktop surface as it is now.
+		// Returns nullptr if every snapshot is still held by a job.
+		std::shared_ptr<Surface> Take(Surface& desktop);
+
+		// Bytes of memory the snapshots we keep take up.
+		std::size_t Bytes() const;
+
+	private:
+
+		struct Snapshot {
+			std::shared_ptr<Surface> surface;
+
+			// Generation the snapshot has every change up to
+			uint64 generation = 0;
+		};
+
+		// Copy the tiles of the desktop which changed since the snapshot was brought up to date.
+		void Sync(Surface& desktop, Snapshot& snapshot);
+
+		std::vector<Snapshot> snapshots;
+
+		// Generation of the last change to each tile
+		std::vector<uint64> tiles;
+		uint32 tilesX = 0;
+		uint32 tilesY = 0;
+
+		// Bumped by every change
+		uint64 generation = 1;
+
+		// Index of the snapshot most recently brought up to date, if any
+		std::optional<std::size_t> latest;
+	};
+
+}
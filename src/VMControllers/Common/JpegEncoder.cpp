@@ -0,0 +1,144 @@
+#include <Common.h>
+#include "JpegEncoder.h"
+#include "PixelKernels.h"
+
+namespace CollabVM {
+
+	JpegEncoder::JpegEncoder() {
+		cinfo.err = jpeg_std_error(&error.base);
+		error.base.error_exit = &JpegEncoder::OnError;
+		jpeg_create_compress(&cinfo);
+
+		destination.base.init_destination = &JpegEncoder::InitDestination;
+		destination.base.empty_output_buffer = &JpegEncoder::EmptyOutputBuffer;
+		destination.base.term_destination = &JpegEncoder::TermDestination;
+		destination.output = nullptr;
+		cinfo.dest = &destination.base;
+	}
+
+	JpegEncoder::~JpegEncoder() {
+		jpeg_destroy_compress(&cinfo);
+	}
+
+	void JpegEncoder::OnError(j_common_ptr cinfo) {
+		auto err = (ErrorManager*)cinfo->err;
+		std::longjmp(err->jump, 1);
+	}
+
+	void JpegEncoder::InitDestination(j_compress_ptr cinfo) {
+		auto dest = (Destination*)cinfo->dest;
+		auto& output = *dest->output;
+
+		// Use all of the buffer's capacity; whatever it held before is thrown away.
+		// OutputBuffer doesn't zero what it grows by, so this costs nothing.
+		output.resize(std::max<std::size_t>(output.capacity(), 4096));
+		dest->base.next_output_byte = output.data();
+		dest->base.free_in_buffer = output.size();
+	}
+
+	boolean JpegEncoder::EmptyOutputBuffer(j_compress_ptr cinfo) {
+		auto dest = (Destination*)cinfo->dest;
+		auto& output = *dest->output;
+
+		// libjpeg only calls this once the whole buffer is full
+		const std::size_t used = output.size();
+		output.resize(used * 2);
+		dest->base.next_output_byte = output.data() + used;
+		dest->base.free_in_buffer = output.size() - used;
+		return TRUE;
+	}
+
+	void JpegEncoder::TermDestination(j_compress_ptr cinfo) {
+		auto dest = (Destination*)cinfo->dest;
+		auto& output = *dest->output;
+
+		// trim to what was actually written (this never reallocates)
+		output.resize(output.size() - dest->base.free_in_buffer);
+	}
+
+	void JpegEncoder::ConvertRow(const byte* src, uint16 width, SurfaceFormat format) {
+		byte* dst = row.data();
+
+#ifdef JCS_EXTENSIONS
+		// Only RGB565 needs converting, to BGRX
+		PixelKernels::RGB565ToXRGB(src, dst, width);
+#else
+		// Plain libjpeg only takes packed RGB.
+		// RGB565 is widened first, then packed within the same row.
+		if(format == SurfaceFormat::BPP16) {
+			PixelKernels::RGB565ToXRGB(src, dst, width);
+			src = dst;
+		}
+
+		PixelKernels::XRGBToRGB24(src, dst, width);
+#endif
+	}
+
+	bool JpegEncoder::Encode(Surface& surface, int quality, OutputBuffer& output) {
+		if(!surface.Valid())
+			return false;
+
+#ifdef JCS_EXTENSIONS
+		const bool direct = surface.Format() != SurfaceFormat::BPP16;
+#else
+		// plain libjpeg only takes packed RGB, so everything gets converted
+		const bool direct = false;
+#endif
+
+		// Rows are widened to 32bpp before being packed, so they need room for that
+		if(!direct)
+			row.resize(surface.Width() * 4);
+
+		destination.output = &output;
+
+		if(setjmp(error.jump)) {
+			// libjpeg failed somewhere below; reset the compressor for the next encode
+			jpeg_abort_compress(&cinfo);
+			output.clear();
+			return false;
+		}
+
+		cinfo.image_width = surface.Width();
+		cinfo.image_height = surface.Height();
+
+#ifdef JCS_EXTENSIONS
+		// Cairo's RGB24/ARGB32 are native-endian 32bit words,
+		// which is BGRX in memory on little-endian machines.
+		// The alpha byte is ignored, like the cairo-jpg path did.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ || defined(_MSC_VER)
+		cinfo.in_color_space = JCS_EXT_BGRX;
+#else
+		cinfo.in_color_space = JCS_EXT_XRGB;
+#endif
+		cinfo.input_components = 4;
+#else
+		cinfo.in_color_space = JCS_RGB;
+		cinfo.input_components = 3;
+#endif
+
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, quality, TRUE);
+		jpeg_start_compress(&cinfo, TRUE);
+
+		const byte* data = surface.Data();
+		const uint32 stride = surface.Stride();
+
+		while(cinfo.next_scanline < cinfo.image_height) {
+			const byte* src = data + (cinfo.next_scanline * stride);
+			JSAMPROW rowPointer;
+
+			if(direct) {
+				rowPointer = (JSAMPROW)src;
+			} else {
+				ConvertRow(src, surface.Width(), surface.Format());
+				rowPointer = row.data();
+			}
+
+			jpeg_write_scanlines(&cinfo, &rowPointer, 1);
+		}
+
+		jpeg_finish_compress(&cinfo);
+		return true;
+	}
+
+}
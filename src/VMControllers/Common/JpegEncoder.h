@@ -0,0 +1,65 @@
+#pragma once
+#include <Common.h>
+#include "Surface.h"
+#include "BufferPool.h"
+
+// libjpeg needs FILE declared before it's included
+#include <cstdio>
+#include <csetjmp>
+#include <jpeglib.h>
+
+namespace CollabVM {
+
+	// JPEG encoder feeding libjpeg(-turbo) directly from surface memory.
+	//
+	// With libjpeg-turbo, 32bpp surfaces are compressed straight from their rows
+	// using the extended BGRX input colorspace, so there is no per-pixel conversion at all.
+	// Output goes into a caller-provided buffer, which is only grown if it turns out to be too small.
+	//
+	// The compressor is set up once and reused for every encode, so an encoder should be kept
+	// around per thread instead of being created per region.
+	struct JpegEncoder {
+
+		JpegEncoder();
+		~JpegEncoder();
+
+		JpegEncoder(const JpegEncoder&) = delete;
+		JpegEncoder& operator=(const JpegEncoder&) = delete;
+
+		// Encode a surface (or view) into output, replacing its contents.
+		// Returns false if the surface could not be encoded.
+		bool Encode(Surface& surface, int quality, OutputBuffer& output);
+
+	private:
+
+		// libjpeg error manager which jumps back into Encode()
+		// instead of calling exit().
+		struct ErrorManager {
+			jpeg_error_mgr base;
+			std::jmp_buf jump;
+		};
+
+		// libjpeg destination manager which writes into an OutputBuffer.
+		struct Destination {
+			jpeg_destination_mgr base;
+			OutputBuffer* output;
+		};
+
+		static void OnError(j_common_ptr cinfo);
+		static void InitDestination(j_compress_ptr cinfo);
+		static boolean EmptyOutputBuffer(j_compress_ptr cinfo);
+		static void TermDestination(j_compress_ptr cinfo);
+
+		// Convert one row of a surface which can't be compressed directly
+		// to the compressor's input format.
+		void ConvertRow(const byte* src, uint16 width, SurfaceFormat format);
+
+		jpeg_compress_struct cinfo;
+		ErrorManager error;
+		Destination destination;
+
+		// Scratch row for surfaces which can't be compressed directly
+		std::vector<byte> row;
+	};
+
+}
@@ -0,0 +1,114 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "KeyframeCache.h"
+#include "VNCClient.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& RequestsMetric = Metrics::Get("keyframe_requests_total");
+	static Metrics::Metric& StaleBlocksMetric = Metrics::Get("keyframe_stale_blocks_total");
+	static Metrics::Metric& BlocksEncodedMetric = Metrics::Get("keyframe_blocks_encoded_total");
+
+	void KeyframeCache::Resize(uint16 width, uint16 height) {
+		std::lock_guard<std::mutex> l(lock);
+
+		this->width = width;
+		blocksX = (width + BlockSize - 1) / BlockSize;
+		const uint32 blocksY = (height + BlockSize - 1) / BlockSize;
+
+		blocks.clear();
+		blocks.resize(blocksX * blocksY);
+
+		for(uint32 by = 0; by < blocksY; ++by) {
+			for(uint32 bx = 0; bx < blocksX; ++bx) {
+				auto& block = blocks[by * blocksX + bx];
+				block.rect.x = bx * BlockSize;
+				block.rect.y = by * BlockSize;
+				block.rect.width = std::min<uint32>(BlockSize, width - block.rect.x);
+				block.rect.height = std::min<uint32>(BlockSize, height - block.rect.y);
+			}
+		}
+
+		last_damage = std::chrono::steady_clock::now();
+	}
+
+	void KeyframeCache::Invalidate(const Rect& rect) {
+		std::lock_guard<std::mutex> l(lock);
+
+		if(blocks.empty() || rect.width == 0 || rect.height == 0)
+			return;
+
+		const uint32 blocksY = blocks.size() / blocksX;
+		const uint32 bx1 = std::min<uint32>((rect.Right() - 1) / BlockSize, blocksX - 1);
+		const uint32 by1 = std::min<uint32>((rect.Bottom() - 1) / BlockSize, blocksY - 1);
+
+		for(uint32 by = rect.y / BlockSize; by <= by1; ++by)
+			for(uint32 bx = rect.x / BlockSize; bx <= bx1; ++bx)
+				blocks[by * blocksX + bx].generation++;
+
+		last_damage = std::chrono::steady_clock::now();
+	}
+
+	std::vector<KeyframeCache::StaleBlock> KeyframeCache::TakeStale() {
+		std::vector<StaleBlock> stale;
+		std::lock_guard<std::mutex> l(lock);
+
+		// Don't chase a screen that keeps changing
+		if(std::chrono::steady_clock::now() - last_damage < QuietTime)
+			return stale;
+
+		for(auto& block : blocks) {
+			if(block.Fresh() || block.submitted_generation == block.generation)
+				continue;
+
+			block.submitted_generation = block.generation;
+			stale.push_back({ block.rect, block.generation });
+		}
+
+		return stale;
+	}
+
+	void KeyframeCache::Store(std::shared_ptr<VNCRegion> region) {
+		std::lock_guard<std::mutex> l(lock);
+
+		if(blocks.empty() || region->x % BlockSize || region->y % BlockSize)
+			return;
+
+		const uint32 index = (region->y / BlockSize) * blocksX + (region->x / BlockSize);
+
+		if(index >= blocks.size())
+			return;
+
+		auto& block = blocks[index];
+
+		// Damaged again while it was being encoded
+		if(region->keyframe_generation != block.generation)
+			return;
+
+		block.region = region;
+		block.encoded_generation = region->keyframe_generation;
+		BlocksEncodedMetric.Add();
+	}
+
+	std::vector<std::shared_ptr<VNCRegion>> KeyframeCache::Get(std::vector<Rect>& stale) {
+		std::vector<std::shared_ptr<VNCRegion>> keyframe;
+		std::lock_guard<std::mutex> l(lock);
+
+		keyframe.reserve(blocks.size());
+
+		for(auto& block : blocks) {
+			// A stale block is still mostly right, so it's sent anyway
+			if(block.region)
+				keyframe.push_back(block.region);
+
+			if(!block.Fresh()) {
+				StaleBlocksMetric.Add();
+				stale.push_back(block.rect);
+			}
+		}
+
+		RequestsMetric.Add();
+		return keyframe;
+	}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <Common.h>
+#include "DamageRegion.h"
+
+namespace CollabVM {
+
+	struct VNCRegion;
+
+	// Cache of the encoded full screen ("keyframe") of a VNC client,
+	// used to give joining users the whole screen without encoding it for each of them.
+	//
+	// The screen is split into blocks. Damage marks the blocks it touches as stale,
+	// and stale blocks are encoded again once the screen has been quiet for a while.
+	// Nobody ever waits for the cache: a screen that keeps changing may never be quiet.
+	struct KeyframeCache {
+		// Size of a keyframe block, in pixels
+		constexpr static uint16 BlockSize = 256;
+
+		// How long the screen has to go without damage before stale blocks are refreshed
+		constexpr static std::chrono::milliseconds QuietTime = std::chrono::milliseconds(500);
+
+		// A block which needs to be encoded.
+		struct StaleBlock {
+			Rect rect;
+
+			// Pass back to Store() through VNCRegion::keyframe_generation
+			uint64 generation;
+		};
+
+		// Set the size of the screen. Everything cached is thrown away.
+		void Resize(uint16 width, uint16 height);
+
+		// Mark the blocks a damaged rectangle touches as stale.
+		void Invalidate(const Rect& rect);
+
+		// Take the blocks that should be encoded now.
+		// These won't be returned again until they're damaged again.
+		std::vector<StaleBlock> TakeStale();
+
+		// Store an encoded block.
+		void Store(std::shared_ptr<VNCRegion> region);
+
+		// Get the keyframe as it is cached right now, stale blocks included.
+		// The blocks which are stale or were never encoded are added to stale,
+		// so they can be sent again as ordinary damage after the keyframe.
+		std::vector<std::shared_ptr<VNCRegion>> Get(std::vector<Rect>& stale);
+
+	private:
+
+		struct Block {
+			Rect rect;
+
+			std::shared_ptr<VNCRegion> region;
+
+			// Bumped every time the block is damaged
+			uint64 generation = 0;
+
+			// Generation region was encoded from, and the last generation submitted for encoding
+			uint64 encoded_generation = ~0ull;
+			uint64 submitted_generation = ~0ull;
+
+			inline bool Fresh() const {
+				return region && encoded_generation == generation;
+			}
+		};
+
+		std::mutex lock;
+
+		// Locked by lock
+		uint16 width = 0;
+		uint16 blocksX = 0;
+		std::vector<Block> blocks;
+		std::chrono::steady_clock::time_point last_damage;
+	};
+
+}
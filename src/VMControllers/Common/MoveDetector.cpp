@@ -0,0 +1,197 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "MoveDetector.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& MovesDetectedMetric = Metrics::Get("moves_detected_total");
+
+	void MovePixels(byte* data, uint32 stride, uint32 bpp, const CopyRect& move) {
+		const uint32 rowSize = move.dest.width * bpp;
+
+		auto MoveRow = [&](uint32 row) {
+			memmove(data + (move.dest.y + row) * stride + move.dest.x * bpp, data + (move.src_y + row) * stride + move.src_x * bpp, rowSize);
+		};
+
+		// Copy rows in the order that doesn't overwrite source rows before they're read
+		if(move.dest.y > move.src_y) {
+			for(uint32 row = move.dest.height; row-- > 0;)
+				MoveRow(row);
+		} else {
+			for(uint32 row = 0; row < move.dest.height; ++row)
+				MoveRow(row);
+		}
+	}
+
+	inline uint64 HashMix(uint64 hash, uint64 value) {
+		hash ^= value;
+		hash *= 0x9E3779B97F4A7C15ull;
+		return hash ^ (hash >> 29);
+	}
+
+	// Hash a row of pixels, 8 bytes at a time
+	inline uint64 HashRow(const byte* row, uint32 size) {
+		uint64 hash = size;
+		uint32 i = 0;
+
+		for(; i + sizeof(uint64) <= size; i += sizeof(uint64)) {
+			uint64 value;
+			memcpy(&value, row + i, sizeof(value));
+			hash = HashMix(hash, value);
+		}
+
+		for(; i < size; ++i)
+			hash = HashMix(hash, row[i]);
+
+		return hash;
+	}
+
+	// Hash every row of an area
+	static void HashRows(const byte* pixels, uint32 stride, uint32 bpp, const Rect& area, std::vector<uint64>& hashes) {
+		hashes.resize(area.height);
+
+		for(uint32 row = 0; row < area.height; ++row)
+			hashes[row] = HashRow(pixels + (area.y + row) * stride + area.x * bpp, area.width * bpp);
+	}
+
+	// Hash every column of an area.
+	// Rows are walked in order, so memory is still read front to back.
+	static void HashColumns(const byte* pixels, uint32 stride, uint32 bpp, const Rect& area, std::vector<uint64>& hashes) {
+		hashes.assign(area.width, area.height);
+
+		for(uint32 row = 0; row < area.height; ++row) {
+			const byte* src = pixels + (area.y + row) * stride + area.x * bpp;
+
+			for(uint32 column = 0; column < area.width; ++column) {
+				uint32 pixel = 0;
+				memcpy(&pixel, src + column * bpp, bpp);
+				hashes[column] = HashMix(hashes[column], pixel);
+			}
+		}
+	}
+
+	bool MoveDetector::FindShift(Shift& shift) {
+		const int32 count = (int32)hashesAfter.size();
+
+		// Index the old lines. Lines which show up more than once
+		// (blank space, mostly) can't tell us where anything moved to.
+		constexpr int32 Ambiguous = -1;
+
+		lines.clear();
+		for(int32 i = 0; i < count; ++i) {
+			auto [it, inserted] = lines.try_emplace(hashesBefore[i], i);
+			if(!inserted)
+				it->second = Ambiguous;
+		}
+
+		// Every changed line which was somewhere else before votes for that offset
+		votes.clear();
+		for(int32 i = 0; i < count; ++i) {
+			if(hashesAfter[i] == hashesBefore[i])
+				continue;
+
+			auto it = lines.find(hashesAfter[i]);
+			if(it == lines.end() || it->second == Ambiguous)
+				continue;
+
+			votes[it->second - i]++;
+		}
+
+		int32 offset = 0;
+		uint32 best = 0;
+		for(auto [candidate, amount] : votes) {
+			if(amount > best) {
+				best = amount;
+				offset = candidate;
+			}
+		}
+
+		if(best == 0)
+			return false;
+
+		// Find the longest run of lines matching at that offset
+		shift = { 0, 0, offset };
+
+		const int32 first = std::max(0, -offset);
+		const int32 last = std::min(count, count - offset);
+
+		for(int32 i = first; i < last;) {
+			if(hashesAfter[i] != hashesBefore[i + offset]) {
+				++i;
+				continue;
+			}
+
+			int32 end = i;
+			while(end < last && hashesAfter[end] == hashesBefore[end + offset])
+				end++;
+
+			if((uint32)(end - i) > shift.length)
+				shift = { (uint32)i, (uint32)(end - i), offset };
+
+			i = end;
+		}
+
+		if(shift.length < MinLines)
+			return false;
+
+		// Moving lines which are the same in place anyway saves nothing
+		uint32 changed = 0;
+		for(uint32 i = shift.start; i < shift.start + shift.length; ++i)
+			if(hashesAfter[i] != hashesBefore[i])
+				changed++;
+
+		return changed >= MinLines;
+	}
+
+	bool MoveDetector::Detect(const byte* before, const byte* after, uint32 stride, uint32 bpp, const Rect& area, CopyRect& move) {
+		if(area.width < MinSize || area.height < MinSize)
+			return false;
+
+		Shift shift;
+
+		// Vertical moves (scrolling) are by far the most common, so try those first
+		HashRows(before, stride, bpp, area, hashesBefore);
+		HashRows(after, stride, bpp, area, hashesAfter);
+
+		if(FindShift(shift)) {
+			// Hashes can collide, so make sure the rows really match
+			for(uint32 row = shift.start; row < shift.start + shift.length; ++row) {
+				const byte* a = after + (area.y + row) * stride + area.x * bpp;
+				const byte* b = before + (area.y + row + shift.offset) * stride + area.x * bpp;
+
+				if(memcmp(a, b, area.width * bpp) != 0)
+					return false;
+			}
+
+			move.dest = { area.x, (uint16)(area.y + shift.start), area.width, (uint16)shift.length };
+			move.src_x = area.x;
+			move.src_y = (uint16)(area.y + shift.start + shift.offset);
+			MovesDetectedMetric.Add();
+			return true;
+		}
+
+		HashColumns(before, stride, bpp, area, hashesBefore);
+		HashColumns(after, stride, bpp, area, hashesAfter);
+
+		if(FindShift(shift)) {
+			const uint32 rowSize = shift.length * bpp;
+
+			for(uint32 row = 0; row < area.height; ++row) {
+				const byte* a = after + (area.y + row) * stride + (area.x + shift.start) * bpp;
+				const byte* b = before + (area.y + row) * stride + (area.x + shift.start + shift.offset) * bpp;
+
+				if(memcmp(a, b, rowSize) != 0)
+					return false;
+			}
+
+			move.dest = { (uint16)(area.x + shift.start), area.y, (uint16)shift.length, area.height };
+			move.src_x = (uint16)(area.x + shift.start + shift.offset);
+			move.src_y = area.y;
+			MovesDetectedMetric.Add();
+			return true;
+		}
+
+		return false;
+	}
+
+}
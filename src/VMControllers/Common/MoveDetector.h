@@ -0,0 +1,52 @@
+#pragma once
+#include <Common.h>
+#include "DamageRegion.h"
+#include <unordered_map>
+
+namespace CollabVM {
+
+	// Move a rectangle of pixels within a buffer. The source and destination may overlap.
+	void MovePixels(byte* data, uint32 stride, uint32 bpp, const CopyRect& move);
+
+	// Finds blocks of pixels which moved between two versions of a surface,
+	// so scrolling can be sent as a copy instead of being encoded again.
+	//
+	// Each row (or column) of a damaged area is hashed in both versions.
+	// Rows of the new version are looked up among the rows of the old one,
+	// and the offset most of them agree on is checked for a long run of matching rows.
+	struct MoveDetector {
+
+		// Areas smaller than this on either side aren't worth checking
+		constexpr static uint16 MinSize = 64;
+
+		// Least amount of rows (or columns) a move has to cover
+		constexpr static uint32 MinLines = 32;
+
+		// Look for a vertical or horizontal move within area.
+		// before and after point at the first pixel of the old and new surface, which share a layout.
+		// Returns true and fills in move if one was found.
+		bool Detect(const byte* before, const byte* after, uint32 stride, uint32 bpp, const Rect& area, CopyRect& move);
+
+	private:
+
+		// A run of lines where after[start + i] == before[start + i + offset]
+		struct Shift {
+			uint32 start;
+			uint32 length;
+			int32 offset;
+		};
+
+		// Find the longest run of lines shifted by the most agreed on offset.
+		bool FindShift(Shift& shift);
+
+		// Line hashes of the old and new surface.
+		// Kept around to avoid reallocating them every update
+		std::vector<uint64> hashesBefore;
+		std::vector<uint64> hashesAfter;
+
+		// Scratch space for FindShift()
+		std::unordered_map<uint64, int32> lines;
+		std::unordered_map<int32, uint32> votes;
+	};
+
+}
@@ -0,0 +1,372 @@
+#include <Common.h>
+#include "PixelKernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COLLABVM_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang need SIMD functions beyond the baseline marked,
+// so the rest of the server doesn't have to be built for AVX2.
+#if defined(COLLABVM_X86) && (defined(__GNUC__) || defined(__clang__))
+#define COLLABVM_TARGET(isa) __attribute__((target(isa)))
+#else
+#define COLLABVM_TARGET(isa)
+#endif
+
+namespace CollabVM::PixelKernels {
+
+	// Scalar kernels.
+	// These define what the results are; the SIMD kernels must match them.
+
+	inline uint32 Expand565(uint16 pixel) {
+		const uint32 r = (pixel >> 11) & 0x1f;
+		const uint32 g = (pixel >> 5) & 0x3f;
+		const uint32 b = pixel & 0x1f;
+		return 0xff000000 | (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+	}
+
+	static void RGB565ToXRGBScalar(const byte* src, byte* dst, uint32 start, uint32 width) {
+		for(uint32 i = start; i < width; ++i) {
+			uint16 pixel;
+			memcpy(&pixel, src + i * 2, sizeof(pixel));
+
+			const uint32 out = Expand565(pixel);
+			memcpy(dst + i * 4, &out, sizeof(out));
+		}
+	}
+
+	static void XRGBToRGB24Scalar(const byte* src, byte* dst, uint32 start, uint32 width) {
+		for(uint32 i = start; i < width; ++i) {
+			uint32 pixel;
+			memcpy(&pixel, src + i * 4, sizeof(pixel));
+
+			dst[i * 3] = (byte)(pixel >> 16);
+			dst[i * 3 + 1] = (byte)(pixel >> 8);
+			dst[i * 3 + 2] = (byte)pixel;
+		}
+	}
+
+	inline byte Average(byte a, byte b) {
+		return (byte)((a + b + 1) >> 1);
+	}
+
+	static void Downscale2xScalar(const byte* src, uint32 srcStride, byte* dst, uint32 dstStride, uint32 start, uint32 width, uint32 height) {
+		for(uint32 y = 0; y < height; ++y) {
+			const byte* top = src + (y * 2) * srcStride;
+			const byte* bottom = top + srcStride;
+			byte* out = dst + y * dstStride;
+
+			for(uint32 x = start; x < width; ++x)
+				for(uint32 c = 0; c < 4; ++c)
+					out[x * 4 + c] = Average(Average(top[x * 8 + c], top[x * 8 + 4 + c]), Average(bottom[x * 8 + c], bottom[x * 8 + 4 + c]));
+		}
+	}
+
+#ifdef COLLABVM_X86
+
+	// SSE2 is part of x86-64, but 32bit x86 CPUs may not have it,
+	// so it's detected and marked like the rest.
+
+	COLLABVM_TARGET("sse2")
+	static void RGB565ToXRGBSSE2(const byte* src, byte* dst, uint32 width) {
+		const __m128i mask5 = _mm_set1_epi16(0x1f);
+		const __m128i mask6 = _mm_set1_epi16(0x3f);
+		const __m128i alpha = _mm_set1_epi16((short)0xff00);
+		uint32 i = 0;
+
+		for(; i + 8 <= width; i += 8) {
+			const __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i * 2));
+
+			__m128i r = _mm_and_si128(_mm_srli_epi16(pixels, 11), mask5);
+			__m128i g = _mm_and_si128(_mm_srli_epi16(pixels, 5), mask6);
+			__m128i b = _mm_and_si128(pixels, mask5);
+
+			r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+			g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+			b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+			// Low halves are B | G << 8, high halves R | X << 8,
+			// so interleaving them gives B, G, R, X bytes
+			const __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+			const __m128i rx = _mm_or_si128(r, alpha);
+
+			_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_unpacklo_epi16(bg, rx));
+			_mm_storeu_si128((__m128i*)(dst + i * 4 + 16), _mm_unpackhi_epi16(bg, rx));
+		}
+
+		RGB565ToXRGBScalar(src, dst, i, width);
+	}
+
+	COLLABVM_TARGET("avx2")
+	static void RGB565ToXRGBAVX2(const byte* src, byte* dst, uint32 width) {
+		const __m256i mask5 = _mm256_set1_epi16(0x1f);
+		const __m256i mask6 = _mm256_set1_epi16(0x3f);
+		const __m256i alpha = _mm256_set1_epi16((short)0xff00);
+		uint32 i = 0;
+
+		for(; i + 16 <= width; i += 16) {
+			const __m256i pixels = _mm256_loadu_si256((const __m256i*)(src + i * 2));
+
+			__m256i r = _mm256_and_si256(_mm256_srli_epi16(pixels, 11), mask5);
+			__m256i g = _mm256_and_si256(_mm256_srli_epi16(pixels, 5), mask6);
+			__m256i b = _mm256_and_si256(pixels, mask5);
+
+			r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+			g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+			b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+
+			const __m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+			const __m256i rx = _mm256_or_si256(r, alpha);
+
+			// Unpacking works within 128bit lanes, giving pixels 0-3, 8-11 and 4-7, 12-15
+			const __m256i low = _mm256_unpacklo_epi16(bg, rx);
+			const __m256i high = _mm256_unpackhi_epi16(bg, rx);
+
+			_mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_permute2x128_si256(low, high, 0x20));
+			_mm256_storeu_si256((__m256i*)(dst + i * 4 + 32), _mm256_permute2x128_si256(low, high, 0x31));
+		}
+
+		RGB565ToXRGBScalar(src, dst, i, width);
+	}
+
+	// Byte shuffle taking 4 XRGB pixels (B, G, R, X in memory) to 12 bytes of R, G, B
+	#define COLLABVM_RGB24_SHUFFLE 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+	// Shuffling bytes needs SSSE3, which every CPU with AVX2 has too.
+	// Each iteration stores 16 bytes of which 12 are used,
+	// so it stops while 6 pixels (18 bytes) are still left for the scalar loop.
+	COLLABVM_TARGET("ssse3")
+	static void XRGBToRGB24SSSE3(const byte* src, byte* dst, uint32 width) {
+		const __m128i shuffle = _mm_setr_epi8(COLLABVM_RGB24_SHUFFLE);
+		uint32 i = 0;
+
+		for(; i + 6 <= width; i += 4) {
+			const __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i * 4));
+			_mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(pixels, shuffle));
+		}
+
+		XRGBToRGB24Scalar(src, dst, i, width);
+	}
+
+	COLLABVM_TARGET("avx2")
+	static void XRGBToRGB24AVX2(const byte* src, byte* dst, uint32 width) {
+		const __m256i shuffle = _mm256_setr_epi8(COLLABVM_RGB24_SHUFFLE, COLLABVM_RGB24_SHUFFLE);
+		uint32 i = 0;
+
+		for(; i + 10 <= width; i += 8) {
+			const __m256i pixels = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i * 4)), shuffle);
+			_mm_storeu_si128((__m128i*)(dst + i * 3), _mm256_castsi256_si128(pixels));
+			_mm_storeu_si128((__m128i*)(dst + i * 3 + 12), _mm256_extracti128_si256(pixels, 1));
+		}
+
+		XRGBToRGB24Scalar(src, dst, i, width);
+	}
+
+	#undef COLLABVM_RGB24_SHUFFLE
+
+	COLLABVM_TARGET("sse2")
+	static void Downscale2xSSE2(const byte* src, uint32 srcStride, byte* dst, uint32 dstStride, uint32 width, uint32 height) {
+		const uint32 vectorWidth = width & ~3u;
+
+		for(uint32 y = 0; y < height; ++y) {
+			const byte* top = src + (y * 2) * srcStride;
+			const byte* bottom = top + srcStride;
+			byte* out = dst + y * dstStride;
+
+			for(uint32 x = 0; x < vectorWidth; x += 4) {
+				const __m128 t0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(top + x * 8)));
+				const __m128 t1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(top + x * 8 + 16)));
+				const __m128 b0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(bottom + x * 8)));
+				const __m128 b1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(bottom + x * 8 + 16)));
+
+				// Split each row into its even and odd pixels, and average those
+				const __m128i topAverage = _mm_avg_epu8(
+					_mm_castps_si128(_mm_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 2, 0))),
+					_mm_castps_si128(_mm_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 1, 3, 1))));
+
+				const __m128i bottomAverage = _mm_avg_epu8(
+					_mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0))),
+					_mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1))));
+
+				_mm_storeu_si128((__m128i*)(out + x * 4), _mm_avg_epu8(topAverage, bottomAverage));
+			}
+		}
+
+		Downscale2xScalar(src, srcStride, dst, dstStride, vectorWidth, width, height);
+	}
+
+	// Shuffling works within 128bit lanes; this puts the 64bit quarters back in order
+	COLLABVM_TARGET("avx2")
+	static inline __m256i Fix(__m256 v) {
+		return _mm256_permute4x64_epi64(_mm256_castps_si256(v), _MM_SHUFFLE(3, 1, 2, 0));
+	}
+
+	COLLABVM_TARGET("avx2")
+	static void Downscale2xAVX2(const byte* src, uint32 srcStride, byte* dst, uint32 dstStride, uint32 width, uint32 height) {
+		const uint32 vectorWidth = width & ~7u;
+
+		for(uint32 y = 0; y < height; ++y) {
+			const byte* top = src + (y * 2) * srcStride;
+			const byte* bottom = top + srcStride;
+			byte* out = dst + y * dstStride;
+
+			for(uint32 x = 0; x < vectorWidth; x += 8) {
+				const __m256 t0 = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)(top + x * 8)));
+				const __m256 t1 = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)(top + x * 8 + 32)));
+				const __m256 b0 = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)(bottom + x * 8)));
+				const __m256 b1 = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)(bottom + x * 8 + 32)));
+
+				const __m256i topAverage = _mm256_avg_epu8(
+					Fix(_mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 2, 0))),
+					Fix(_mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 1, 3, 1))));
+
+				const __m256i bottomAverage = _mm256_avg_epu8(
+					Fix(_mm256_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0))),
+					Fix(_mm256_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1))));
+
+				_mm256_storeu_si256((__m256i*)(out + x * 4), _mm256_avg_epu8(topAverage, bottomAverage));
+			}
+		}
+
+		Downscale2xScalar(src, srcStride, dst, dstStride, vectorWidth, width, height);
+	}
+
+	static InstructionSet DetectInstructionSet() {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+
+		const int maxLeaf = info[0];
+
+		__cpuid(info, 1);
+		const bool sse2 = (info[3] & (1 << 26)) != 0;
+		const bool ssse3 = (info[2] & (1 << 9)) != 0;
+
+		// The OS has to save the AVX registers too
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+
+		if(maxLeaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+			__cpuidex(info, 7, 0);
+
+			if(info[1] & (1 << 5))
+				return InstructionSet::AVX2;
+		}
+
+		if(ssse3)
+			return InstructionSet::SSSE3;
+
+		return sse2 ? InstructionSet::SSE2 : InstructionSet::Scalar;
+#else
+		__builtin_cpu_init();
+
+		if(__builtin_cpu_supports("avx2"))
+			return InstructionSet::AVX2;
+
+		if(__builtin_cpu_supports("ssse3"))
+			return InstructionSet::SSSE3;
+
+		if(__builtin_cpu_supports("sse2"))
+			return InstructionSet::SSE2;
+
+		return InstructionSet::Scalar;
+#endif
+	}
+
+#endif
+
+	static const Kernels ScalarKernels {
+		[](const byte* src, byte* dst, uint32 width) {
+			RGB565ToXRGBScalar(src, dst, 0, width);
+		},
+
+		[](const byte* src, byte* dst, uint32 width) {
+			XRGBToRGB24Scalar(src, dst, 0, width);
+		},
+
+		[](const byte* src, uint32 srcStride, byte* dst, uint32 dstStride, uint32 width, uint32 height) {
+			Downscale2xScalar(src, srcStride, dst, dstStride, 0, width, height);
+		}
+	};
+
+#ifdef COLLABVM_X86
+	// RGB24 output needs SSSE3's byte shuffle, so SSE2 alone keeps the scalar version of it
+	static const Kernels SSE2Kernels { RGB565ToXRGBSSE2, ScalarKernels.XRGBToRGB24, Downscale2xSSE2 };
+	static const Kernels SSSE3Kernels { RGB565ToXRGBSSE2, XRGBToRGB24SSSE3, Downscale2xSSE2 };
+	static const Kernels AVX2Kernels { RGB565ToXRGBAVX2, XRGBToRGB24AVX2, Downscale2xAVX2 };
+#endif
+
+	// The kernels picked for this CPU
+	struct Dispatch {
+		InstructionSet isa = InstructionSet::Scalar;
+		const Kernels* kernels = &ScalarKernels;
+
+		Dispatch() {
+#ifdef COLLABVM_X86
+			isa = DetectInstructionSet();
+
+			if(isa >= InstructionSet::AVX2)
+				kernels = &AVX2Kernels;
+			else if(isa >= InstructionSet::SSSE3)
+				kernels = &SSSE3Kernels;
+			else if(isa >= InstructionSet::SSE2)
+				kernels = &SSE2Kernels;
+#endif
+		}
+	};
+
+	// Picked on first use instead of during static initialization,
+	// since surfaces can be created from static initializers in other files.
+	static const Dispatch& GetDispatch() {
+		static Dispatch dispatch;
+		return dispatch;
+	}
+
+	InstructionSet Active() {
+		return GetDispatch().isa;
+	}
+
+	const Kernels* GetKernels(InstructionSet isa) {
+		// Kernels of an instruction set the CPU has are always picked over the ones before it
+		if(isa > GetDispatch().isa)
+			return nullptr;
+
+		switch(isa) {
+#ifdef COLLABVM_X86
+			case InstructionSet::SSE2: return &SSE2Kernels;
+			case InstructionSet::SSSE3: return &SSSE3Kernels;
+			case InstructionSet::AVX2: return &AVX2Kernels;
+#endif
+			case InstructionSet::Scalar:
+			default:
+				return &ScalarKernels;
+		}
+	}
+
+	const char* GetName(InstructionSet isa) {
+		switch(isa) {
+			case InstructionSet::SSE2: return "SSE2";
+			case InstructionSet::SSSE3: return "SSSE3";
+			case InstructionSet::AVX2: return "AVX2";
+			case InstructionSet::Scalar:
+			default:
+				return "scalar";
+		}
+	}
+
+	void RGB565ToXRGB(const byte* src, byte* dst, uint32 width) {
+		GetDispatch().kernels->RGB565ToXRGB(src, dst, width);
+	}
+
+	void XRGBToRGB24(const byte* src, byte* dst, uint32 width) {
+		GetDispatch().kernels->XRGBToRGB24(src, dst, width);
+	}
+
+	void Downscale2x(const byte* src, uint32 srcStride, byte* dst, uint32 dstStride, uint32 width, uint32 height) {
+		GetDispatch().kernels->Downscale2x(src, srcStride, dst, dstStride, width, height);
+	}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <Common.h>
+
+namespace CollabVM::PixelKernels {
+
+	// Pixel conversion and scaling kernels used by surfaces, snapshots and encoders.
+	//
+	// Every kernel has a scalar version, and SIMD versions picked at runtime
+	// by what the CPU supports. The SIMD versions give bit-exact the same results.
+	//
+	// "XRGB" pixels are native-endian 32bit words (0xXXRRGGBB), which is how Cairo stores
+	// RGB24/ARGB32 surfaces. 5 and 6 bit channels are widened by bit replication.
+
+	enum class InstructionSet : byte {
+		Scalar,
+
+		// SSE2 kernels, except for RGB24 output
+		SSE2,
+
+		// SSE2 kernels, plus an SSSE3 byte shuffle for RGB24 output
+		SSSE3,
+
+		AVX2
+	};
+
+	// The instruction set the kernels are using.
+	InstructionSet Active();
+
+	// The kernels of one instruction set.
+	struct Kernels {
+		void(*RGB565ToXRGB)(const byte* src, byte* dst, uint32 width);
+		void(*XRGBToRGB24)(const byte* src, byte* dst, uint32 width);
+		void(*Downscale2x)(const byte* src, uint32 srcStride, byte* dst, uint32 dstStride, uint32 width, uint32 height);
+	};
+
+	// Get the kernels of an instruction set, even if they aren't the active ones (so tests can compare them),
+	// or nullptr if this build or the CPU doesn't support the instruction set.
+	const Kernels* GetKernels(InstructionSet isa);
+
+	// Get a printable name for an instruction set.
+	const char* GetName(InstructionSet isa);
+
+	// Convert a row of RGB565 pixels to XRGB, with X set to 0xff.
+	void RGB565ToXRGB(const byte* src, byte* dst, uint32 width);
+
+	// Convert a row of XRGB pixels to packed R, G, B bytes.
+	// src and dst may be the same buffer.
+	void XRGBToRGB24(const byte* src, byte* dst, uint32 width);
+
+	// Halve a rectangle of XRGB pixels in both directions, averaging each 2x2 block.
+	// Each channel is averaged horizontally, then vertically, rounding up both times.
+	// dst is width x height pixels; src has to have twice as many in both directions.
+	void Downscale2x(const byte* src, uint32 srcStride, byte* dst, uint32 dstStride, uint32 width, uint32 height);
+
+}
@@ -1,9 +1,9 @@
-#include <Common.h>
-#include "QEMUAudio.h"
-
-
-namespace CollabVM {
-
-
-
+#include <Common.h>
+#include "QEMUAudio.h"
+
+
+namespace CollabVM {
+
+
+
 }
\ No newline at end of file
@@ -1,9 +1,9 @@
-#include <Common.h>
-#include <rfb/rfbclient.h>
-
-namespace CollabVM {
-#if 0
-	// QEMU audio protocol extension.
-	extern rfbClientProtocolExtension QEMUAudioExtension;
-#endif
+#include <Common.h>
+#include <rfb/rfbclient.h>
+
+namespace CollabVM {
+#if 0
+	// QEMU audio protocol extension.
+	extern rfbClientProtocolExtension QEMUAudioExtension;
+#endif
 }
\ No newline at end of file
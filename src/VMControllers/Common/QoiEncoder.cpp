@@ -0,0 +1,129 @@
+#include <Common.h>
+#include "QoiEncoder.h"
+
+namespace CollabVM {
+
+	constexpr byte QoiOpIndex = 0x00;
+	constexpr byte QoiOpDiff = 0x40;
+	constexpr byte QoiOpLuma = 0x80;
+	constexpr byte QoiOpRun = 0xc0;
+	constexpr byte QoiOpRgb = 0xfe;
+
+	constexpr uint32 QoiHeaderSize = 14;
+	constexpr byte QoiEnd[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+	// Longest run one RUN chunk can hold
+	constexpr uint32 QoiMaxRun = 62;
+
+	inline byte* WriteU32BE(byte* out, uint32 value) {
+		out[0] = (byte)(value >> 24);
+		out[1] = (byte)(value >> 16);
+		out[2] = (byte)(value >> 8);
+		out[3] = (byte)value;
+		return out + 4;
+	}
+
+	// The encoding loop, specialized per surface format
+	// so reading a pixel doesn't branch on the format.
+	template<SurfaceFormat Format>
+	static byte* EncodeQoiPixels(Surface& surface, byte* out) {
+		constexpr uint32 bpp = BytesPerPixel(Format);
+
+		// Pixels are kept as 0xRRGGBB; alpha is always 255.
+		// The decoder's array starts out transparent, which none of our pixels can match,
+		// so empty slots get a value no 0xRRGGBB pixel has either.
+		constexpr uint32 Alpha = 255;
+		constexpr uint32 EmptySlot = 0xff000000;
+
+		uint32 index[64];
+		std::fill(std::begin(index), std::end(index), EmptySlot);
+		uint32 previous = 0;
+		uint32 run = 0;
+
+		for(uint32 y = 0; y < surface.Height(); ++y) {
+			const byte* src = surface.Data() + y * surface.Stride();
+
+			for(uint32 x = 0; x < surface.Width(); ++x, src += bpp) {
+				const uint32 pixel = ReadRGB(src, Format);
+
+				if(pixel == previous) {
+					if(++run == QoiMaxRun) {
+						*out++ = QoiOpRun | (run - 1);
+						run = 0;
+					}
+					continue;
+				}
+
+				if(run) {
+					*out++ = QoiOpRun | (run - 1);
+					run = 0;
+				}
+
+				const byte r = (byte)(pixel >> 16);
+				const byte g = (byte)(pixel >> 8);
+				const byte b = (byte)pixel;
+				const uint32 slot = (r * 3 + g * 5 + b * 7 + Alpha * 11) % 64;
+
+				if(index[slot] == pixel) {
+					*out++ = QoiOpIndex | slot;
+				} else {
+					index[slot] = pixel;
+
+					const sbyte vr = (sbyte)(r - (byte)(previous >> 16));
+					const sbyte vg = (sbyte)(g - (byte)(previous >> 8));
+					const sbyte vb = (sbyte)(b - (byte)previous);
+					const sbyte vgr = vr - vg;
+					const sbyte vgb = vb - vg;
+
+					if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+						*out++ = QoiOpDiff | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2);
+					} else if(vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+						*out++ = QoiOpLuma | (vg + 32);
+						*out++ = ((vgr + 8) << 4) | (vgb + 8);
+					} else {
+						*out++ = QoiOpRgb;
+						*out++ = r;
+						*out++ = g;
+						*out++ = b;
+					}
+				}
+
+				previous = pixel;
+			}
+		}
+
+		if(run)
+			*out++ = QoiOpRun | (run - 1);
+
+		return out;
+	}
+
+	bool EncodeQoi(Surface& surface, OutputBuffer& output) {
+		if(!surface.Data() || !surface.Width() || !surface.Height())
+			return false;
+
+		// Worst case is an RGB chunk for every pixel
+		const std::size_t maxSize = QoiHeaderSize + (std::size_t)surface.Width() * surface.Height() * 4 + sizeof(QoiEnd);
+		output.resize(maxSize);
+
+		byte* out = output.data();
+
+		memcpy(out, "qoif", 4);
+		out = WriteU32BE(out + 4, surface.Width());
+		out = WriteU32BE(out, surface.Height());
+		*out++ = 3; // channels
+		*out++ = 0; // sRGB
+
+		if(surface.Format() == SurfaceFormat::BPP16)
+			out = EncodeQoiPixels<SurfaceFormat::BPP16>(surface, out);
+		else
+			out = EncodeQoiPixels<SurfaceFormat::BPP32>(surface, out);
+
+		memcpy(out, QoiEnd, sizeof(QoiEnd));
+		out += sizeof(QoiEnd);
+
+		output.resize(out - output.data());
+		return true;
+	}
+
+}
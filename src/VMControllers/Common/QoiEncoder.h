@@ -0,0 +1,35 @@
+#pragma once
+#include <Common.h>
+#include "Surface.h"
+#include "BufferPool.h"
+
+namespace CollabVM {
+
+	// Encode a surface (or view) as a QOI ("Quite OK Image") image into output,
+	// replacing its contents. Returns false if the surface could not be encoded.
+	//
+	// QOI is lossless and byte oriented, so it encodes in a single pass over the pixels
+	// with no entropy coding, which makes it several times faster than PNG
+	// while still compressing flat UI and text well.
+	//
+	// The output is a standard QOI file (https://qoiformat.org/qoi-specification.pdf),
+	// always with 3 channels and the sRGB colorspace, so any QOI decoder can read it.
+	// For clients implementing their own decoder:
+	//
+	// Header (14 bytes): magic "qoif", width and height (uint32 big-endian), channels (3), colorspace (0).
+	//
+	// The decoder keeps the previous pixel (starting at r=0 g=0 b=0 a=255),
+	// and an array of 64 previously seen pixels (all zero to start with).
+	// Every decoded pixel is stored in the array at (r * 3 + g * 5 + b * 7 + a * 11) % 64.
+	// Chunks follow the header until width * height pixels are decoded:
+	//
+	// 11111110 r g b   RGB:   the next pixel is r, g, b (alpha unchanged)
+	// 00iiiiii         INDEX: the next pixel is array[i]
+	// 01rrggbb         DIFF:  the next pixel is the previous one plus r-2, g-2, b-2 (wrapping around)
+	// 10gggggg rrrrbbbb LUMA: green changes by g-32, red by (g-32)+(r-8), blue by (g-32)+(b-8)
+	// 11rrrrrr         RUN:   the previous pixel repeats r+1 times (r is 0..61)
+	//
+	// The stream ends with seven 0x00 bytes and one 0x01 byte.
+	bool EncodeQoi(Surface& surface, OutputBuffer& output);
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <Common.h>
+
+namespace CollabVM {
+
+	// Quality tiers screen updates are encoded at.
+	//
+	// Every user is put into the tier their connection can keep up with,
+	// and each tier that has users in it is encoded exactly once,
+	// no matter how many users are in it.
+	enum class QualityTier : byte {
+		// Slow links: low JPEG quality, few updates per second
+		Low,
+
+		// Where every user starts
+		Medium,
+
+		// Fast, low latency links
+		High
+	};
+
+	constexpr std::size_t QualityTierCount = 3;
+
+	// Link statistics of a session, measured by the WebSocket server.
+	struct LinkStats {
+		// Smoothed throughput, in bytes per second.
+		// 0 if nothing has been measured yet.
+		uint64 bandwidth = 0;
+
+		// Smoothed round-trip time, in milliseconds.
+		// 0 if nothing has been measured yet.
+		uint32 rtt = 0;
+
+		// Bytes queued for sending which haven't been written yet.
+		uint64 queued_bytes = 0;
+	};
+
+	// Pick the tier a link with the given statistics can keep up with.
+	inline QualityTier SelectQualityTier(const LinkStats& stats) {
+		// Falling behind, or a slow or far away link
+		if(stats.queued_bytes > 512 * 1024
+			|| stats.rtt > 500
+			|| (stats.bandwidth != 0 && stats.bandwidth < 256 * 1024))
+			return QualityTier::Low;
+
+		// Nothing measured yet
+		if(stats.bandwidth == 0)
+			return QualityTier::Medium;
+
+		if(stats.bandwidth > 2 * 1024 * 1024
+			&& stats.rtt < 100
+			&& stats.queued_bytes < 64 * 1024)
+			return QualityTier::High;
+
+		return QualityTier::Medium;
+	}
+
+}
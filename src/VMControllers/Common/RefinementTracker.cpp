@@ -0,0 +1,110 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "RefinementTracker.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& RefinedTilesMetric = Metrics::Get("refined_tiles_total");
+
+	void RefinementTracker::Resize(uint16 width, uint16 height) {
+		this->width = width;
+		this->height = height;
+
+		tilesX = (width + TileSize - 1) / TileSize;
+		tilesY = (height + TileSize - 1) / TileSize;
+
+		tiles.assign(tilesX * tilesY, Tile {});
+		lossy = 0;
+	}
+
+	RefinementTracker::TileSpan RefinementTracker::Span(const Rect& rect, bool covered) const {
+		const uint32 right = std::min<uint32>(rect.Right(), width);
+		const uint32 bottom = std::min<uint32>(rect.Bottom(), height);
+
+		if(right <= rect.x || bottom <= rect.y)
+			return { 0, 0, 0, 0 };
+
+		if(!covered)
+			return { (uint32)rect.x / TileSize, (uint32)rect.y / TileSize, (right + TileSize - 1) / TileSize, (bottom + TileSize - 1) / TileSize };
+
+		// Tiles on the right and bottom edge of the surface are smaller,
+		// and count as covered when the rectangle reaches the edge
+		return {
+			(uint32)(rect.x + TileSize - 1) / TileSize,
+			(uint32)(rect.y + TileSize - 1) / TileSize,
+			right == width ? tilesX : right / TileSize,
+			bottom == height ? tilesY : bottom / TileSize
+		};
+	}
+
+	void RefinementTracker::Sent(const Rect& rect, bool lossless, std::chrono::steady_clock::time_point when) {
+		const auto span = Span(rect, lossless);
+
+		for(uint32 ty = span.y0; ty < span.y1; ++ty) {
+			for(uint32 tx = span.x0; tx < span.x1; ++tx) {
+				auto& tile = tiles[ty * tilesX + tx];
+
+				if(lossless) {
+					lossy -= tile.lossy;
+					tile.lossy = false;
+				} else {
+					lossy += !tile.lossy;
+					tile.lossy = true;
+					tile.sent = when;
+				}
+			}
+		}
+	}
+
+	void RefinementTracker::Copy(const CopyRect& move) {
+		// The moved pixels are as lossy as the worst tile they came from
+		const auto source = Span(move.Source(), false);
+
+		bool sourceLossy = false;
+		std::chrono::steady_clock::time_point sourceSent;
+
+		for(uint32 ty = source.y0; ty < source.y1; ++ty) {
+			for(uint32 tx = source.x0; tx < source.x1; ++tx) {
+				auto& tile = tiles[ty * tilesX + tx];
+
+				if(tile.lossy) {
+					sourceLossy = true;
+					sourceSent = std::max(sourceSent, tile.sent);
+				}
+			}
+		}
+
+		if(sourceLossy)
+			Sent(move.dest, false, sourceSent);
+	}
+
+	void RefinementTracker::TakeIdle(std::chrono::steady_clock::time_point idle_since, std::size_t max, std::vector<Rect>& out) {
+		std::size_t taken = 0;
+
+		for(uint32 ty = 0; ty < tilesY && lossy && taken < max; ++ty) {
+			for(uint32 tx = 0; tx < tilesX && taken < max; ++tx) {
+				auto& tile = tiles[ty * tilesX + tx];
+
+				if(!tile.lossy || tile.sent > idle_since)
+					continue;
+
+				tile.lossy = false;
+				lossy--;
+				taken++;
+
+				const uint32 left = tx * TileSize;
+				const uint32 top = ty * TileSize;
+				const Rect rect { (uint16)left, (uint16)top, (uint16)(std::min<uint32>(left + TileSize, width) - left), (uint16)(std::min<uint32>(top + TileSize, height) - top) };
+
+				// Extend the previous tile's rectangle if it's right next to this one
+				if(!out.empty() && out.back().y == rect.y && out.back().Right() == rect.x && out.back().height == rect.height)
+					out.back().width += rect.width;
+				else
+					out.push_back(rect);
+			}
+		}
+
+		RefinedTilesMetric.Add(taken);
+	}
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <Common.h>
+#include "DamageRegion.h"
+
+namespace CollabVM {
+
+	// Tracks which tiles of the screen users only have a lossy (JPEG) version of,
+	// and since when, so tiles which stopped changing can be sent again losslessly.
+	//
+	// Moving content is sent fast and lossy; once it stops moving,
+	// it's refined to a crisp version. One of these is kept per quality tier.
+	struct RefinementTracker {
+
+		constexpr static uint16 TileSize = DamageRegion::TileSize;
+
+		// Set the size of the surface tiles are tracked for.
+		// Every tile starts out lossless (there's nothing to refine before anything was sent.)
+		void Resize(uint16 width, uint16 height);
+
+		// Record that the pixels of a rectangle were sent, lossy or not.
+		// A lossless rectangle only makes the tiles it covers completely lossless.
+		void Sent(const Rect& rect, bool lossless, std::chrono::steady_clock::time_point when);
+
+		// Carry tile fidelity along with moved pixels.
+		void Copy(const CopyRect& move);
+
+		// Take up to max tiles which are lossy and weren't sent since idle_since,
+		// marking them lossless. Neighbouring tiles on a row are merged,
+		// and the resulting rectangles are added to out.
+		void TakeIdle(std::chrono::steady_clock::time_point idle_since, std::size_t max, std::vector<Rect>& out);
+
+	private:
+
+		struct Tile {
+			// When lossy pixels were last sent for this tile
+			std::chrono::steady_clock::time_point sent;
+
+			bool lossy = false;
+		};
+
+		// Tile coordinates covered by a rectangle, end exclusive.
+		// covered selects tiles the rectangle covers completely, instead of any tile it touches.
+		struct TileSpan {
+			uint32 x0, y0, x1, y1;
+		};
+
+		TileSpan Span(const Rect& rect, bool covered) const;
+
+		uint16 width = 0;
+		uint16 height = 0;
+
+		uint32 tilesX = 0;
+		uint32 tilesY = 0;
+
+		std::vector<Tile> tiles;
+
+		// Amount of lossy tiles, so TakeIdle() can skip scanning when there are none
+		std::size_t lossy = 0;
+	};
+
+}
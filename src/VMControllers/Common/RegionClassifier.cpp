@@ -0,0 +1,114 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "RegionClassifier.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& SolidTilesMetric = Metrics::Get("tiles_solid_total");
+	static Metrics::Metric& FewColorTilesMetric = Metrics::Get("tiles_few_colors_total");
+	static Metrics::Metric& PhotoTilesMetric = Metrics::Get("tiles_photo_total");
+
+	ClassifiedRect RegionClassifier::Classify(Surface& surface, const Rect& rect) {
+		const auto format = surface.Format();
+		const uint32 bpp = BytesPerPixel(format);
+		const uint32 stride = surface.Stride();
+		const byte* pixels = surface.Data();
+
+		ClassifiedRect result { rect, RegionClass::Solid, ReadRGB(pixels + rect.y * stride + rect.x * bpp, format) };
+
+		colors.fill(0);
+		uint32 count = 0;
+
+		// Pixels tend to come in runs, so skip the set for repeats of the last colour
+		uint32 last = ~0u;
+
+		for(uint32 y = rect.y; y < rect.Bottom(); ++y) {
+			const byte* src = pixels + y * stride + rect.x * bpp;
+
+			for(uint32 x = 0; x < rect.width; ++x, src += bpp) {
+				const uint32 color = ReadRGB(src, format);
+
+				if(color == last)
+					continue;
+
+				last = color;
+
+				// The colour with the top bit set, so it's never 0
+				const uint32 key = color | 0x80000000;
+				// Multiplicative hash; its well mixed top bits pick the slot
+				std::size_t slot = (uint32)(key * 2654435761u) >> SlotShift;
+
+				while(colors[slot] != 0 && colors[slot] != key)
+					slot = (slot + 1) % colors.size();
+
+				if(colors[slot] == key)
+					continue;
+
+				if(++count > MaxFewColors) {
+					result.type = RegionClass::Photo;
+					return result;
+				}
+
+				colors[slot] = key;
+			}
+		}
+
+		if(count > 1)
+			result.type = RegionClass::FewColors;
+
+		return result;
+	}
+
+	void RegionClassifier::Split(Surface& surface, const Rect& rect, std::vector<ClassifiedRect>& out) {
+		auto SameKind = [](const ClassifiedRect& a, const ClassifiedRect& b) {
+			return a.type == b.type && (a.type != RegionClass::Solid || a.color == b.color);
+		};
+
+		// Runs this call added
+		const std::size_t first = out.size();
+
+		for(uint32 top = rect.y; top < rect.Bottom();) {
+			// Tiles are aligned to the grid damage is tracked on
+			const uint32 bottom = std::min<uint32>((top / TileSize + 1) * TileSize, rect.Bottom());
+			const std::size_t thisRow = out.size();
+
+			for(uint32 left = rect.x; left < rect.Right();) {
+				const uint32 right = std::min<uint32>((left / TileSize + 1) * TileSize, rect.Right());
+
+				auto tile = Classify(surface, { (uint16)left, (uint16)top, (uint16)(right - left), (uint16)(bottom - top) });
+
+				switch(tile.type) {
+					case RegionClass::Solid: SolidTilesMetric.Add(); break;
+					case RegionClass::FewColors: FewColorTilesMetric.Add(); break;
+					case RegionClass::Photo: PhotoTilesMetric.Add(); break;
+				}
+
+				// Extend the run to the left, if this tile is the same kind
+				if(out.size() > thisRow && SameKind(out.back(), tile))
+					out.back().rect.width += tile.rect.width;
+				else
+					out.push_back(tile);
+
+				left = right;
+			}
+
+			// Runs spanning exactly the same columns as a run ending right above become part of it
+			for(std::size_t i = thisRow; i < out.size();) {
+				auto match = std::find_if(out.begin() + first, out.begin() + thisRow, [&](const ClassifiedRect& above) {
+					return SameKind(above, out[i]) && above.rect.x == out[i].rect.x && above.rect.width == out[i].rect.width && above.rect.Bottom() == top;
+				});
+
+				if(match == out.begin() + thisRow) {
+					++i;
+					continue;
+				}
+
+				match->rect.height += out[i].rect.height;
+				out.erase(out.begin() + i);
+			}
+
+			top = bottom;
+		}
+	}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <Common.h>
+#include "Surface.h"
+#include "DamageRegion.h"
+
+namespace CollabVM {
+
+	// What kind of content a rectangle of pixels holds,
+	// which decides how it's best sent.
+	enum class RegionClass : byte {
+		// Every pixel is the same colour; sent as a fill, without encoding anything.
+		Solid,
+
+		// Only a few colours (flat UI, text); a lossless codec is both smaller and sharper than JPEG.
+		FewColors,
+
+		// Anything else (photos, video, gradients); sent with the configured codec.
+		Photo
+	};
+
+	// A rectangle of a surface, and what it holds.
+	struct ClassifiedRect {
+		Rect rect;
+		RegionClass type;
+
+		// Colour of a Solid rectangle, as 0xRRGGBB
+		uint32 color;
+	};
+
+	// Classifies the tiles of damaged regions, and splits regions
+	// into runs of tiles that are best sent the same way.
+	struct RegionClassifier {
+
+		constexpr static uint16 TileSize = DamageRegion::TileSize;
+
+		// Most colours a rectangle can have to count as FewColors
+		constexpr static uint32 MaxFewColors = 64;
+
+		// Classify a rectangle of a surface.
+		ClassifiedRect Classify(Surface& surface, const Rect& rect);
+
+		// Classify every tile of a rectangle, and split it into rectangles
+		// of neighbouring tiles of the same class (and colour, for Solid tiles).
+		// The split rectangles are added to out.
+		void Split(Surface& surface, const Rect& rect, std::vector<ClassifiedRect>& out);
+
+	private:
+
+		// Open addressing set of the colours seen so far; 0 marks an empty slot,
+		// so colours are stored with their top bit set.
+		// Twice as large as it can get, so probing stays short.
+		std::array<uint32, MaxFewColors * 2> colors;
+
+		// Shift taking the top bits of a 32-bit hash, as many as index colors
+		constexpr static uint32 SlotShift = 25;
+		static_assert((std::size_t(1) << (32 - SlotShift)) == MaxFewColors * 2, "SlotShift must match the size of colors");
+	};
+
+}
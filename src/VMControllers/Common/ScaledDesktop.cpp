@@ -0,0 +1,77 @@
+#include <Common.h>
+#include "ScaledDesktop.h"
+#include "PixelKernels.h"
+
+namespace CollabVM {
+
+	void ScaledDesktop::Resize(Surface& desktop) {
+		uint16 width = desktop.Width();
+		uint16 height = desktop.Height();
+
+		// Levels are always 32bpp, so the kernels and encoders only have one format to deal with
+		for(auto& level : levels) {
+			width /= 2;
+			height /= 2;
+
+			if(width && height)
+				level.Setup(width, height, SurfaceFormat::BPP32);
+			else
+				level = Surface();
+		}
+
+		if(desktop.Valid())
+			Update(desktop, { 0, 0, desktop.Width(), desktop.Height() });
+	}
+
+	std::array<Rect, ScaledDesktop::MaxScale> ScaledDesktop::Update(Surface& desktop, const Rect& rect) {
+		std::array<Rect, MaxScale> updated {};
+
+		Surface* src = &desktop;
+		Rect damage = rect;
+
+		for(byte i = 0; i < MaxScale && damage.Area(); ++i) {
+			if(!levels[i].Valid())
+				break;
+
+			damage = Downscale(*src, levels[i], damage);
+			updated[i] = damage;
+			src = &levels[i];
+		}
+
+		return updated;
+	}
+
+	Rect ScaledDesktop::Downscale(Surface& src, Surface& dst, const Rect& rect) {
+		// Every destination pixel touching the damage is filtered again
+		const uint32 left = rect.x / 2;
+		const uint32 top = rect.y / 2;
+		const uint32 right = std::min<uint32>((rect.Right() + 1) / 2, dst.Width());
+		const uint32 bottom = std::min<uint32>((rect.Bottom() + 1) / 2, dst.Height());
+
+		if(right <= left || bottom <= top)
+			return { 0, 0, 0, 0 };
+
+		const uint32 width = right - left;
+		byte* out = dst.Data() + top * dst.Stride() + left * 4;
+
+		if(src.Format() == SurfaceFormat::BPP16) {
+			// Widen the two source rows of each destination row first
+			const uint32 rowSize = width * 2 * 4;
+			scratch.resize(rowSize * 2);
+
+			for(uint32 y = top; y < bottom; ++y) {
+				const byte* in = src.Data() + (y * 2) * src.Stride() + (left * 2) * 2;
+
+				PixelKernels::RGB565ToXRGB(in, scratch.data(), width * 2);
+				PixelKernels::RGB565ToXRGB(in + src.Stride(), scratch.data() + rowSize, width * 2);
+				PixelKernels::Downscale2x(scratch.data(), rowSize, out + (y - top) * dst.Stride(), dst.Stride(), width, 1);
+			}
+		} else {
+			const byte* in = src.Data() + (top * 2) * src.Stride() + (left * 2) * 4;
+			PixelKernels::Downscale2x(in, src.Stride(), out, dst.Stride(), width, bottom - top);
+		}
+
+		return { (uint16)left, (uint16)top, (uint16)width, (uint16)(bottom - top) };
+	}
+
+}
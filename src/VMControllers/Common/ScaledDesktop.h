@@ -0,0 +1,56 @@
+#pragma once
+#include <Common.h>
+#include "Surface.h"
+#include "DamageRegion.h"
+
+namespace CollabVM {
+
+	// Reduced resolution versions of the desktop surface (1/2, 1/4 and 1/8),
+	// for viewers on small screens and VM thumbnails.
+	//
+	// Each level is made from the one above it with a 2x2 box filter,
+	// and only the damaged parts are filtered again, so keeping them up to date
+	// costs about one pass over the damage.
+	// Only used by the VNC client thread.
+	struct ScaledDesktop {
+
+		// Amount of levels. Level n is 1/2^n of the desktop's size.
+		constexpr static byte MaxScale = 3;
+
+		// (Re)allocate the levels for a desktop surface.
+		void Resize(Surface& desktop);
+
+		// Filter damage of the desktop surface down through every level.
+		// Returns the rectangle updated on each level (index 0 is scale 1);
+		// rectangles after the last level that exists are empty.
+		std::array<Rect, MaxScale> Update(Surface& desktop, const Rect& rect);
+
+		// Get the level of a scale from 1 to MaxScale.
+		// The surface is invalid if the desktop is too small for it.
+		inline Surface& Level(byte scale) {
+			return levels[scale - 1];
+		}
+
+		// Memory taken up by every level
+		inline std::size_t Bytes() const {
+			std::size_t bytes = 0;
+
+			for(auto& level : levels)
+				bytes += level.Capacity();
+
+			return bytes;
+		}
+
+	private:
+
+		// Filter rect of src into dst, which is half its size.
+		// Returns the updated rectangle of dst.
+		Rect Downscale(Surface& src, Surface& dst, const Rect& rect);
+
+		std::array<Surface, MaxScale> levels;
+
+		// Rows of a 16bpp desktop widened to 32bpp before filtering
+		std::vector<byte> scratch;
+	};
+
+}
@@ -1,54 +1,232 @@
-#include <Common.h>
-#include "Surface.h"
-
-namespace CollabVM {
-
-
-	Surface::~Surface() {
-		// Destroy the Cairo surface
-		if(surface)
-			cairo_surface_destroy(surface);
-	}
-
-	void Surface::Setup(uint16 width, uint16 height, SurfaceFormat format) {
-		auto cairo_format = (cairo_format_t)0;
-
-		// select Cairo format from SurfaceFormat enum
-		switch(format) {
-
-		case SurfaceFormat::BPP16:
-			cairo_format = CAIRO_FORMAT_RGB16_565;
-			break;
-		case SurfaceFormat::BPP24:
-			cairo_format = CAIRO_FORMAT_RGB24;
-			break;
-		case SurfaceFormat::BPP32:
-			cairo_format = CAIRO_FORMAT_ARGB32;
-			break;
-
-		default:
-			break;
-
-		}
-
-		stride = cairo_format_stride_for_width(cairo_format, width);
-		buffer.resize(width*height*stride);
-		surface = cairo_image_surface_create_for_data(buffer.data(), cairo_format, width, height, stride);
-
-		if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
-			// uh-oh...
-			buffer.clear();
-		}
-	}
-
-
-	Surface Surface::GetSubSurf(uint16 x, uint16 y, uint16 width, uint16 height) {
-		// stub TODO
-		return {};
-	}
-
-	void Surface::Draw(Surface& Other, uint16 x, uint16 y, uint16 width, uint16 height) {
-		// stub TODO
-	}
-
+#include <Common.h>
+#include <Metrics.h>
+#include "Surface.h"
+#include "PixelKernels.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace CollabVM {
+
+	// select Cairo format from SurfaceFormat enum
+	inline cairo_format_t CairoFormat(SurfaceFormat format) {
+		switch(format) {
+
+		case SurfaceFormat::BPP16:
+			return CAIRO_FORMAT_RGB16_565;
+		case SurfaceFormat::BPP24:
+			return CAIRO_FORMAT_RGB24;
+		case SurfaceFormat::BPP32:
+			return CAIRO_FORMAT_ARGB32;
+
+		default:
+			break;
+
+		}
+
+		return CAIRO_FORMAT_INVALID;
+	}
+
+	static Metrics::Metric& SurfaceBytesMetric = Metrics::Get("surface_bytes");
+
+	bool Surface::UseHugePages = false;
+
+	constexpr std::size_t HugePageSize = 2 * 1024 * 1024;
+
+	// Allocate aligned surface memory.
+	// size is rounded up to what was actually allocated.
+	static byte* AllocateSurfaceMemory(std::size_t& size) {
+		std::size_t alignment = Surface::Alignment;
+
+#ifdef __linux__
+		if(Surface::UseHugePages && size >= HugePageSize)
+			alignment = HugePageSize;
+#endif
+
+		size = (size + alignment - 1) / alignment * alignment;
+
+#ifdef _WIN32
+		auto memory = (byte*)_aligned_malloc(size, alignment);
+#else
+		auto memory = (byte*)std::aligned_alloc(alignment, size);
+#endif
+
+#ifdef __linux__
+		// Only a hint; without THP support this does nothing
+		if(memory && alignment == HugePageSize)
+			madvise(memory, size, MADV_HUGEPAGE);
+#endif
+
+		if(memory)
+			SurfaceBytesMetric.Add(size);
+
+		return memory;
+	}
+
+	static void FreeSurfaceMemory(byte* memory, std::size_t size) {
+#ifdef _WIN32
+		_aligned_free(memory);
+#else
+		std::free(memory);
+#endif
+		SurfaceBytesMetric.Sub(size);
+	}
+
+	Surface::~Surface() {
+		// Destroy the Cairo surface
+		DestroyCairoSurface();
+		FreeMemory();
+	}
+
+	Surface::Surface(Surface&& other) noexcept {
+		*this = std::move(other);
+	}
+
+	Surface& Surface::operator=(Surface&& other) noexcept {
+		if(this == &other)
+			return *this;
+
+		DestroyCairoSurface();
+		FreeMemory();
+
+		width = other.width;
+		height = other.height;
+		stride = other.stride;
+		format = other.format;
+
+		memory = other.memory;
+		capacity = other.capacity;
+		data = other.data;
+		surface = other.surface;
+
+		other.width = 0;
+		other.height = 0;
+		other.stride = 0;
+		other.memory = nullptr;
+		other.capacity = 0;
+		other.data = nullptr;
+		other.surface = nullptr;
+		return *this;
+	}
+
+	void Surface::Setup(uint16 width, uint16 height, SurfaceFormat format) {
+		DestroyCairoSurface();
+
+		this->width = width;
+		this->height = height;
+		this->format = format;
+
+		stride = cairo_format_stride_for_width(CairoFormat(format), width);
+
+		// Reuse our memory if it's big enough (a view's memory isn't ours to reuse),
+		// so resizing to the same or a smaller size doesn't allocate.
+		std::size_t size = (std::size_t)height * stride;
+
+		if(!memory || size > capacity) {
+			FreeMemory();
+			memory = AllocateSurfaceMemory(size);
+			capacity = memory ? size : 0;
+		}
+
+		data = memory;
+
+		if(data)
+			CreateCairoSurface();
+
+		if(!surface) {
+			// uh-oh...
+			FreeMemory();
+			data = nullptr;
+		}
+	}
+
+	void Surface::CreateCairoSurface() {
+		surface = cairo_image_surface_create_for_data(data, CairoFormat(format), width, height, stride);
+
+		if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+			DestroyCairoSurface();
+	}
+
+	void Surface::FreeMemory() {
+		if(memory) {
+			FreeSurfaceMemory(memory, capacity);
+			memory = nullptr;
+			capacity = 0;
+		}
+	}
+
+	void Surface::DestroyCairoSurface() {
+		if(surface) {
+			cairo_surface_destroy(surface);
+			surface = nullptr;
+		}
+	}
+
+	Surface Surface::GetSubSurf(uint16 x, uint16 y, uint16 width, uint16 height) {
+		Surface sub;
+
+		if(!data || x >= this->width || y >= this->height)
+			return sub;
+
+		// clip to our bounds
+		sub.width = std::min<uint16>(width, this->width - x);
+		sub.height = std::min<uint16>(height, this->height - y);
+
+		if(sub.width == 0 || sub.height == 0)
+			return sub;
+
+		// The view keeps our stride, so each row of it
+		// is a row of ours, starting at x.
+		sub.format = format;
+		sub.stride = stride;
+		sub.data = data + (y * stride) + (x * BytesPerPixel(format));
+		sub.CreateCairoSurface();
+
+		if(!sub.surface)
+			sub.data = nullptr;
+
+		return sub;
+	}
+
+	Surface Surface::Clone() {
+		Surface copy;
+
+		if(!Valid())
+			return copy;
+
+		copy.Setup(width, height, format);
+
+		if(!copy.Valid())
+			return copy;
+
+		const uint32 rowSize = width * BytesPerPixel(format);
+
+		for(uint32 row = 0; row < height; ++row)
+			memcpy(copy.data + (row * copy.stride), data + (row * stride), rowSize);
+
+		return copy;
+	}
+
+	void Surface::Draw(Surface& Other, uint16 x, uint16 y, uint16 width, uint16 height) {
+		if(!data || !Other.data || x >= this->width || y >= this->height)
+			return;
+
+		const uint32 w = std::min<uint32>({ width, Other.width, (uint32)this->width - x });
+		const uint32 h = std::min<uint32>({ height, Other.height, (uint32)this->height - y });
+		const uint32 bpp = BytesPerPixel(format);
+
+		byte* dst = data + (y * stride) + (x * bpp);
+		const byte* src = Other.data;
+
+		if(Other.format == format) {
+			// Plain row copies already run at memory bandwidth
+			for(uint32 row = 0; row < h; ++row)
+				memcpy(dst + row * stride, src + row * Other.stride, w * bpp);
+		} else if(Other.format == SurfaceFormat::BPP16 && bpp == 4) {
+			for(uint32 row = 0; row < h; ++row)
+				PixelKernels::RGB565ToXRGB(src + row * Other.stride, dst + row * stride, w);
+		}
+	}
+
 }
\ No newline at end of file
@@ -1,68 +1,166 @@
-#include <Common.h>
-#include <cairo/cairo.h>
-
-namespace CollabVM {
-
-	// Surface format enumeration
-	enum class SurfaceFormat : byte {
-		BPP16,
-		BPP24,
-		BPP32
-	};
-
-	// Basic wrapper object over Cairo surfaces
-	// and memory.
-	struct Surface {
-
-		inline Surface() {
-			// nothing
-		}
-
-		~Surface();
-
-		inline Surface(uint16 width, uint16 height, SurfaceFormat format) 
-			: width(width), height(height), format(format) {
-			Setup(width, height, format);
-		}
-
-		
-		void Setup(uint16 width, uint16 height, SurfaceFormat format);
-		
-		// Get a sub-surface of this one.
-		Surface GetSubSurf(uint16 x, uint16 y, uint16 width, uint16 height);
-
-		// draw the contents of another surface onto this one.
-		// Essentially a blit without any form of ROP
-		void Draw(Surface& Other, uint16 x, uint16 y, uint16 width, uint16 height);
-
-		// retun the raw cairo surface this wraps
-		inline cairo_surface_t* Raw() {
-			if(surface)
-				return surface;
-		}
-
-		// return the raw buffer.
-		inline std::vector<byte>& Buffer() {
-			return buffer;
-		}
-
-	private:
-
-		// width
-		uint16 width;
-
-		// height
-		uint16 height;
-
-		uint32 stride;
-
-		SurfaceFormat format;
-
-		// the buffer that this surface uses
-		std::vector<byte> buffer;
-
-		// cairo surface object
-		cairo_surface_t* surface;
-	};
-
-}
\ No newline at end of file
+#pragma once
+#include <Common.h>
+#include <cairo/cairo.h>
+
+namespace CollabVM {
+
+	// Surface format enumeration
+	enum class SurfaceFormat : byte {
+		BPP16,
+		BPP24,
+		BPP32
+	};
+
+	// Returns the size of one pixel of the given format, in bytes.
+	constexpr uint32 BytesPerPixel(SurfaceFormat format) {
+		return format == SurfaceFormat::BPP16 ? 2 : 4;
+	}
+
+	// Read one pixel of the given format as 0xRRGGBB.
+	// RGB565 is widened the same way PixelKernels::RGB565ToXRGB() does it.
+	inline uint32 ReadRGB(const byte* src, SurfaceFormat format) {
+		if(format == SurfaceFormat::BPP16) {
+			// RGB565
+			uint16 pixel;
+			memcpy(&pixel, src, sizeof(pixel));
+
+			const uint32 r = (pixel >> 11) & 0x1f;
+			const uint32 g = (pixel >> 5) & 0x3f;
+			const uint32 b = pixel & 0x1f;
+			return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+		}
+
+		// Native-endian XRGB words
+		uint32 pixel;
+		memcpy(&pixel, src, sizeof(pixel));
+		return pixel & 0xffffff;
+	}
+
+	// Basic wrapper object over Cairo surfaces
+	// and memory.
+	struct Surface {
+
+		// Alignment of surface memory, so SIMD kernels can use aligned loads on the first row.
+		constexpr static std::size_t Alignment = 64;
+
+		// Back large surfaces with transparent huge pages, where the OS has them (Linux).
+		// Saves TLB misses walking big framebuffers, at the cost of memory rounded up to 2MB.
+		static bool UseHugePages;
+
+		inline Surface() {
+			// nothing
+		}
+
+		~Surface();
+
+		inline Surface(uint16 width, uint16 height, SurfaceFormat format)
+			: width(width), height(height), format(format) {
+			Setup(width, height, format);
+		}
+
+		// Surfaces own a Cairo surface object, so they can only be moved.
+		Surface(const Surface&) = delete;
+		Surface& operator=(const Surface&) = delete;
+
+		Surface(Surface&& other) noexcept;
+		Surface& operator=(Surface&& other) noexcept;
+
+		// (Re)size this surface. The memory is reused if it's large enough,
+		// so the contents are undefined afterwards.
+		void Setup(uint16 width, uint16 height, SurfaceFormat format);
+
+		// Get a sub-surface of this one.
+		//
+		// The returned surface is a view: it shares this surface's memory and stride,
+		// so nothing is copied, and it is only valid as long as this surface isn't
+		// resized or destroyed. The rectangle is clipped to the bounds of this surface;
+		// an empty (invalid) surface is returned if nothing is left after clipping.
+		Surface GetSubSurf(uint16 x, uint16 y, uint16 width, uint16 height);
+
+		// Make a copy of this surface (or view) which owns its memory.
+		Surface Clone();
+
+		// draw the contents of another surface onto this one.
+		// Essentially a blit without any form of ROP.
+		// The top left width x height pixels of Other are drawn at x, y, clipped to both surfaces.
+		// A 16bpp surface can be drawn onto a 32bpp one; other format mismatches draw nothing.
+		void Draw(Surface& Other, uint16 x, uint16 y, uint16 width, uint16 height);
+
+		// retun the raw cairo surface this wraps
+		inline cairo_surface_t* Raw() {
+			return surface;
+		}
+
+		// return a pointer to the first pixel of this surface.
+		inline byte* Data() {
+			return data;
+		}
+
+		inline uint16 Width() const {
+			return width;
+		}
+
+		inline uint16 Height() const {
+			return height;
+		}
+
+		// Distance between two rows, in bytes.
+		inline uint32 Stride() const {
+			return stride;
+		}
+
+		inline SurfaceFormat Format() const {
+			return format;
+		}
+
+		// Returns true if this surface has valid memory and a Cairo surface.
+		inline bool Valid() const {
+			return data != nullptr && surface != nullptr;
+		}
+
+		// Returns true if this surface is a view into another surface's memory.
+		inline bool IsView() const {
+			return data != nullptr && memory == nullptr;
+		}
+
+		// Bytes of memory this surface owns.
+		inline std::size_t Capacity() const {
+			return capacity;
+		}
+
+	private:
+
+		// Create the Cairo surface over data, using the current
+		// width, height, stride and format.
+		void CreateCairoSurface();
+
+		// Destroy the Cairo surface, if one exists.
+		void DestroyCairoSurface();
+
+		// Free the memory this surface owns, if any.
+		void FreeMemory();
+
+		// width
+		uint16 width = 0;
+
+		// height
+		uint16 height = 0;
+
+		uint32 stride = 0;
+
+		SurfaceFormat format = SurfaceFormat::BPP32;
+
+		// the memory that this surface owns, Alignment aligned
+		// (nullptr if this surface is a view)
+		byte* memory = nullptr;
+		std::size_t capacity = 0;
+
+		// pointer to the first pixel.
+		// Points into memory, or into the parent surface's memory for views
+		byte* data = nullptr;
+
+		// cairo surface object
+		cairo_surface_t* surface = nullptr;
+	};
+
+}
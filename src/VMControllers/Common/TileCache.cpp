@@ -0,0 +1,194 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "TileCache.h"
+#include <random>
+
+namespace CollabVM {
+
+	static Metrics::Metric& HitsMetric = Metrics::Get("tile_cache_hits_total");
+	static Metrics::Metric& MissesMetric = Metrics::Get("tile_cache_misses_total");
+	static Metrics::Metric& EvictionsMetric = Metrics::Get("tile_cache_evictions_total");
+	static Metrics::Metric& BytesMetric = Metrics::Get("tile_cache_bytes");
+	static Metrics::Metric& EntriesMetric = Metrics::Get("tile_cache_entries");
+
+	// 128-bit pixel hash: SipHash-2-4 with 128-bit output, keyed with a random key per process.
+	// The cache is shared by every VM, so a guest must not be able to make tiles
+	// which collide with what another VM shows. Unlike an unkeyed hash,
+	// collisions can't be searched for without knowing the key.
+	namespace {
+
+		inline uint64 Rotl(uint64 x, int r) {
+			return (x << r) | (x >> (64 - r));
+		}
+
+		struct HashKey {
+			uint64 k0;
+			uint64 k1;
+		};
+
+		const HashKey& GetHashKey() {
+			static const HashKey key = [] {
+				std::random_device random;
+				auto word = [&]() { return ((uint64)random() << 32) | random(); };
+				return HashKey { word(), word() };
+			}();
+
+			return key;
+		}
+
+		// SipHash state, fed a row at a time, since rows aren't contiguous
+		class SipHash128 {
+			uint64 v0;
+			uint64 v1;
+			uint64 v2;
+			uint64 v3;
+
+			// Bytes of an unfinished word, and how many bytes were fed in total
+			uint64 tail = 0;
+			uint64 length = 0;
+
+			inline void Round() {
+				v0 += v1; v1 = Rotl(v1, 13); v1 ^= v0; v0 = Rotl(v0, 32);
+				v2 += v3; v3 = Rotl(v3, 16); v3 ^= v2;
+				v0 += v3; v3 = Rotl(v3, 21); v3 ^= v0;
+				v2 += v1; v1 = Rotl(v1, 17); v1 ^= v2; v2 = Rotl(v2, 32);
+			}
+
+			inline void Compress(uint64 word) {
+				v3 ^= word;
+				Round();
+				Round();
+				v0 ^= word;
+			}
+
+			inline uint64 Finalize() {
+				for(int i = 0; i < 4; ++i)
+					Round();
+
+				return v0 ^ v1 ^ v2 ^ v3;
+			}
+
+		   public:
+			explicit SipHash128(const HashKey& key)
+				: v0(key.k0 ^ 0x736f6d6570736575ull),
+				v1(key.k1 ^ 0x646f72616e646f6dull ^ 0xee),
+				v2(key.k0 ^ 0x6c7967656e657261ull),
+				v3(key.k1 ^ 0x7465646279746573ull) {
+			}
+
+			void Update(const byte* data, std::size_t size) {
+				std::size_t i = 0;
+
+				// Finish the word the last row left unfinished
+				for(; i < size && (length & 7); ++i, ++length) {
+					tail |= (uint64)data[i] << ((length & 7) * 8);
+
+					if((length & 7) == 7) {
+						Compress(tail);
+						tail = 0;
+					}
+				}
+
+				for(; i + 8 <= size; i += 8, length += 8) {
+					uint64 word;
+					std::memcpy(&word, data + i, sizeof(word));
+					Compress(word);
+				}
+
+				for(; i < size; ++i, ++length)
+					tail |= (uint64)data[i] << ((length & 7) * 8);
+			}
+
+			std::array<uint64, 2> Finish() {
+				Compress(tail | (length << 56));
+
+				v2 ^= 0xee;
+				const uint64 h0 = Finalize();
+
+				v1 ^= 0xdd;
+				const uint64 h1 = Finalize();
+
+				return { h0, h1 };
+			}
+		};
+
+	}
+
+	TileKey TileKey::Make(Surface& pixels, byte type, byte quality) {
+		const std::size_t rowSize = (std::size_t)pixels.Width() * BytesPerPixel(pixels.Format());
+		SipHash128 hash(GetHashKey());
+
+		for(uint32 y = 0; y < pixels.Height(); ++y)
+			hash.Update(pixels.Data() + y * pixels.Stride(), rowSize);
+
+		return { hash.Finish(), pixels.Width(), pixels.Height(), (byte)pixels.Format(), type, quality };
+	}
+
+	EncodedTileCache& EncodedTileCache::Get() {
+		static EncodedTileCache cache;
+		return cache;
+	}
+
+	std::size_t EncodedTileCache::EntryBytes(const Entry& entry) {
+		// list node, index node, and the shared buffer's control block, roughly
+		constexpr std::size_t Overhead = 128;
+		return entry.data->size() + Overhead;
+	}
+
+	void EncodedTileCache::SetMaxBytes(std::size_t newMaxBytes) {
+		std::lock_guard<std::mutex> l(lock);
+		max_bytes.store(newMaxBytes, std::memory_order_relaxed);
+		Trim();
+	}
+
+	EncodedTileCache::data_type EncodedTileCache::Find(const TileKey& key) {
+		if(!Enabled())
+			return nullptr;
+
+		std::lock_guard<std::mutex> l(lock);
+		auto it = index.find(key);
+
+		if(it == index.end()) {
+			MissesMetric.Add();
+			return nullptr;
+		}
+
+		entries.splice(entries.begin(), entries, it->second);
+		HitsMetric.Add();
+		return it->second->data;
+	}
+
+	void EncodedTileCache::Insert(const TileKey& key, data_type data) {
+		if(!Enabled() || !data || data->empty() || data->size() > MaxTileBytes)
+			return;
+
+		std::lock_guard<std::mutex> l(lock);
+
+		// Another encoder may have finished the same tile first
+		if(index.find(key) != index.end())
+			return;
+
+		entries.push_front({ key, std::move(data) });
+		index[key] = entries.begin();
+		bytes += EntryBytes(entries.front());
+
+		Trim();
+	}
+
+	void EncodedTileCache::Trim() {
+		const std::size_t maxBytes = max_bytes.load(std::memory_order_relaxed);
+
+		while(bytes > maxBytes && !entries.empty()) {
+			auto& oldest = entries.back();
+
+			bytes -= EntryBytes(oldest);
+			index.erase(oldest.key);
+			entries.pop_back();
+			EvictionsMetric.Add();
+		}
+
+		BytesMetric.Set(bytes);
+		EntriesMetric.Set(entries.size());
+	}
+
+}
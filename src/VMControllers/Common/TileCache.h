@@ -0,0 +1,107 @@
+#pragma once
+#include <Common.h>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include "Surface.h"
+#include "BufferPool.h"
+
+namespace CollabVM {
+
+	// Identifies an encoded tile by what it holds:
+	// a 128-bit keyed hash of its pixels (see TileKey::Make()), its size and format, and how it was encoded.
+	struct TileKey {
+		std::array<uint64, 2> hash;
+		uint16 width;
+		uint16 height;
+		byte format;
+
+		// VNCClientOptions::OutputRegionType the tile was encoded as
+		byte type;
+
+		// Codec quality (e.g JPEG quality), or 0 for codecs without one
+		byte quality;
+
+		// Make the key of a surface's pixels, encoded as the given type and quality.
+		static TileKey Make(Surface& pixels, byte type, byte quality);
+
+		inline bool operator==(const TileKey& other) const {
+			return hash == other.hash && width == other.width && height == other.height
+				&& format == other.format && type == other.type && quality == other.quality;
+		}
+	};
+
+	struct TileKeyHasher {
+		inline std::size_t operator()(const TileKey& key) const {
+			// The pixel hash is already well mixed
+			return (std::size_t)key.hash[0];
+		}
+	};
+
+	// A process-wide LRU cache of encoded tiles, shared by every VM,
+	// so pixels that were on some screen before (windows being switched between,
+	// menus opening and closing, VMs booting from the same image) aren't encoded again.
+	//
+	// Bounded by bytes; the least recently used tiles are thrown away first.
+	struct EncodedTileCache {
+		typedef std::shared_ptr<const OutputBuffer> data_type;
+
+		// Default bound of the cache
+		constexpr static std::size_t DefaultMaxBytes = 64 * 1024 * 1024;
+
+		// Larger tiles are unlikely to repeat, and would push out many smaller ones
+		constexpr static std::size_t MaxTileBytes = 256 * 1024;
+
+		// Encoded regions are cut into tiles of this size, on a grid aligned to the screen,
+		// so the same pixels become the same tiles again, however the damage around them was shaped.
+		constexpr static uint16 TileSize = 128;
+
+		// Largest tile cached, in pixels.
+		// Larger regions are neither cached here nor by clients (see ClientTileCache),
+		// so their key is never computed.
+		constexpr static uint32 MaxTileArea = TileSize * TileSize;
+
+		// Get the process-wide cache.
+		static EncodedTileCache& Get();
+
+		// Set the most bytes the cache may hold, evicting tiles if it's over.
+		// 0 turns the cache off.
+		void SetMaxBytes(std::size_t bytes);
+
+		inline bool Enabled() const {
+			return max_bytes.load(std::memory_order_relaxed) != 0;
+		}
+
+		// Find the encoded data of a tile, marking it as recently used.
+		// Returns nullptr if it isn't cached.
+		data_type Find(const TileKey& key);
+
+		// Cache the encoded data of a tile.
+		// The buffer is shared with whoever holds it, not copied.
+		void Insert(const TileKey& key, data_type data);
+
+	private:
+
+		struct Entry {
+			TileKey key;
+			data_type data;
+		};
+
+		// Bytes an entry is accounted as, including bookkeeping
+		static std::size_t EntryBytes(const Entry& entry);
+
+		// Evict until the cache fits. Requires lock
+		void Trim();
+
+		std::atomic<std::size_t> max_bytes { DefaultMaxBytes };
+
+		std::mutex lock;
+
+		// Locked by lock.
+		// Most recently used tiles are at the front.
+		std::list<Entry> entries;
+		std::unordered_map<TileKey, std::list<Entry>::iterator, TileKeyHasher> index;
+		std::size_t bytes = 0;
+	};
+
+}
@@ -0,0 +1,107 @@
+#include <Common.h>
+#include <Metrics.h>
+#include "TileTracker.h"
+#include "MoveDetector.h"
+
+namespace CollabVM {
+
+	static Metrics::Metric& TilesCheckedMetric = Metrics::Get("tiles_checked_total");
+	static Metrics::Metric& TilesChangedMetric = Metrics::Get("tiles_changed_total");
+
+	void TileTracker::Resize(Surface& surface) {
+		width = surface.Width();
+		height = surface.Height();
+		stride = surface.Stride();
+		bpp = BytesPerPixel(surface.Format());
+
+		tilesX = (width + TileSize - 1) / TileSize;
+		const uint32 tilesY = (height + TileSize - 1) / TileSize;
+
+		shadow.resize(height * stride);
+		valid.assign(tilesX * tilesY, 0);
+	}
+
+	void TileTracker::Check(Surface& surface, int x, int y, int w, int h, DamageRegion& damage) {
+		// Surface changed under us without a resize, so we can't trust the shadow copy
+		if(!Matches(surface)) {
+			damage.Add(x, y, w, h);
+			return;
+		}
+
+		// clip to the surface
+		const uint32 left = std::max(x, 0);
+		const uint32 top = std::max(y, 0);
+		const uint32 right = std::min(x + w, (int)width);
+		const uint32 bottom = std::min(y + h, (int)height);
+
+		if(right <= left || bottom <= top)
+			return;
+
+		const byte* pixels = surface.Data();
+
+		for(uint32 ty = top / TileSize; ty * TileSize < bottom; ++ty) {
+			for(uint32 tx = left / TileSize; tx * TileSize < right; ++tx) {
+				// the part of the rectangle within this tile
+				const uint32 x0 = std::max(left, tx * TileSize);
+				const uint32 x1 = std::min(right, (tx + 1) * TileSize);
+				const uint32 y0 = std::max(top, ty * TileSize);
+				const uint32 y1 = std::min(bottom, (ty + 1) * TileSize);
+
+				const uint32 offset = x0 * bpp;
+				const uint32 rowSize = (x1 - x0) * bpp;
+
+				auto& tileValid = valid[ty * tilesX + tx];
+
+				// rows which differ from the shadow copy
+				uint32 firstChanged = y1;
+				uint32 lastChanged = y0;
+
+				for(uint32 row = y0; row < y1; ++row) {
+					const byte* src = pixels + (row * stride) + offset;
+					byte* dst = shadow.data() + (row * stride) + offset;
+
+					if(!tileValid || memcmp(src, dst, rowSize) != 0) {
+						memcpy(dst, src, rowSize);
+						firstChanged = std::min(firstChanged, row);
+						lastChanged = row;
+					}
+				}
+
+				// Only a fully covered tile has a complete shadow copy.
+				// Until then every check of the tile counts as a change.
+				if(x0 == tx * TileSize && y0 == ty * TileSize && (x1 == (tx + 1) * TileSize || x1 == width) && (y1 == (ty + 1) * TileSize || y1 == height))
+					tileValid = 1;
+
+				TilesCheckedMetric.Add();
+
+				if(firstChanged < y1) {
+					TilesChangedMetric.Add();
+					damage.Add(x0, firstChanged, x1 - x0, (lastChanged - firstChanged) + 1);
+				}
+			}
+		}
+	}
+
+	void TileTracker::Copy(const CopyRect& move) {
+		if(shadow.empty())
+			return;
+
+		MovePixels(shadow.data(), stride, bpp, move);
+	}
+
+	bool TileTracker::Valid(const Rect& rect) const {
+		if(!rect.Area() || rect.Right() > width || rect.Bottom() > height)
+			return false;
+
+		const uint32 tx1 = (rect.Right() - 1) / TileSize;
+		const uint32 ty1 = (rect.Bottom() - 1) / TileSize;
+
+		for(uint32 ty = rect.y / TileSize; ty <= ty1; ++ty)
+			for(uint32 tx = rect.x / TileSize; tx <= tx1; ++tx)
+				if(!valid[ty * tilesX + tx])
+					return false;
+
+		return true;
+	}
+
+}
\ No newline at end of file
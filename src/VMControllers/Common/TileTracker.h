@@ -0,0 +1,64 @@
+#pragma once
+#include <Common.h>
+#include "Surface.h"
+#include "DamageRegion.h"
+
+namespace CollabVM {
+
+	// Tracks which tiles of a surface actually changed.
+	//
+	// VNC servers (QEMU included) often report large damage rectangles where
+	// most of the pixels are the same as before. The tracker keeps a shadow copy of
+	// the surface, and compares damaged tiles against it row by row, so only
+	// the rows of tiles that really differ end up being encoded.
+	struct TileTracker {
+
+		constexpr static uint16 TileSize = DamageRegion::TileSize;
+
+		// (Re)allocate the shadow copy for a surface.
+		// Every tile is considered changed until it has been checked once.
+		void Resize(Surface& surface);
+
+		// Compare the given damaged rectangle of the surface against the shadow copy,
+		// adding the parts of each tile that changed to damage,
+		// and bringing the shadow copy up to date.
+		void Check(Surface& surface, int x, int y, int width, int height, DamageRegion& damage);
+
+		// Apply a move to the shadow copy, the same way clients will apply it.
+		void Copy(const CopyRect& move);
+
+		// Returns true if every tile of the rectangle holds valid pixels in the shadow copy.
+		bool Valid(const Rect& rect) const;
+
+		// Returns true if the shadow copy is laid out the same way as surface.
+		inline bool Matches(Surface& surface) const {
+			return surface.Data() && surface.Width() == width && surface.Height() == height && surface.Stride() == stride;
+		}
+
+		// Bytes of memory the shadow copy takes up.
+		inline std::size_t Bytes() const {
+			return shadow.capacity() + valid.capacity();
+		}
+
+		// The shadow copy, i.e the surface as of the last check.
+		inline const byte* Shadow() const {
+			return shadow.data();
+		}
+
+	private:
+
+		uint16 width = 0;
+		uint16 height = 0;
+		uint32 stride = 0;
+		uint32 bpp = 0;
+
+		uint32 tilesX = 0;
+
+		// Shadow copy of the surface, laid out the same way
+		std::vector<byte> shadow;
+
+		// Whether each tile of the shadow copy holds valid pixels yet
+		std::vector<byte> valid;
+	};
+
+}
@@ -1,54 +1,268 @@
-#include <Common.h>
-#include <Server.h>
-#include "ControllerStatus.h"
-#include <Protocol.h>
-#include <UserList.h>
-
-namespace CollabVM {
-	
-	// Base interface for VM controllers to implement.
-	struct VMController : public std::enable_shared_from_this<VMController> {
-	
-		// Constructor.
-		inline VMController(std::shared_ptr<Server> server)
-			: server(server) {
-			// This constructor only serves the purpose
-			// of receving a handle to the server.
-			// Nothing more, nothing less
-		}
-
-		virtual ~VMController() {
-			// remove ownership explicitly when destructing
-			server.reset();
-		}
-
-		virtual bool Start() = 0;
-
-		virtual void OnStateChange() = 0;
-
-		// Join a user to the VM controller.
-		inline void Join(std::shared_ptr<User> user) {
-			userlist.AddUser(user);
-			user->vm = shared_from_this();
-		}
-
-		inline void Leave(std::shared_ptr<User> user) {
-			userlist.RemoveUser(user);
-			user->vm.reset();
-		}
-
-		// Implementation-defined value
-		// to detect VM controller type.
-		const byte Type = 0; // 0 is reserved for the base so that functions can complain
-
-	private:
-
-		// Pointer to server
-		std::shared_ptr<Server> server;
-
-		UserList userlist;
-
-		ControllerStatus status;
-	};
-
+#pragma once
+#include <Common.h>
+#include "ControllerStatus.h"
+#include "VNCClient.h"
+#include <Protocol.h>
+#include <UserList.h>
+
+namespace CollabVM {
+
+	struct Server;
+	
+	// Base interface for VM controllers to implement.
+	struct VMController : public std::enable_shared_from_this<VMController> {
+	
+		// Constructor.
+		inline VMController(std::shared_ptr<Server> server)
+			: server(server) {
+			// This constructor only serves the purpose
+			// of receving a handle to the server.
+			// Nothing more, nothing less
+		}
+
+		virtual ~VMController() {
+			// remove ownership explicitly when destructing
+			server.reset();
+		}
+
+		virtual bool Start() = 0;
+
+		virtual void OnStateChange() = 0;
+
+		// Join a user to the VM controller.
+		inline void Join(std::shared_ptr<User> user) {
+			bool added = false;
+
+			// The user is counted under the list's lock,
+			// so BroadcastScreenUpdate() can't move them to another tier in between.
+			userlist.AddUser(user, [&](auto&) {
+				added = true;
+				AddViewer(*user);
+				SendKeyframe(user);
+			});
+
+			if(!added)
+				return;
+
+			user->vm = shared_from_this();
+		}
+
+		inline void Leave(std::shared_ptr<User> user) {
+			if(user->vm.get() != this)
+				return;
+
+			userlist.RemoveUser(user, [&]() {
+				RemoveViewer(*user);
+			});
+
+			user->vm.reset();
+		}
+
+		// Move a user to the scaled stream of the given scale (see ScaledDesktop),
+		// or back to full resolution with a scale of 0.
+		// Users on a scaled stream don't keep any quality tier active.
+		inline void SetUserScale(std::shared_ptr<User> user, byte scale) {
+			scale = std::min(scale, ScaledDesktop::MaxScale);
+
+			if(user->vm.get() != this)
+				return;
+
+			userlist.ForEachLock([&](auto it) {
+				if(*it != user)
+					return true;
+
+				if(user->scale != scale) {
+					RemoveViewer(*user);
+					user->scale = scale;
+					AddViewer(*user);
+
+					// The user has seen nothing of the stream they moved to
+					SendKeyframe(user);
+				}
+
+				return false;
+			});
+		}
+
+		// Get the last encoded thumbnail of the screen, or nullptr if there isn't one.
+		inline std::shared_ptr<VNCRegion> GetThumbnail() {
+			if(!vnc_client)
+				return nullptr;
+
+			return vnc_client->GetThumbnail();
+		}
+
+		// Call when a user sends keyboard or mouse input to this VM,
+		// so its screen updates are sent at the full frame rate while they interact.
+		inline void NotifyInput() {
+			if(vnc_client)
+				vnc_client->NotifyInput();
+		}
+
+		// Send a screen update to every user on this VM in the region's quality tier,
+		// or on its scaled stream.
+		// Implementations should call this from their VNC client's OnScreenUpdate.
+		// The update is serialized exactly once, and every user is sent the same buffer,
+		// unless their client already holds the tile (see ClientTileCache).
+		inline void BroadcastScreenUpdate(std::shared_ptr<VNCRegion> region) {
+			if(!region)
+				return;
+
+			auto message = Protocol::SerializeScreenUpdate(region);
+
+			userlist.ForEachLock([&](auto it) {
+				auto& user = *it;
+
+				if(user->scale != region->scale)
+					return true;
+
+				// Scaled streams have no tiers
+				if(user->scale) {
+					if(user->handle)
+						SendScreenUpdate(user, region, message);
+
+					return true;
+				}
+
+				// Move users whose link got faster or slower to a better fitting tier.
+				if(user->tier == region->tier) {
+					auto old_tier = user->tier;
+
+					if(user->UpdateQualityTier()) {
+						AddTierUser(user->tier);
+						RemoveTierUser(old_tier);
+
+						// The new tier's stream doesn't know what this user has seen
+						SendKeyframe(user);
+					}
+				}
+
+				if(user->tier == region->tier && user->handle)
+					SendScreenUpdate(user, region, message);
+
+				return true;
+			});
+		}
+
+		// Implementation-defined value
+		// to detect VM controller type.
+		const byte Type = 0; // 0 is reserved for the base so that functions can complain
+
+	protected:
+
+		// VNC client of the VM, if the implementation uses one.
+		std::shared_ptr<VNCClient> vnc_client;
+
+	private:
+
+		// Send a user one screen update. Requires the user list's lock.
+		// If their session fell behind and dropped updates, it's sent a keyframe once it catches up.
+		inline void SendScreenUpdate(const std::shared_ptr<User>& user, std::shared_ptr<VNCRegion> region, const WebsocketServer::shared_message_type& message) {
+			if(user->tile_cache.Send(*user->handle, region, message) == ClientTileCache::SendResult::Resumed)
+				SendKeyframe(user);
+		}
+
+		// Send one user the whole screen of the stream they're on, without sending it to anyone else on it.
+		// Full resolution users get it from the keyframe cache, instead of it being encoded again for each.
+		// Requires the user list's lock.
+		inline void SendKeyframe(const std::shared_ptr<User>& user) {
+			if(!vnc_client)
+				return;
+
+			std::weak_ptr<VMController> weak_vm = shared_from_this();
+			std::weak_ptr<User> weak = user;
+			const byte scale = user->scale;
+			const QualityTier tier = user->tier;
+
+			auto callback = [weak_vm, weak, scale, tier](const std::vector<std::shared_ptr<VNCRegion>>& keyframe) {
+				auto vm = weak_vm.lock();
+				auto user = weak.lock();
+
+				if(!vm || !user)
+					return;
+
+				vm->userlist.ForEachLock([&](auto it) {
+					if(*it != user)
+						return true;
+
+					// Users who moved to another stream since are sent its keyframe instead
+					if(!user->handle || user->scale != scale || (!scale && user->tier != tier))
+						return false;
+
+					// Only the small header is built per user; the encoded blocks are shared
+					for(auto& region : keyframe)
+						vm->SendScreenUpdate(user, region, Protocol::SerializeScreenUpdate(region));
+
+					return false;
+				});
+			};
+
+			if(scale)
+				vnc_client->RequestScaleKeyframe(scale, callback);
+			else
+				vnc_client->RequestKeyframe(tier, callback);
+		}
+
+		// Count a user in whatever their screen updates are encoded for.
+		// Requires the user list's lock, which is always taken before tier_lock.
+		inline void AddViewer(User& user) {
+			if(user.scale)
+				AddScaleUser(user.scale);
+			else
+				AddTierUser(user.tier);
+		}
+
+		inline void RemoveViewer(User& user) {
+			if(user.scale)
+				RemoveScaleUser(user.scale);
+			else
+				RemoveTierUser(user.tier);
+		}
+
+		// Count a user on a scaled stream, turning the stream on if it was empty
+		inline void AddScaleUser(byte scale) {
+			std::lock_guard<std::mutex> l(tier_lock);
+
+			if(scale_users[scale - 1]++ == 0 && vnc_client)
+				vnc_client->SetScaleActive(scale, true);
+		}
+
+		inline void RemoveScaleUser(byte scale) {
+			std::lock_guard<std::mutex> l(tier_lock);
+
+			if(scale_users[scale - 1] != 0 && --scale_users[scale - 1] == 0 && vnc_client)
+				vnc_client->SetScaleActive(scale, false);
+		}
+
+		// Count a user in a quality tier, turning the tier on if it was empty
+		inline void AddTierUser(QualityTier tier) {
+			std::lock_guard<std::mutex> l(tier_lock);
+
+			if(tier_users[(std::size_t)tier]++ == 0 && vnc_client)
+				vnc_client->SetTierActive(tier, true);
+		}
+
+		// Stop counting a user in a quality tier, turning the tier off once it's empty
+		inline void RemoveTierUser(QualityTier tier) {
+			std::lock_guard<std::mutex> l(tier_lock);
+
+			if(tier_users[(std::size_t)tier] != 0 && --tier_users[(std::size_t)tier] == 0 && vnc_client)
+				vnc_client->SetTierActive(tier, false);
+		}
+
+		// Pointer to server
+		std::shared_ptr<Server> server;
+
+		// Amount of users in each quality tier
+		std::mutex tier_lock;
+		std::array<uint32, QualityTierCount> tier_users {};
+
+		// Amount of users on each scaled stream, locked by tier_lock too
+		std::array<uint32, ScaledDesktop::MaxScale> scale_users {};
+
+		UserList userlist;
+
+		ControllerStatus status;
+	};
+
 }
\ No newline at end of file
@@ -1,196 +1,1031 @@
-#include <Common.h>
-#include "VNCClient.h"
-#include <cairo_jpg.h>
-
-#ifdef _MSC_VER
-#define strdup _strdup
-#endif
-
-namespace CollabVM {
-
-	// Key for user data to store the pointer to the active VNC client.
-	// This is used so that all of the libvncserver code can access the VNCClient object it's tied to.
-	// (I'm waiting for people to call me cheeky :P)
-	const static uint32 VNCCLIENT_KEY = 0x796C694C;
-
-	// cairo write data structure
-	struct cairo_write_data {
-		int datasize = 0;
-		std::vector<byte> buffer;
-	};
-
-	// Called to resize the surface
-	rfbBool ResizeSurface(rfbClient* client) {
-		// get the client instance controlling this client
-		// (confusing, I know)
-		VNCClient* thatClient = (VNCClient*)rfbClientGetClientData(client, (void*)&VNCCLIENT_KEY);
-
-		if(!thatClient)
-			return FALSE; // not controlled by us probably, not sure how that happened, but no thanks
-
-		int w = client->width;
-		int h = client->height;
-		int bpp = client->format.bitsPerPixel;
-
-		SurfaceFormat fmt = (SurfaceFormat)0;
-
-		switch(bpp) {
-		case 16:
-			fmt = SurfaceFormat::BPP16;
-			break;
-
-		case 32:
-			fmt = SurfaceFormat::BPP32;
-			break;
-
-		default:
-			thatClient->logger.error("Unhandled bpp value ", bpp, "!");
-			return FALSE;
-			break;
-		}
-
-		// Setup the desktop surface to be the right w/h
-		thatClient->desktop.Setup(w, h, fmt);
-		
-		client->frameBuffer = thatClient->desktop.Buffer().data();
-
-		SetFormatAndEncodings(client);
-
-		return TRUE;
-	}
-
-	cairo_status_t cairo_write_func(void* closure, const unsigned char* data, unsigned int length) {
-		cairo_write_data* wd = (cairo_write_data*)closure;
-
-		int next = wd->datasize + length;
-
-		if(next > wd->buffer.size()) {
-			do {
-				wd->buffer.resize(wd->buffer.size() * 2);
-			} while((next > wd->buffer.size()));
-		}
-
-		memcpy(&wd->buffer[wd->datasize], data, length);
-		wd->datasize += length;
-
-		return CAIRO_STATUS_SUCCESS;
-	}
-
-	void UpdateSurface(rfbClient* client, int x, int y, int w, int h) {
-		VNCClient* thatClient = (VNCClient*)rfbClientGetClientData(client, (void*)&VNCCLIENT_KEY);
-
-		if(!thatClient)
-			return;
-
-		// framebuffer will already have the relevant pixels in it.
-		// the passed x,y,w,h is a rectangle defining the updated region.
-		// so now, we create a region structure
-		std::shared_ptr<VNCRegion> region = std::make_shared<VNCRegion>();
-
-		cairo_write_data writeData;
-
-		switch(thatClient->options.output_region_type) {
-			
-		case VNCClientOptions::OutputRegionType::JpegRegion: {
-			auto cairos = thatClient->desktop.Raw();
-			cairo_image_surface_write_to_jpeg_stream(cairos, cairo_write_func, &writeData, thatClient->options.jpeg_compression_quality);
-		} break;
-
-		case VNCClientOptions::OutputRegionType::PngRegion: {
-			auto cairos = thatClient->desktop.Raw();
-			cairo_surface_write_to_png_stream(cairos, cairo_write_func, &writeData);
-		} break;
-
-		default:
-			return;
-			break;
-		}
-
-		// now we have the encoded region.
-		// so we set the region
-		region->data = writeData.buffer;
-		region->x = x;
-		region->y = y;
-		region->width = w;
-		region->height = h;
-
-		if(thatClient->OnScreenUpdate)
-			thatClient->OnScreenUpdate(region);
-	}
-
-	VNCClient::~VNCClient() {
-		if(client) {
-			// free our strdup()'d hostname string to avoid memory leaking
-			free(client->serverHost);
-			rfbClientCleanup(client);
-		}
-	}
-
-	void VNCClient::Connect() {
-		// Connect() simply starts the thread.
-		vnc_thread = std::thread(&VNCClient::ClientThread, shared_from_this());
-		vnc_thread.detach();
-	}
-
-	
-	void VNCClient::SetOptions(VNCClientOptions& new_options) {
-		std::lock_guard<std::mutex> l(state_lock);
-		options = new_options;
-	}
-
-	void VNCClient::ClientThread() {
-
-		// Set state, locking the state mutex
-		auto SetState = [&](State newState) {
-			std::lock_guard<std::mutex> l(state_lock);
-			current_state = newState;
-
-			if(OnStateChange)
-				OnStateChange();
-		};
-
-		SetState(State::ConnectingToServer);
-
-		// get a 32bpp client & set the client data
-		client = rfbGetClient(8, 3, 4);
-		rfbClientSetClientData(client, (void*)&VNCCLIENT_KEY, this);
-
-		client->serverHost = strdup(options.hostname.data());
-		client->serverPort = options.port;
-
-		if(options.register_qemu_audio) {
-			logger.info("Registering QEMU Audio extension");
-		}
-
-		if(rfbInitClient(client, 0, NULL)) {
-			// Initalization succedded
-
-			client->canHandleNewFBSize = TRUE;
-			client->MallocFrameBuffer = ResizeSurface;
-			client->GotFrameBufferUpdate = UpdateSurface;
-			
-			// mark client as connected
-			SetState(State::Connected);
-
-			// go into a loop, waiting and handling server messages.
-			while(true) {
-				int i = WaitForMessage(client, 500);
-				if(i > 0)
-					break;
-
-				if(!HandleRFBServerMessage(client))
-					break;
-			}
-
-			// if we broke out of the above loop,
-			// it's probably because we disconnected.
-			SetState(State::Disconnected);
-			
-			
-		} else {
-			// client initalization failed
-			SetState(State::Disconnected);
-			return;
-		}
-	}
+#include <Common.h>
+#include "VNCClient.h"
+#include "JpegEncoder.h"
+#include "QoiEncoder.h"
+#include "TileCache.h"
+
+#ifdef _MSC_VER
+#define strdup _strdup
+#endif
+
+namespace CollabVM {
+
+	// Key for user data to store the pointer to the active VNC client.
+	// This is used so that all of the libvncserver code can access the VNCClient object it's tied to.
+	// (I'm waiting for people to call me cheeky :P)
+	const static uint32 VNCCLIENT_KEY = 0x796C694C;
+
+	// cairo write data structure
+	struct cairo_write_data {
+		// buffer to append the output to
+		OutputBuffer* buffer;
+	};
+
+	// Called to resize the surface
+	rfbBool ResizeSurface(rfbClient* client) {
+		// get the client instance controlling this client
+		// (confusing, I know)
+		VNCClient* thatClient = (VNCClient*)rfbClientGetClientData(client, (void*)&VNCCLIENT_KEY);
+
+		if(!thatClient)
+			return FALSE; // not controlled by us probably, not sure how that happened, but no thanks
+
+		int w = client->width;
+		int h = client->height;
+		int bpp = client->format.bitsPerPixel;
+
+		SurfaceFormat fmt = (SurfaceFormat)0;
+
+		switch(bpp) {
+		case 16:
+			fmt = SurfaceFormat::BPP16;
+			break;
+
+		case 32:
+			fmt = SurfaceFormat::BPP32;
+			break;
+
+		default:
+			thatClient->logger.error("Unhandled bpp value ", bpp, "!");
+			return FALSE;
+			break;
+		}
+
+		// Setup the desktop surface to be the right w/h
+		thatClient->desktop.Setup(w, h, fmt);
+		thatClient->damage.Resize(w, h);
+		thatClient->changed.Resize(w, h);
+		thatClient->update_moves.clear();
+		thatClient->tiles.Resize(thatClient->desktop);
+		thatClient->snapshots.Resize(thatClient->desktop);
+		thatClient->keyframe.Resize(w, h);
+		thatClient->scaled.Resize(thatClient->desktop);
+		thatClient->scaled_damage.Resize(w, h);
+		thatClient->thumbnail_dirty = true;
+
+		{
+			std::lock_guard<std::mutex> l(thatClient->tier_lock);
+			for(auto& tier : thatClient->tiers) {
+				tier.damage.Resize(w, h);
+				tier.refinement.Resize(w, h);
+				tier.moves.clear();
+			}
+
+			for(byte i = 0; i < ScaledDesktop::MaxScale; ++i) {
+				auto& level = thatClient->scaled.Level(i + 1);
+				thatClient->scales[i].damage.Resize(level.Width(), level.Height());
+			}
+		}
+		
+		client->frameBuffer = thatClient->desktop.Data();
+
+		SetFormatAndEncodings(client);
+
+		return TRUE;
+	}
+
+	cairo_status_t cairo_write_func(void* closure, const unsigned char* data, unsigned int length) {
+		cairo_write_data* wd = (cairo_write_data*)closure;
+
+		// The buffer comes from the pool with room for a typical output already reserved,
+		// so this rarely has to grow it.
+		wd->buffer->insert(wd->buffer->end(), data, data + length);
+
+		return CAIRO_STATUS_SUCCESS;
+	}
+
+	void UpdateSurface(rfbClient* client, int x, int y, int w, int h) {
+		VNCClient* thatClient = (VNCClient*)rfbClientGetClientData(client, (void*)&VNCCLIENT_KEY);
+
+		if(!thatClient)
+			return;
+
+		// framebuffer will already have the relevant pixels in it.
+		// the passed x,y,w,h is a rectangle defining the updated region.
+		// libvncclient calls us once per rectangle, so just remember the damage
+		// until the whole update is finished.
+		thatClient->damage.Add(x, y, w, h);
+		thatClient->snapshots.Damage(x, y, w, h);
+	}
+
+	// Called for RFB CopyRect rectangles, instead of libvncclient copying the pixels itself.
+	void CopySurface(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y) {
+		VNCClient* thatClient = (VNCClient*)rfbClientGetClientData(client, (void*)&VNCCLIENT_KEY);
+
+		if(!thatClient)
+			return;
+
+		auto& desktop = thatClient->desktop;
+
+		if(w <= 0 || h <= 0 || src_x < 0 || src_y < 0 || dest_x < 0 || dest_y < 0
+			|| std::max(src_x, dest_x) + w > desktop.Width() || std::max(src_y, dest_y) + h > desktop.Height())
+			return;
+
+		CopyRect move { { (uint16)dest_x, (uint16)dest_y, (uint16)w, (uint16)h }, (uint16)src_x, (uint16)src_y };
+
+		MovePixels(desktop.Data(), desktop.Stride(), BytesPerPixel(desktop.Format()), move);
+
+		// Users can only repeat the move if they have the source pixels.
+		// Otherwise the destination is just damage like any other.
+		if(thatClient->tiles.Matches(desktop) && thatClient->tiles.Valid(move.Source())) {
+			thatClient->tiles.Copy(move);
+			thatClient->update_moves.push_back(move);
+		}
+
+		thatClient->damage.Add(dest_x, dest_y, w, h);
+		thatClient->snapshots.Damage(dest_x, dest_y, w, h);
+	}
+
+	void FinishedUpdate(rfbClient* client) {
+		VNCClient* thatClient = (VNCClient*)rfbClientGetClientData(client, (void*)&VNCCLIENT_KEY);
+
+		if(!thatClient)
+			return;
+
+		auto& desktop = thatClient->desktop;
+		auto& tiles = thatClient->tiles;
+		auto& moves = thatClient->update_moves;
+
+		auto updated = thatClient->damage.Flush();
+
+		// Look for scrolling while the shadow copy still has the old pixels.
+		// Detected moves are applied to the shadow copy, so checking the damage
+		// afterwards only finds the pixels which the moves didn't bring along.
+		if(tiles.Matches(desktop)) {
+			for(auto& rect : updated) {
+				CopyRect move;
+
+				if(!tiles.Valid(rect) || !thatClient->move_detector.Detect(tiles.Shadow(), desktop.Data(), desktop.Stride(), BytesPerPixel(desktop.Format()), rect, move))
+					continue;
+
+				tiles.Copy(move);
+				moves.push_back(move);
+			}
+		}
+
+		// Only the tiles whose pixels really changed are kept.
+		for(auto& rect : updated)
+			tiles.Check(desktop, rect.x, rect.y, rect.width, rect.height, thatClient->changed);
+
+		// Encode the coalesced damage of the update
+		auto rects = thatClient->changed.Flush();
+
+		for(auto& move : moves)
+			thatClient->keyframe.Invalidate(move.dest);
+
+		for(auto& rect : rects)
+			thatClient->keyframe.Invalidate(rect);
+
+		// Scaled streams have no moves, so moved pixels are just damage to them
+		for(auto& move : moves)
+			thatClient->scaled_damage.Add(move.dest.x, move.dest.y, move.dest.width, move.dest.height);
+
+		for(auto& rect : rects)
+			thatClient->scaled_damage.Add(rect.x, rect.y, rect.width, rect.height);
+
+		// The damage is sent on the next frame tick,
+		// which may well be right now.
+		thatClient->AccumulateDamage(moves, rects);
+		moves.clear();
+		thatClient->Tick();
+	}
+
+	void VNCClient::AccumulateDamage(const std::vector<CopyRect>& moves, const std::vector<Rect>& rects) {
+		std::lock_guard<std::mutex> l(tier_lock);
+
+		for(auto& tier : tiers) {
+			if(!tier.active)
+				continue;
+
+			for(auto& move : moves) {
+				// A tier that's slow to send could pile up moves;
+				// past a point, just send the pixels instead.
+				if(tier.moves.size() >= TierState::MaxPendingMoves) {
+					tier.damage.Add(move.dest.x, move.dest.y, move.dest.width, move.dest.height);
+					continue;
+				}
+
+				tier.damage.Copy(move);
+				tier.refinement.Copy(move);
+				tier.moves.push_back(move);
+			}
+
+			for(auto& rect : rects)
+				tier.damage.Add(rect.x, rect.y, rect.width, rect.height);
+		}
+	}
+
+	void VNCClient::Tick() {
+		auto now = std::chrono::steady_clock::now();
+
+		// Everything this tick submits shares one snapshot of the options
+		TakeOptions();
+
+		{
+			std::lock_guard<std::mutex> l(tier_lock);
+
+			bool watched = false;
+			for(auto& tier : tiers)
+				watched |= tier.active;
+
+			for(auto& scale : scales)
+				watched |= scale.active;
+
+			scheduler.SetMaxFps(tick_options->max_fps);
+			scheduler.SetWatched(watched);
+		}
+
+		if(!scheduler.TickDue(now))
+			return;
+
+		if(framebuffer_bytes)
+			framebuffer_bytes->Set(desktop.Capacity() + tiles.Bytes() + snapshots.Bytes() + scaled.Bytes());
+
+		auto stale = keyframe.TakeStale();
+		std::vector<std::pair<QualityTier, keyframe_callback_type>> requests;
+		std::vector<std::pair<byte, keyframe_callback_type>> scaleRequests;
+
+		{
+			std::lock_guard<std::mutex> l(tier_lock);
+			requests.swap(keyframe_requests);
+			scaleRequests.swap(scale_keyframe_requests);
+		}
+
+		// Keyframe blocks must line up with the Medium stream, and the users they're sent to with their tier's,
+		// or a move still held back on it would be applied on top of a block which already has it.
+		// So everything those tiers are holding goes out first.
+		std::array<bool, QualityTierCount> force {};
+		force[(std::size_t)QualityTier::Medium] = !stale.empty();
+
+		for(auto& request : requests)
+			force[(std::size_t)request.first] = true;
+
+		FlushTiers(now, force);
+		FlushScaled(now);
+		FlushKeyframe(stale);
+		ServeKeyframes(requests);
+		ServeScaleKeyframes(scaleRequests);
+	}
+
+	void VNCClient::FlushScaled(std::chrono::steady_clock::time_point now) {
+		using namespace std::chrono;
+
+		bool anyActive = false;
+
+		{
+			std::lock_guard<std::mutex> l(tier_lock);
+			for(auto& scale : scales)
+				anyActive |= scale.active;
+		}
+
+		const bool thumbnailDue = now - last_thumbnail >= tick_options->thumbnail_interval;
+
+		// Filtering isn't free, so damage is only brought down to the scaled desktops
+		// while a stream is watching, or the thumbnail is due.
+		if(!scaled_damage.Empty() && (anyActive || thumbnailDue)) {
+			std::vector<std::array<Rect, ScaledDesktop::MaxScale>> updated;
+
+			for(auto& rect : scaled_damage.Flush())
+				updated.push_back(scaled.Update(desktop, rect));
+
+			thumbnail_dirty = true;
+
+			std::lock_guard<std::mutex> l(tier_lock);
+
+			for(auto& levels : updated)
+				for(byte i = 0; i < ScaledDesktop::MaxScale; ++i)
+					if(scales[i].active && levels[i].Area())
+						scales[i].damage.Add(levels[i].x, levels[i].y, levels[i].width, levels[i].height);
+		}
+
+		if(anyActive) {
+			std::vector<std::pair<Rect, byte>> submit;
+
+			{
+				std::lock_guard<std::mutex> l(tier_lock);
+
+				// Scaled streams are paced like the Medium tier they're encoded at
+				auto interval = microseconds(1000000 / std::max<uint16>(tick_options->quality_tiers[(std::size_t)QualityTier::Medium].max_fps, 1));
+
+				for(byte i = 0; i < ScaledDesktop::MaxScale; ++i) {
+					auto& scale = scales[i];
+
+					if(!scale.active || scale.damage.Empty() || now - scale.last_flush < interval)
+						continue;
+
+					scale.last_flush = now;
+
+					for(auto& rect : scale.damage.Flush())
+						submit.push_back({ rect, (byte)(i + 1) });
+				}
+			}
+
+			for(auto& [rect, scale] : submit)
+				SubmitScaled(rect, scale);
+		}
+
+		if(thumbnailDue && thumbnail_dirty) {
+			last_thumbnail = now;
+			thumbnail_dirty = false;
+			SubmitThumbnail();
+		}
+	}
+
+	void VNCClient::SubmitScaled(const Rect& rect, byte scale, std::function<void(std::shared_ptr<VNCRegion>)> recipient) {
+		auto& level = scaled.Level(scale);
+
+		Rect band = rect;
+		uint16 bandHeight = rect.Area() > BandArea ? BandHeight : rect.height;
+
+		for(uint32 y = rect.y; y < rect.Bottom(); y += bandHeight) {
+			band.y = y;
+			band.height = std::min<uint32>(bandHeight, rect.Bottom() - y);
+
+			// Scaled desktops are small, so jobs get their own copy of the pixels
+			auto pixels = std::make_shared<Surface>(level.GetSubSurf(band.x, band.y, band.width, band.height).Clone());
+
+			if(!pixels->Valid())
+				continue;
+
+			EncoderPool::Get().Submit(encode_stream, [pixels, band, scale, recipient, options = tick_options]() {
+				auto region = EncodeClassified(*pixels, band, QualityTier::Medium, *options);
+
+				if(region) {
+					region->scale = scale;
+					region->recipient = recipient;
+				}
+
+				return region;
+			});
+		}
+	}
+
+	void VNCClient::SubmitThumbnail() {
+		// The smallest scale the desktop is big enough for
+		byte scale = ScaledDesktop::MaxScale;
+		while(scale > 0 && !scaled.Level(scale).Valid())
+			scale--;
+
+		if(scale == 0)
+			return;
+
+		auto& level = scaled.Level(scale);
+		auto pixels = std::make_shared<Surface>(level.GetSubSurf(0, 0, level.Width(), level.Height()).Clone());
+
+		if(!pixels->Valid())
+			return;
+
+		EncoderPool::Get().Submit(thumbnail_stream, [pixels, scale, options = tick_options]() {
+			auto region = EncodeRegion(*pixels, { 0, 0, pixels->Width(), pixels->Height() }, VNCClientOptions::OutputRegionType::JpegRegion, QualityTier::Medium, *options);
+
+			if(region)
+				region->scale = scale;
+
+			return region;
+		});
+	}
+
+	std::shared_ptr<Surface> VNCClient::TakePixels(const Rect& rect, Rect& source) {
+		// Jobs read from a snapshot of the whole desktop when one is free.
+		// Otherwise they get their own copy of the pixels.
+		if(auto frame = snapshots.Take(desktop)) {
+			source = rect;
+			return frame;
+		}
+
+		auto pixels = std::make_shared<Surface>(desktop.GetSubSurf(rect.x, rect.y, rect.width, rect.height).Clone());
+
+		if(!pixels->Valid())
+			return nullptr;
+
+		source = { 0, 0, rect.width, rect.height };
+		return pixels;
+	}
+
+	void VNCClient::FlushKeyframe(const std::vector<KeyframeCache::StaleBlock>& stale) {
+		for(auto& block : stale) {
+			Rect source;
+			auto frame = TakePixels(block.rect, source);
+
+			if(!frame)
+				continue;
+
+			EncoderPool::Get().Submit(encode_stream, [frame, source, block, options = tick_options]() {
+				auto pixels = frame->GetSubSurf(source.x, source.y, source.width, source.height);
+
+				if(!pixels.Valid())
+					return std::shared_ptr<VNCRegion>();
+
+				auto region = EncodeClassified(pixels, block.rect, QualityTier::Medium, *options);
+
+				if(region) {
+					region->keyframe = true;
+					region->keyframe_generation = block.generation;
+				}
+
+				return region;
+			});
+		}
+	}
+
+	void VNCClient::FlushTiers(std::chrono::steady_clock::time_point now, const std::array<bool, QualityTierCount>& force) {
+		using namespace std::chrono;
+
+		// Collect what to submit under the lock, but submit outside of it,
+		// since submitting blocks while the encoder queue is full.
+		// Pixels are copied at submission, so each frame encodes the latest pixels
+		// of everything damaged since the last one.
+		std::vector<std::pair<Rect, QualityTier>> submit;
+		std::vector<std::pair<CopyRect, QualityTier>> submitMoves;
+		std::vector<std::pair<Rect, QualityTier>> submitRefine;
+
+		// Refinement is low priority. It only goes ahead while
+		// the encoders have nothing else to do, and there's no fresh damage.
+		constexpr std::size_t MaxRefineTiles = 16;
+		const bool encodersIdle = EncoderPool::Get().QueueDepth() == 0;
+		std::vector<Rect> refine;
+
+		{
+			std::lock_guard<std::mutex> l(tier_lock);
+
+			for(std::size_t i = 0; i < tiers.size(); ++i) {
+				auto& tier = tiers[i];
+
+				if(!tier.active || (tier.damage.Empty() && tier.moves.empty()))
+					continue;
+
+				// Slower tiers keep collecting damage until their next frame is due
+				auto interval = microseconds(1000000 / std::max<uint16>(tick_options->quality_tiers[i].max_fps, 1));
+				if(now - tier.last_flush < interval && !force[i])
+					continue;
+
+				tier.last_flush = now;
+
+				for(auto& move : tier.moves)
+					submitMoves.push_back({ move, (QualityTier)i });
+				tier.moves.clear();
+
+				for(auto& rect : tier.damage.Flush())
+					submit.push_back({ rect, (QualityTier)i });
+			}
+
+			if(encodersIdle && submit.empty() && submitMoves.empty()) {
+				for(std::size_t i = 0; i < tiers.size(); ++i) {
+					auto& tier = tiers[i];
+
+					if(!tier.active || !tick_options->quality_tiers[i].refine || !tier.damage.Empty() || !tier.moves.empty())
+						continue;
+
+					refine.clear();
+					tier.refinement.TakeIdle(now - tick_options->refine_delay, MaxRefineTiles, refine);
+
+					for(auto& rect : refine)
+						submitRefine.push_back({ rect, (QualityTier)i });
+				}
+			}
+		}
+
+		// Moves go first; the damage was tracked as if they already happened
+		for(auto& [move, tier] : submitMoves)
+			SubmitMove(move, tier);
+
+		for(auto& [rect, tier] : submit)
+			SubmitRegion(rect, tier);
+
+		for(auto& [rect, tier] : submitRefine)
+			SubmitBands(rect, VNCClientOptions::OutputRegionType::QoiRegion, tier);
+	}
+
+	void VNCClient::SetTierActive(QualityTier tier, bool active) {
+		std::lock_guard<std::mutex> l(tier_lock);
+		auto& state = tiers[(std::size_t)tier];
+
+		if(state.active == active)
+			return;
+
+		state.active = active;
+
+		// Damage collected while inactive is stale;
+		// users moving to the tier ask for a refresh instead.
+		state.damage.Flush();
+		state.moves.clear();
+	}
+
+	void VNCClient::SetScaleActive(byte scale, bool active) {
+		if(scale == 0 || scale > ScaledDesktop::MaxScale)
+			return;
+
+		std::lock_guard<std::mutex> l(tier_lock);
+		auto& state = scales[scale - 1];
+
+		if(state.active == active)
+			return;
+
+		state.active = active;
+		state.damage.Flush();
+	}
+
+	template<class Function>
+	void VNCClient::ForEachBand(const Rect& rect, Function fun) {
+		Rect band = rect;
+		uint16 bandHeight = rect.Area() > BandArea ? BandHeight : rect.height;
+
+		for(uint32 y = rect.y; y < rect.Bottom(); y += bandHeight) {
+			band.y = y;
+			band.height = std::min<uint32>(bandHeight, rect.Bottom() - y);
+
+			// The desktop keeps changing while the job is waiting,
+			// so the job reads from a snapshot.
+			Rect source;
+			auto frame = TakePixels(band, source);
+
+			if(frame)
+				fun(band, frame, source);
+		}
+	}
+
+	void VNCClient::SubmitRegion(const Rect& rect, QualityTier tier) {
+		if(!tick_options->classify_regions) {
+			SubmitBands(rect, tick_options->output_region_type, tier);
+			return;
+		}
+
+		// Classifying reads every pixel, so it's done by the job, on the snapshot it encodes.
+		// That keeps it off the VNC client thread, and the classes match the pixels sent.
+		ForEachBand(rect, [&](const Rect& band, std::shared_ptr<Surface> frame, const Rect& source) {
+			EncoderPool::Get().SubmitBatch(encode_stream, [frame, source, band, tier, options = tick_options](std::vector<std::shared_ptr<VNCRegion>>& out) {
+				EncodeSplit(*frame, source, band, tier, *options, out);
+			});
+		});
+	}
+
+	void VNCClient::MarkSent(const VNCRegion& region) {
+		// Keyframe blocks and scaled streams aren't refined, and moves were tracked when they happened
+		if(region.keyframe || region.scale || region.region_type == VNCClientOptions::OutputRegionType::CopyRegion)
+			return;
+
+		const Rect rect { (uint16)region.x, (uint16)region.y, (uint16)region.width, (uint16)region.height };
+		const bool lossless = region.region_type != VNCClientOptions::OutputRegionType::JpegRegion;
+
+		std::lock_guard<std::mutex> l(tier_lock);
+		tiers[(std::size_t)region.tier].refinement.Sent(rect, lossless, std::chrono::steady_clock::now());
+	}
+
+	void VNCClient::RequestKeyframe(QualityTier tier, keyframe_callback_type callback) {
+		std::lock_guard<std::mutex> l(tier_lock);
+		keyframe_requests.push_back({ tier, callback });
+	}
+
+	void VNCClient::RequestScaleKeyframe(byte scale, keyframe_callback_type callback) {
+		if(scale == 0 || scale > ScaledDesktop::MaxScale)
+			return;
+
+		std::lock_guard<std::mutex> l(tier_lock);
+		scale_keyframe_requests.push_back({ scale, callback });
+	}
+
+	void VNCClient::ServeKeyframes(std::vector<std::pair<QualityTier, keyframe_callback_type>>& requests) {
+		if(requests.empty())
+			return;
+
+		std::vector<Rect> stale;
+		auto regions = std::make_shared<std::vector<std::shared_ptr<VNCRegion>>>(keyframe.Get(stale));
+		auto callbacks = std::make_shared<std::vector<keyframe_callback_type>>();
+
+		// Users on tiers which refine are sent lossless versions of the JPEG blocks too
+		auto refineCallbacks = std::make_shared<std::vector<keyframe_callback_type>>();
+		std::array<bool, QualityTierCount> requested {};
+
+		for(auto& [tier, callback] : requests) {
+			requested[(std::size_t)tier] = true;
+
+			if(tick_options->quality_tiers[(std::size_t)tier].refine)
+				refineCallbacks->push_back(callback);
+
+			callbacks->push_back(std::move(callback));
+		}
+
+		// The keyframe goes through the stream like any other region,
+		// so users get it after every update sent on their tier before it.
+		auto delivery = std::make_shared<VNCRegion>();
+		delivery->recipient = [regions, callbacks](std::shared_ptr<VNCRegion>) {
+			for(auto& callback : *callbacks)
+				callback(*regions);
+		};
+
+		SubmitDone(delivery);
+
+		// The users only have JPEG versions of some blocks.
+		// The blocks were idle to be cached, so they're refined right away,
+		// but only for these users; everyone else on their tiers has them already.
+		if(!refineCallbacks->empty()) {
+			auto refined = [refineCallbacks](std::shared_ptr<VNCRegion> region) {
+				const std::vector<std::shared_ptr<VNCRegion>> one { region };
+
+				for(auto& callback : *refineCallbacks)
+					callback(one);
+			};
+
+			for(auto& region : *regions) {
+				const Rect rect { (uint16)region->x, (uint16)region->y, (uint16)region->width, (uint16)region->height };
+
+				// Stale blocks are sent again anyway
+				if(region->region_type != VNCClientOptions::OutputRegionType::JpegRegion
+					|| std::any_of(stale.begin(), stale.end(), [&](const Rect& s) { return s.x == rect.x && s.y == rect.y; }))
+					continue;
+
+				ForEachBand(rect, [&](const Rect& band, std::shared_ptr<Surface> frame, const Rect& source) {
+					EncoderPool::Get().SubmitBatch(encode_stream, [frame, source, band, refined, options = tick_options](std::vector<std::shared_ptr<VNCRegion>>& out) {
+						EncodeTiles(*frame, source, band, VNCClientOptions::OutputRegionType::QoiRegion, QualityTier::Medium, *options, out);
+
+						for(auto& region : out)
+							region->recipient = refined;
+					});
+				});
+			}
+		}
+
+		// The screen may never be quiet long enough for these to be cached,
+		// so the users get them like any other damage on their tiers
+		std::lock_guard<std::mutex> l(tier_lock);
+
+		for(std::size_t i = 0; i < tiers.size(); ++i) {
+			if(!requested[i] || !tiers[i].active)
+				continue;
+
+			for(auto& rect : stale)
+				tiers[i].damage.Add(rect.x, rect.y, rect.width, rect.height);
+		}
+	}
+
+	void VNCClient::ServeScaleKeyframes(std::vector<std::pair<byte, keyframe_callback_type>>& requests) {
+		if(requests.empty())
+			return;
+
+		// Users asking for the same scale share its encode
+		std::array<std::shared_ptr<std::vector<keyframe_callback_type>>, ScaledDesktop::MaxScale> callbacks;
+
+		for(auto& [scale, callback] : requests) {
+			auto& list = callbacks[scale - 1];
+
+			if(!list)
+				list = std::make_shared<std::vector<keyframe_callback_type>>();
+
+			list->push_back(std::move(callback));
+		}
+
+		for(byte i = 0; i < ScaledDesktop::MaxScale; ++i) {
+			auto& level = scaled.Level(i + 1);
+
+			if(!callbacks[i] || !level.Valid())
+				continue;
+
+			auto recipient = [list = callbacks[i]](std::shared_ptr<VNCRegion> region) {
+				const std::vector<std::shared_ptr<VNCRegion>> one { region };
+
+				for(auto& callback : *list)
+					callback(one);
+			};
+
+			SubmitScaled({ 0, 0, level.Width(), level.Height() }, i + 1, recipient);
+		}
+	}
+
+	void VNCClient::SubmitBands(const Rect& rect, VNCClientOptions::OutputRegionType type, QualityTier tier) {
+		ForEachBand(rect, [&](const Rect& band, std::shared_ptr<Surface> frame, const Rect& source) {
+			EncoderPool::Get().SubmitBatch(encode_stream, [frame, source, band, type, tier, options = tick_options](std::vector<std::shared_ptr<VNCRegion>>& out) {
+				EncodeTiles(*frame, source, band, type, tier, *options, out);
+			});
+		});
+	}
+
+	void VNCClient::SubmitMove(const CopyRect& move, QualityTier tier) {
+		auto region = std::make_shared<VNCRegion>();
+
+		region->x = move.dest.x;
+		region->y = move.dest.y;
+		region->width = move.dest.width;
+		region->height = move.dest.height;
+		region->src_x = move.src_x;
+		region->src_y = move.src_y;
+		region->region_type = VNCClientOptions::OutputRegionType::CopyRegion;
+		region->tier = tier;
+
+		SubmitDone(region);
+	}
+
+	void VNCClient::SubmitDone(std::shared_ptr<VNCRegion> region) {
+		// Nothing to encode, but it still has to go through the stream
+		// to stay in order with the regions around it.
+		EncoderPool::Get().Submit(encode_stream, [region]() {
+			return region;
+		});
+	}
+
+	std::shared_ptr<VNCRegion> VNCClient::MakeFillRegion(const Rect& rect, uint32 color, QualityTier tier) {
+		auto region = std::make_shared<VNCRegion>();
+
+		region->x = rect.x;
+		region->y = rect.y;
+		region->width = rect.width;
+		region->height = rect.height;
+		region->color = color;
+		region->region_type = VNCClientOptions::OutputRegionType::FillRegion;
+		region->tier = tier;
+
+		return region;
+	}
+
+	VNCClientOptions::OutputRegionType VNCClient::RegionTypeFor(RegionClass type, const VNCClientOptions& options) {
+		switch(type) {
+			case RegionClass::Solid:
+				return VNCClientOptions::OutputRegionType::FillRegion;
+			case RegionClass::FewColors:
+				return VNCClientOptions::OutputRegionType::QoiRegion;
+			case RegionClass::Photo:
+			default:
+				return options.output_region_type;
+		}
+	}
+
+	std::shared_ptr<VNCRegion> VNCClient::EncodeClassified(Surface& pixels, const Rect& rect, QualityTier tier, const VNCClientOptions& options) {
+		if(!options.classify_regions)
+			return EncodeRegion(pixels, rect, options.output_region_type, tier, options);
+
+		thread_local RegionClassifier classifier;
+		auto result = classifier.Classify(pixels, { 0, 0, pixels.Width(), pixels.Height() });
+
+		if(result.type == RegionClass::Solid)
+			return MakeFillRegion(rect, result.color, tier);
+
+		return EncodeRegion(pixels, rect, RegionTypeFor(result.type, options), tier, options);
+	}
+
+	void VNCClient::EncodeTiles(Surface& frame, const Rect& source, const Rect& rect, VNCClientOptions::OutputRegionType type, QualityTier tier, const VNCClientOptions& options, std::vector<std::shared_ptr<VNCRegion>>& out) {
+		constexpr uint32 TileSize = EncodedTileCache::TileSize;
+
+		for(uint32 top = rect.y; top < rect.Bottom();) {
+			const uint32 bottom = std::min<uint32>((top / TileSize + 1) * TileSize, rect.Bottom());
+
+			for(uint32 left = rect.x; left < rect.Right();) {
+				const uint32 right = std::min<uint32>((left / TileSize + 1) * TileSize, rect.Right());
+				const Rect tile { (uint16)left, (uint16)top, (uint16)(right - left), (uint16)(bottom - top) };
+
+				auto pixels = frame.GetSubSurf(source.x + (left - rect.x), source.y + (top - rect.y), tile.width, tile.height);
+
+				if(pixels.Valid()) {
+					if(auto region = EncodeRegion(pixels, tile, type, tier, options))
+						out.push_back(region);
+				}
+
+				left = right;
+			}
+
+			top = bottom;
+		}
+	}
+
+	void VNCClient::EncodeSplit(Surface& frame, const Rect& source, const Rect& rect, QualityTier tier, const VNCClientOptions& options, std::vector<std::shared_ptr<VNCRegion>>& out) {
+		thread_local RegionClassifier classifier;
+		thread_local std::vector<ClassifiedRect> parts;
+
+		parts.clear();
+		classifier.Split(frame, source, parts);
+
+		for(auto& part : parts) {
+			const Rect where { (uint16)(part.rect.x - source.x + rect.x), (uint16)(part.rect.y - source.y + rect.y), part.rect.width, part.rect.height };
+
+			if(part.type == RegionClass::Solid) {
+				out.push_back(MakeFillRegion(where, part.color, tier));
+				continue;
+			}
+
+			EncodeTiles(frame, part.rect, where, RegionTypeFor(part.type, options), tier, options, out);
+		}
+	}
+
+	std::shared_ptr<VNCRegion> VNCClient::EncodeRegion(Surface& pixels, const Rect& rect, VNCClientOptions::OutputRegionType type, QualityTier tier, const VNCClientOptions& options) {
+		std::shared_ptr<VNCRegion> region = std::make_shared<VNCRegion>();
+
+		// Output sizes of recent regions this encoder thread encoded, per region type.
+		// Used to pick a buffer from the pool that most likely won't need to grow.
+		thread_local SizeEstimator jpegSizes;
+		thread_local SizeEstimator pngSizes;
+		thread_local SizeEstimator qoiSizes;
+
+		// Pixels which were on some screen before are shared out of the tile cache instead.
+		// The key also lets clients' tile caches recognize the region.
+		// Only tiles are cached anywhere, so larger regions aren't hashed at all.
+		const byte quality = type == VNCClientOptions::OutputRegionType::JpegRegion ? options.JpegQuality(tier) : 0;
+		const bool tile = (uint32)pixels.Width() * pixels.Height() <= EncodedTileCache::MaxTileArea;
+		auto& cache = EncodedTileCache::Get();
+		const bool useCache = tile && cache.Enabled();
+		EncodedTileCache::data_type cached;
+		TileKey key {};
+
+		if(tile)
+			key = TileKey::Make(pixels, (byte)type, quality);
+
+		if(useCache)
+			cached = cache.Find(key);
+
+		if(cached) {
+			region->shared_data = std::move(cached);
+		} else {
+			switch(type) {
+			
+			case VNCClientOptions::OutputRegionType::JpegRegion: {
+				// The compressor is reused for every region this encoder thread encodes
+				thread_local JpegEncoder jpeg;
+
+				region->data = BufferPool::Get().Acquire(jpegSizes.Estimate());
+
+				if(!jpeg.Encode(pixels, quality, region->data))
+					return nullptr;
+
+				jpegSizes.Record(region->data.size());
+			} break;
+
+			case VNCClientOptions::OutputRegionType::PngRegion: {
+				region->data = BufferPool::Get().Acquire(pngSizes.Estimate());
+
+				cairo_write_data writeData { &region->data };
+				auto cairos = pixels.Raw();
+
+				if(cairo_surface_write_to_png_stream(cairos, cairo_write_func, &writeData) != CAIRO_STATUS_SUCCESS)
+					return nullptr;
+
+				pngSizes.Record(region->data.size());
+			} break;
+
+			case VNCClientOptions::OutputRegionType::QoiRegion: {
+				region->data = BufferPool::Get().Acquire(qoiSizes.Estimate());
+
+				if(!EncodeQoi(pixels, region->data))
+					return nullptr;
+
+				qoiSizes.Record(region->data.size());
+			} break;
+
+			default:
+				return nullptr;
+				break;
+			}
+		}
+
+		// The encoded buffer itself goes into the cache, and the region shares it
+		if(useCache && !region->shared_data && region->data.size() <= EncodedTileCache::MaxTileBytes) {
+			region->shared_data = std::make_shared<const OutputBuffer>(std::move(region->data));
+			region->data = OutputBuffer();
+			cache.Insert(key, region->shared_data);
+		}
+
+		// now we have the encoded region.
+		// so we set the region
+		region->x = rect.x;
+		region->y = rect.y;
+		region->width = pixels.Width();
+		region->height = pixels.Height();
+		region->region_type = type;
+		region->tier = tier;
+		region->content = key;
+		region->cacheable = tile;
+
+		return region;
+	}
+
+	VNCClient::~VNCClient() {
+		if(framebuffer_bytes)
+			framebuffer_bytes->Set(0);
+
+		if(client) {
+			// free our strdup()'d hostname string to avoid memory leaking
+			free(client->serverHost);
+			rfbClientCleanup(client);
+		}
+	}
+
+	void VNCClient::Connect() {
+		// Connect() simply starts the thread.
+		vnc_thread = std::thread(&VNCClient::ClientThread, shared_from_this());
+		vnc_thread.detach();
+	}
+
+	
+	void VNCClient::SetOptions(VNCClientOptions& new_options) {
+		auto snapshot = std::make_shared<const VNCClientOptions>(new_options);
+
+		std::lock_guard<std::mutex> l(state_lock);
+		options = std::move(snapshot);
+	}
+
+	void VNCClient::TakeOptions() {
+		std::lock_guard<std::mutex> l(state_lock);
+		tick_options = options;
+	}
+
+	void VNCClient::ClientThread() {
+
+		// Set state, locking the state mutex
+		auto SetState = [&](State newState) {
+			std::lock_guard<std::mutex> l(state_lock);
+			current_state = newState;
+
+			if(OnStateChange)
+				OnStateChange();
+		};
+
+		SetState(State::ConnectingToServer);
+		TakeOptions();
+
+		// Deliver encoded regions to OnScreenUpdate.
+		// Jobs can outlive us, so don't keep ourselves alive from them.
+		std::weak_ptr<VNCClient> weak = shared_from_this();
+		encode_stream = std::make_shared<EncodeStream>([weak](std::shared_ptr<VNCRegion> region) {
+			auto self = weak.lock();
+
+			if(!self)
+				return;
+
+			if(region->recipient) {
+				region->recipient(region);
+				return;
+			}
+
+			if(region->keyframe) {
+				self->keyframe.Store(region);
+				return;
+			}
+
+			self->MarkSent(*region);
+
+			if(self->OnScreenUpdate)
+				self->OnScreenUpdate(region);
+		});
+
+		thumbnail_stream = std::make_shared<EncodeStream>([weak](std::shared_ptr<VNCRegion> region) {
+			auto self = weak.lock();
+
+			if(!self)
+				return;
+
+			std::lock_guard<std::mutex> l(self->thumbnail_lock);
+			self->thumbnail = region;
+		});
+
+		framebuffer_bytes = &Metrics::Get("framebuffer_bytes{vnc=\"" + tick_options->hostname + ":" + std::to_string(tick_options->port) + "\"}");
+
+		// get a 32bpp client & set the client data
+		client = rfbGetClient(8, 3, 4);
+		rfbClientSetClientData(client, (void*)&VNCCLIENT_KEY, this);
+
+		client->serverHost = strdup(tick_options->hostname.data());
+		client->serverPort = tick_options->port;
+
+		if(tick_options->register_qemu_audio) {
+			logger.info("Registering QEMU Audio extension");
+		}
+
+		// rfbInitClient() already allocates the framebuffer,
+		// so our callbacks need to be set up before it's called.
+		client->canHandleNewFBSize = TRUE;
+		client->MallocFrameBuffer = ResizeSurface;
+		client->GotFrameBufferUpdate = UpdateSurface;
+		client->FinishedFrameBufferUpdate = FinishedUpdate;
+		client->GotCopyRect = CopySurface;
+
+		if(rfbInitClient(client, 0, NULL)) {
+			// Initalization succedded
+			
+			// mark client as connected
+			SetState(State::Connected);
+
+			// go into a loop, waiting and handling server messages.
+			// The wait ends when the next frame is due,
+			// so that damage held back by the scheduler is sent on time.
+			while(true) {
+				auto wait = scheduler.UntilNextTick(std::chrono::steady_clock::now());
+				auto wait_us = std::clamp<int64>(wait.count(), 1000, 100 * 1000);
+
+				int i = WaitForMessage(client, wait_us);
+				if(i < 0)
+					break;
+
+				if(i > 0 && !HandleRFBServerMessage(client))
+					break;
+
+				Tick();
+			}
+
+			// if we broke out of the above loop,
+			// it's probably because we disconnected.
+			SetState(State::Disconnected);
+			
+			
+		} else {
+			// client initalization failed
+			SetState(State::Disconnected);
+			return;
+		}
+	}
 }
\ No newline at end of file
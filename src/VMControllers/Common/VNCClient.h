@@ -1,156 +1,510 @@
-#include <Common.h>
-#include <Logger.h>
-#include <rfb/rfbclient.h>
-#include "Surface.h"
-
-namespace CollabVM {
-	
-	// Default JPEG quality.
-	// Tuned for a mix of performance and quality.
-	constexpr byte DEFAULT_JPEG_QUALITY = 65;
-
-	// Options that the VNC Client can be configured to use.
-	struct VNCClientOptions {
-
-		// Hostname of the VNC server.
-		std::string hostname;
-
-		// Port of the VNC server.
-		uint16 port;
-
-		// Password.
-		// Leave blank if one isn't needed to connect.
-		std::string password;
-
-		// Amount of times we should retry the VNC connection before giving up and
-		// leaving the state as disconnected.
-		uint16 retry_count;
-
-		// Set this to true if you want to register the QEMU audio extension.
-		//
-		// Please note that registering the extension is *not* the same as requiring the extension; 
-		// the client extension is only invoked if requested. 
-		//
-		// If you encounter a problematic VNC server, this can be turned off; 
-		// however, I have doubts that many VNC servers
-		// would be problematic or stupid enough to clobber over this extension.
-		bool register_qemu_audio;
-
-		// The image format that the VNC Client
-		// should output regions as. This is configurable per-VNC client.
-		enum class OutputRegionType {
-			// Use PNG to encode regions.
-			// Higher quality, but it may use more bandwidth.
-			PngRegion,
-
-			// Use JPEG to encode regions.
-			// Not lossless like PNG, however far smaller.
-			JpegRegion
-		} output_region_type;
-
-		// JPEG region compression quality.
-		// This field is only applicable if output_region_type is JpegRegion, and is ignored otherwise.
-		byte jpeg_compression_quality;
-
-	};
-
-	// Region data structure
-	struct VNCRegion {
-		// Where the region updated.
-		int16 x;
-		int16 y;
-
-		// The width and height of the region.
-		int16 width;
-		int16 height;
-
-		// Active region type (what the data buffer will contain.)
-		VNCClientOptions::OutputRegionType region_type;
-
-		// Data buffer of the region (copied from the total data buffer), encoded into the proper region type.
-		std::vector<byte> data;
-	};
-
-	struct VNCCursor {
-		// The width and height of the region.
-		int16 width;
-		int16 height;
-
-		// Cursor surface. It's up to the user of this client
-		// to figure out what to do with the surface
-		// (I mean, to be fair, cursors could be sent uncompressed.)
-		Surface& surface;
-	};
-
-	// VNC Client object.
-	struct VNCClient : public std::enable_shared_from_this<VNCClient> {
-		friend rfbBool ResizeSurface(rfbClient* client);
-		friend void UpdateSurface(rfbClient* client, int x, int y, int w, int h);
-
-		enum class State : byte {
-			Disconnected,
-			ConnectingToServer,
-			Connected
-		};
-
-		~VNCClient();
-
-		// "asynchronously" start connecting to the VNC server.
-		// Spawns a new thread.
-		void Connect();
-
-		void SetOptions(VNCClientOptions& new_options);
-	
-		// returns current state
-		inline State GetState() {
-			// State is modified by the client thread.
-			std::lock_guard<std::mutex> l(state_lock);
-			return current_state;
-		}
-
-
-		// Function callbacks.
-		// These run on the VNC client thread
-		
-		std::function<void()> OnStateChange;
-
-		std::function<void()> OnConnect;
-		std::function<void()> OnClose;
-		std::function<void(std::shared_ptr<VNCRegion>)> OnScreenUpdate;
-
-		// cursor is bound to be small (128*128 max is sensible)
-		// so we don't handle encoding it ourselves.
-		std::function<void(std::shared_ptr<VNCCursor>)> OnCursorUpdate;
-
-	private:
-
-		void ClientThread();
-		
-		// lock controlling state,
-		// this should be renamed as it's client wide
-		std::mutex state_lock;
-
-		std::thread vnc_thread;
-
-		// friend members may need this
-	protected:
-
-		State current_state = State::Disconnected;
-
-		// The options that this VNC Client is using.
-		VNCClientOptions options;
-
-		// libvncclient client object
-		rfbClient* client;
-		
-		// Cursor surface
-		Surface cursor;
-
-		// desktop surface
-		Surface desktop;
-
-		// logger channel instance
-		Logger logger = Logger::GetLogger("VNCClient");
-	};
-
+#pragma once
+#include <Common.h>
+#include <Logger.h>
+#include <Metrics.h>
+#include <rfb/rfbclient.h>
+#include "Surface.h"
+#include "DamageRegion.h"
+#include "TileTracker.h"
+#include "MoveDetector.h"
+#include "RegionClassifier.h"
+#include "RefinementTracker.h"
+#include "FrameSnapshots.h"
+#include "ScaledDesktop.h"
+#include "TileCache.h"
+#include "EncoderPool.h"
+#include "BufferPool.h"
+#include "QualityTier.h"
+#include "KeyframeCache.h"
+#include "FrameScheduler.h"
+
+namespace CollabVM {
+	
+	// Default JPEG quality.
+	// Tuned for a mix of performance and quality.
+	constexpr byte DEFAULT_JPEG_QUALITY = 65;
+
+	// Settings of a QualityTier.
+	struct QualityTierOptions {
+		// JPEG quality regions of this tier are encoded at
+		byte jpeg_quality;
+
+		// Most times per second regions of this tier are sent
+		uint16 max_fps;
+
+		// Whether tiles sent as JPEG are sent again losslessly once they stop changing.
+		// Lossless tiles are a lot larger, so slow links are better off without.
+		bool refine;
+	};
+
+	// Options that the VNC Client can be configured to use.
+	struct VNCClientOptions {
+
+		// Hostname of the VNC server.
+		std::string hostname;
+
+		// Port of the VNC server.
+		uint16 port;
+
+		// Password.
+		// Leave blank if one isn't needed to connect.
+		std::string password;
+
+		// Amount of times we should retry the VNC connection before giving up and
+		// leaving the state as disconnected.
+		uint16 retry_count;
+
+		// Set this to true if you want to register the QEMU audio extension.
+		//
+		// Please note that registering the extension is *not* the same as requiring the extension; 
+		// the client extension is only invoked if requested. 
+		//
+		// If you encounter a problematic VNC server, this can be turned off; 
+		// however, I have doubts that many VNC servers
+		// would be problematic or stupid enough to clobber over this extension.
+		bool register_qemu_audio;
+
+		// The image format that the VNC Client
+		// should output regions as. This is configurable per-VNC client.
+		enum class OutputRegionType {
+			// Use PNG to encode regions.
+			// Higher quality, but it may use more bandwidth.
+			PngRegion,
+
+			// Use JPEG to encode regions.
+			// Not lossless like PNG, however far smaller.
+			JpegRegion,
+
+			// Use QOI to encode regions.
+			// Lossless like PNG, but encodes several times faster,
+			// at the cost of larger output for photographic content.
+			// See QoiEncoder.h for the format.
+			QoiRegion,
+
+			// Not an output format, so don't configure this.
+			// Marks regions which copy pixels already on the screen
+			// (from src_x/src_y) instead of carrying encoded data.
+			CopyRegion,
+
+			// Not an output format either.
+			// Marks regions of a single colour, which carry no data.
+			FillRegion
+		} output_region_type;
+
+		// JPEG region compression quality.
+		// This field is only applicable if output_region_type is JpegRegion, and is ignored otherwise.
+		// This is the quality of the Medium tier, which every user starts at.
+		byte jpeg_compression_quality;
+
+		// Settings of each QualityTier.
+		// The Medium tier's jpeg_quality is ignored in favour of jpeg_compression_quality.
+		std::array<QualityTierOptions, QualityTierCount> quality_tiers = {{
+			{ 35, 5, false },
+			{ DEFAULT_JPEG_QUALITY, 15, true },
+			{ 85, 30, true }
+		}};
+
+		// How long a tile has to stay the same before it's refined.
+		std::chrono::milliseconds refine_delay = std::chrono::milliseconds(1000);
+
+		// Pick the codec of each tile by what it holds:
+		// solid tiles become fills, tiles with few colours are sent losslessly as QOI,
+		// and only the rest use output_region_type.
+		bool classify_regions = true;
+
+		// Most frames per second sent on any tier.
+		// Frames run at half this rate unless a user just sent input; see FrameScheduler.
+		uint16 max_fps = 30;
+
+		// Most often the VM thumbnail is encoded again, while the screen changes.
+		std::chrono::milliseconds thumbnail_interval = std::chrono::milliseconds(2000);
+
+		inline byte JpegQuality(QualityTier tier) const {
+			if(tier == QualityTier::Medium)
+				return jpeg_compression_quality;
+
+			return quality_tiers[(std::size_t)tier].jpeg_quality;
+		}
+
+	};
+
+	// Region data structure
+	struct VNCRegion {
+		// Where the region updated.
+		int16 x;
+		int16 y;
+
+		// The width and height of the region.
+		int16 width;
+		int16 height;
+
+		// Active region type (what the data buffer will contain.)
+		VNCClientOptions::OutputRegionType region_type;
+
+		// Where the pixels of a CopyRegion are copied from.
+		int16 src_x = 0;
+		int16 src_y = 0;
+
+		// Colour of a FillRegion, as 0xRRGGBB.
+		uint32 color = 0;
+
+		// Quality tier the region was encoded for.
+		QualityTier tier = QualityTier::Medium;
+
+		// Scale of the stream the region belongs to (see ScaledDesktop).
+		// 0 is the full size desktop; otherwise the position and size are on the scaled desktop.
+		byte scale = 0;
+
+		// True if this region is a block of the keyframe cache,
+		// rather than an update to broadcast.
+		bool keyframe = false;
+
+		// Generation of the keyframe block this region was encoded from
+		uint64 keyframe_generation = 0;
+
+		// Set for regions meant for a single user, such as a joining user's keyframe.
+		// When its turn in the stream comes, the region is handed to this instead of OnScreenUpdate.
+		std::function<void(std::shared_ptr<VNCRegion>)> recipient;
+
+		// What the region holds, for clients' tile caches.
+		// Only set if cacheable is true, which only tiles are (see EncodedTileCache::MaxTileArea).
+		TileKey content {};
+		bool cacheable = false;
+
+		// Data buffer of the region, encoded into the proper region type.
+		// Taken from the BufferPool, and given back to it when the region is destroyed.
+		// Empty if shared_data is set.
+		OutputBuffer data;
+
+		// Encoded data shared with the EncodedTileCache, if the region is in it
+		EncodedTileCache::data_type shared_data;
+
+		// Get the encoded data of the region.
+		inline const OutputBuffer& Data() const {
+			return shared_data ? *shared_data : data;
+		}
+
+		inline ~VNCRegion() {
+			BufferPool::Get().Release(std::move(data));
+		}
+	};
+
+	struct VNCCursor {
+		// The width and height of the region.
+		int16 width;
+		int16 height;
+
+		// Cursor surface. It's up to the user of this client
+		// to figure out what to do with the surface
+		// (I mean, to be fair, cursors could be sent uncompressed.)
+		Surface& surface;
+	};
+
+	// VNC Client object.
+	struct VNCClient : public std::enable_shared_from_this<VNCClient> {
+		friend rfbBool ResizeSurface(rfbClient* client);
+		friend void UpdateSurface(rfbClient* client, int x, int y, int w, int h);
+		friend void CopySurface(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y);
+		friend void FinishedUpdate(rfbClient* client);
+
+		enum class State : byte {
+			Disconnected,
+			ConnectingToServer,
+			Connected
+		};
+
+		~VNCClient();
+
+		// "asynchronously" start connecting to the VNC server.
+		// Spawns a new thread.
+		void Connect();
+
+		void SetOptions(VNCClientOptions& new_options);
+
+		// Set whether regions are encoded for the given quality tier.
+		// Tiers nobody is in should be turned off, so they aren't encoded for nothing.
+		// Every tier starts off; the VMController turns tiers on as users are counted in them.
+		void SetTierActive(QualityTier tier, bool active);
+
+		// Set whether regions are encoded for the scaled stream of the given scale (1 to ScaledDesktop::MaxScale).
+		// Scaled streams are encoded at the Medium tier's quality.
+		void SetScaleActive(byte scale, bool active);
+
+		// Get the last encoded thumbnail of the screen (a JPEG of the smallest scale),
+		// or nullptr if there isn't one yet.
+		inline std::shared_ptr<VNCRegion> GetThumbnail() {
+			std::lock_guard<std::mutex> l(thumbnail_lock);
+			return thumbnail;
+		}
+
+		// Note that a user sent input to the VM,
+		// so frames are sent at the maximum rate for a while.
+		inline void NotifyInput() {
+			scheduler.OnInput();
+		}
+
+		typedef std::function<void(const std::vector<std::shared_ptr<VNCRegion>>&)> keyframe_callback_type;
+
+		// Get the whole screen, encoded at the Medium tier, for one user on the given tier,
+		// e.g because they just joined, moved to the tier, or caught up after dropping updates.
+		// Nobody else on the tier is sent anything again.
+		// This is served from a cache, so it's cheap even if many users join at once.
+		// On the next frame, callback is called with every cached block, in order with the tier's updates,
+		// and the blocks which were out of date are then sent again on the tier, as ordinary damage.
+		// If the tier refines, callback is called again with lossless versions of the JPEG blocks.
+		// See KeyframeCache::Get().
+		void RequestKeyframe(QualityTier tier, keyframe_callback_type callback);
+
+		// Get the whole scaled desktop of a scaled stream for one user on it.
+		// Scaled desktops aren't cached, so on the next frame they're encoded for the users who asked,
+		// and callback is called with each region, in order with the stream's updates.
+		void RequestScaleKeyframe(byte scale, keyframe_callback_type callback);
+	
+		// returns current state
+		inline State GetState() {
+			// State is modified by the client thread.
+			std::lock_guard<std::mutex> l(state_lock);
+			return current_state;
+		}
+
+
+		// Function callbacks.
+		// These run on the VNC client thread,
+		// except for OnScreenUpdate, which runs on an encoder pool thread.
+		// Screen updates are still delivered one at a time, in order.
+		
+		std::function<void()> OnStateChange;
+
+		std::function<void()> OnConnect;
+		std::function<void()> OnClose;
+		std::function<void(std::shared_ptr<VNCRegion>)> OnScreenUpdate;
+
+		// cursor is bound to be small (128*128 max is sensible)
+		// so we don't handle encoding it ourselves.
+		std::function<void(std::shared_ptr<VNCCursor>)> OnCursorUpdate;
+
+	private:
+
+		void ClientThread();
+
+		// Take a snapshot of the options into tick_options.
+		void TakeOptions();
+
+		// Hand moves and damage to every active tier.
+		// Moves happened before the damage.
+		void AccumulateDamage(const std::vector<CopyRect>& moves, const std::vector<Rect>& rects);
+
+		// If a frame is due, submit the damage of every tier whose own frame interval has passed,
+		// and refresh the keyframe if it's time to.
+		void Tick();
+
+		// Submit the damage of every tier whose frame interval has passed.
+		// The moves and damage of tiers set in force are submitted regardless.
+		void FlushTiers(std::chrono::steady_clock::time_point now, const std::array<bool, QualityTierCount>& force);
+
+		// Bring the scaled desktops up to date if anything needs them,
+		// then submit the damage of every scaled stream whose frame interval has passed,
+		// and the thumbnail if it's time to.
+		void FlushScaled(std::chrono::steady_clock::time_point now);
+
+		// Queue a rectangle of a scaled desktop to be encoded for its stream,
+		// or only for recipient if it's set (see VNCRegion::recipient).
+		void SubmitScaled(const Rect& rect, byte scale, std::function<void(std::shared_ptr<VNCRegion>)> recipient = nullptr);
+
+		// Queue the smallest scaled desktop to be encoded as the thumbnail.
+		void SubmitThumbnail();
+
+		// Queue the given damage of the desktop surface to be encoded for a tier.
+		// If regions are classified, every band is split up by what it holds on the encoder thread,
+		// from the same snapshot it's encoded from.
+		void SubmitRegion(const Rect& rect, QualityTier tier);
+
+		// Queue a rectangle of the desktop surface to be encoded as the given region type,
+		// split up so it can be encoded in parallel.
+		void SubmitBands(const Rect& rect, VNCClientOptions::OutputRegionType type, QualityTier tier);
+
+		// Split a rectangle of the desktop surface into bands, and call fun(band, frame, source)
+		// for each with a snapshot of its pixels, which are at source in frame.
+		template<class Function>
+		void ForEachBand(const Rect& rect, Function fun);
+
+		// Queue a move to be sent on a tier, in order with its encoded regions.
+		void SubmitMove(const CopyRect& move, QualityTier tier);
+
+		// Queue a region which needs no encoding, in order with the regions around it.
+		void SubmitDone(std::shared_ptr<VNCRegion> region);
+
+		// Record what fidelity a region was sent at on its tier, for refinement.
+		// Called as regions are delivered, so the latest region sent always wins.
+		void MarkSent(const VNCRegion& region);
+
+		// Get pixels of the desktop surface for a job to encode, as they are now.
+		// The pixels of rect are at source in the returned surface.
+		std::shared_ptr<Surface> TakePixels(const Rect& rect, Rect& source);
+
+		// Queue stale keyframe blocks to be encoded.
+		// The Medium tier must have been flushed right before, so that the blocks
+		// have exactly what the Medium stream sent up to them (see Tick()).
+		void FlushKeyframe(const std::vector<KeyframeCache::StaleBlock>& stale);
+
+		// Send the keyframe to users who asked for it, in order with their tiers.
+		// This needs the tiers of the requests flushed right before.
+		void ServeKeyframes(std::vector<std::pair<QualityTier, keyframe_callback_type>>& requests);
+
+		// Encode the scaled desktops users asked for, for only them.
+		// The scaled desktops must have been brought up to date right before.
+		void ServeScaleKeyframes(std::vector<std::pair<byte, keyframe_callback_type>>& requests);
+
+		// Encode a copy of a rectangle of the desktop surface into a region of the given type.
+		// Returns nullptr if the rectangle could not be encoded.
+		static std::shared_ptr<VNCRegion> EncodeRegion(Surface& pixels, const Rect& rect, VNCClientOptions::OutputRegionType type, QualityTier tier, const VNCClientOptions& options);
+
+		// Encode a copy of a rectangle of the desktop surface, classifying it as a whole first.
+		static std::shared_ptr<VNCRegion> EncodeClassified(Surface& pixels, const Rect& rect, QualityTier tier, const VNCClientOptions& options);
+
+		// Encode the pixels at source in frame as tiles (see EncodedTileCache::TileSize) added to out.
+		// rect is where source is on the desktop.
+		static void EncodeTiles(Surface& frame, const Rect& source, const Rect& rect, VNCClientOptions::OutputRegionType type, QualityTier tier, const VNCClientOptions& options, std::vector<std::shared_ptr<VNCRegion>>& out);
+
+		// Classify the tiles of the pixels at source in frame, and encode each run of tiles
+		// of the same class into tiles added to out. rect is where source is on the desktop.
+		static void EncodeSplit(Surface& frame, const Rect& source, const Rect& rect, QualityTier tier, const VNCClientOptions& options, std::vector<std::shared_ptr<VNCRegion>>& out);
+
+		// The region type content of the given class is sent as.
+		static VNCClientOptions::OutputRegionType RegionTypeFor(RegionClass type, const VNCClientOptions& options);
+
+		static std::shared_ptr<VNCRegion> MakeFillRegion(const Rect& rect, uint32 color, QualityTier tier);
+
+		// Large regions are split into bands of rows this tall,
+		// so that the encoder pool can encode them in parallel.
+		constexpr static uint32 BandArea = 256 * 256;
+		constexpr static uint16 BandHeight = 128;
+
+		// Per quality tier state
+		struct TierState {
+			// Moves held back before sending fall back to damage past this amount
+			constexpr static std::size_t MaxPendingMoves = 16;
+
+			bool active = false;
+
+			// Moves which haven't been sent on this tier yet, in order.
+			// They're sent before damage.
+			std::vector<CopyRect> moves;
+
+			// Damage which hasn't been sent on this tier yet
+			DamageRegion damage;
+
+			// Which tiles were sent lossy, to refine once they're idle
+			RefinementTracker refinement;
+
+			std::chrono::steady_clock::time_point last_flush;
+		};
+
+		// locks tiers
+		std::mutex tier_lock;
+
+		std::array<TierState, QualityTierCount> tiers;
+
+		// Users waiting for the keyframe, and the tier each is on, served on the next frame.
+		// Locked by tier_lock
+		std::vector<std::pair<QualityTier, keyframe_callback_type>> keyframe_requests;
+
+		// Users waiting for a scaled desktop, and its scale. Locked by tier_lock
+		std::vector<std::pair<byte, keyframe_callback_type>> scale_keyframe_requests;
+
+		// Per scaled stream state, locked by tier_lock.
+		// Index 0 is scale 1.
+		struct ScaleState {
+			bool active = false;
+
+			// Damage of the scaled desktop which hasn't been sent yet
+			DamageRegion damage;
+
+			std::chrono::steady_clock::time_point last_flush;
+		};
+
+		std::array<ScaleState, ScaledDesktop::MaxScale> scales;
+
+		// locks thumbnail
+		std::mutex thumbnail_lock;
+
+		std::shared_ptr<VNCRegion> thumbnail;
+		
+		// lock controlling state,
+		// this should be renamed as it's client wide
+		std::mutex state_lock;
+
+		std::thread vnc_thread;
+
+		// friend members may need this
+	protected:
+
+		State current_state = State::Disconnected;
+
+		// The options that this VNC Client is using. Locked by state_lock.
+		// SetOptions() replaces them as a whole, so a snapshot can be shared by jobs instead of copied.
+		std::shared_ptr<const VNCClientOptions> options = std::make_shared<const VNCClientOptions>();
+
+		// Snapshot of options for the current tick, and what its jobs are submitted with.
+		// Only touched by the client thread
+		std::shared_ptr<const VNCClientOptions> tick_options;
+
+		// libvncclient client object
+		rfbClient* client;
+		
+		// Cursor surface
+		Surface cursor;
+
+		// desktop surface
+		Surface desktop;
+
+		// Damage of the framebuffer update currently being received, as the VNC server reported it
+		DamageRegion damage;
+
+		// Damage of the update where the pixels actually changed
+		DamageRegion changed;
+
+		// Moves of the framebuffer update currently being received
+		std::vector<CopyRect> update_moves;
+
+		// Filters out damage where the pixels did not actually change
+		TileTracker tiles;
+
+		// Copies of the desktop surface for encoders to read from
+		FrameSnapshots snapshots;
+
+		// Finds scrolling in damage, so it can be sent as moves
+		MoveDetector move_detector;
+
+		// Reduced resolution copies of the desktop, for scaled streams and the thumbnail
+		ScaledDesktop scaled;
+
+		// Damage of the desktop which isn't in the scaled desktops yet.
+		// They're only brought up to date while something uses them.
+		DamageRegion scaled_damage;
+
+		// Whether the scaled desktops changed since the thumbnail was last encoded
+		bool thumbnail_dirty = false;
+
+		std::chrono::steady_clock::time_point last_thumbnail;
+
+		// Encoded full screen for joining users
+		KeyframeCache keyframe;
+
+		// Paces frames. Only touched by the client thread (except NotifyInput())
+		FrameScheduler scheduler;
+
+		// Stream our regions are encoded on
+		std::shared_ptr<EncodeStream> encode_stream;
+
+		// Stream thumbnails are encoded on, so they never hold up screen updates
+		std::shared_ptr<EncodeStream> thumbnail_stream;
+
+		// Memory taken up by copies of our framebuffer (the desktop, its shadow copy, snapshots, and scaled desktops)
+		Metrics::Metric* framebuffer_bytes = nullptr;
+
+		// logger channel instance
+		Logger logger = Logger::GetLogger("VNCClient");
+	};
+
 }
\ No newline at end of file
@@ -1,305 +1,538 @@
-#include "WebsocketServer.h"
-
-using namespace std::placeholders;
-
-namespace CollabVM {
-
-	inline void ConfigureStream(ws::stream<beast::tcp_stream>& stream) {
-		// Enable the WebSocket permessage deflate extension.
-		ws::permessage_deflate pmd;
-		pmd.client_enable = true;
-		pmd.server_enable = true;
-		pmd.compLevel = 3;
-		stream.set_option(pmd);
-
-		stream.auto_fragment(false);
-	}
-
-	// return a mime type for the specific file
-	inline beast::string_view MimeType(beast::string_view path) {
-		auto ext = [&path] {
-			auto const pos = path.rfind(".");
-			if(pos == beast::string_view::npos)
-				return beast::string_view{};
-			return path.substr(pos);
-		}();
-#define EXT(extension, mime) if(beast::iequals(ext, extension)) return mime;
-		// Subset that should be "good" enough
-		EXT(".htm", "text/html")
-		EXT(".html", "text/html")
-		EXT(".css", "text/css")
-		EXT(".txt", "text/plain")
-		EXT(".js", "application/javascript")
-		EXT(".json", "application/json")
-		EXT(".png", "image/png")
-		EXT(".ico", "image/vnd.microsoft.icon")
-#undef EXT
-		return "application/text";
-	}
-
-
-	// WSSession
-
-	void WSSession::Run(http::request<http::string_body> req) {
-		// already running on the right strand
-		SessionStart(req);
-	}
-
-	void WSSession::SessionStart(http::request<http::string_body> req) {
-		ConfigureStream(stream);
-
-		stream.set_option(ws::stream_base::timeout::suggested(beast::role_type::server));
-
-		stream.set_option(ws::stream_base::decorator([&](ws::response_type& res) {
-			// Set the subprotocol if we need to
-			if(!subprotocol.empty())
-				res.set(http::field::sec_websocket_protocol, subprotocol);
-
-			
-			// TODO(maybe): Add version information
-			res.set(http::field::server, "collab-vm-server/2.0");
-		}));
-
-		stream.async_accept(req, beast::bind_front_handler(&WSSession::OnAccept, shared_from_this()));
-	}
-
-	ws::stream<beast::tcp_stream>& WSSession::GetStream() {
-		return stream;
-	}
-
-	void WSSession::OnAccept(beast::error_code ec) {
-		if(ec)
-			return;
-
-		logger.verbose("Accepted session for ", GetAddress().to_string());
-
-		server->OnOpen(shared_from_this());
-
-		Read();
-	}
-
-	void WSSession::Read() {
-		// make message
-		auto message = std::make_shared<WSMessage>();
-
-		stream.async_read(message->buffer, beast::bind_front_handler(&WSSession::OnRead, shared_from_this(), message));
-	}
-
-	void WSSession::OnRead(WebsocketServer::message_type message, beast::error_code ec, std::size_t bytes_transferred) {
-		if(ec == ws::error::closed) {
-			message.reset();
-			server->OnClose(shared_from_this());
-			return;
-		}
-
-		if(ec)
-			return;
-
-		message->binary = stream.got_binary();
-
-		server->OnMessage(shared_from_this(), message);
-
-		Read();
-	}
-
-	void WSSession::Send(WebsocketServer::message_type message) {
-		if(!message) {
-			// NOTE: If this happens, there's probably a lot more wrong, but instead of crashing on this
-			// we'll crash on what might actually be breaking
-			logger.verbose("message is null!");
-			return;
-		}
-
-		if(message->buffer.size() == 0) {
-			logger.verbose("Refusing to send empty message");
-			return;
-		}
-
-		if (message->binary)
-			stream.binary(true);
-		else
-			stream.text(true);
-
-		stream.async_write(message->buffer.data(), beast::bind_front_handler(&WSSession::OnSend, shared_from_this()));
-	}
-
-	void WSSession::OnSend(beast::error_code ec, std::size_t bytes_transferred) {
-		if(ec == ws::error::closed)
-			server->OnClose(shared_from_this());
-	}
-
-	// http session
-	struct HTTPSession : public std::enable_shared_from_this<HTTPSession> {
-		
-		explicit HTTPSession(WebsocketServer* server, tcp::socket&& socket)
-			: server(server), stream(std::move(socket)) {
-		
-		}
-
-		void Run() {
-			// Ensure we're on the right strand
-			net::dispatch(stream.get_executor(), beast::bind_front_handler(&HTTPSession::Read, shared_from_this()));
-		}
-
-
-	private:
-
-		void Read() {
-			req = {};
-
-			http::async_read(stream, request_buffer, req, beast::bind_front_handler(&HTTPSession::OnRead, shared_from_this()));
-		}
-
-		void OnRead(beast::error_code ec, size_t bytes_written) {
-			if (ec == http::error::end_of_stream) {
-				beast::error_code ec;
-				stream.socket().shutdown(tcp::socket::shutdown_send, ec);
-			}
-
-			if (ec)
-				return;
-
-			// TODO: here would be a good place to add code to check for the X-Forwarded-For
-			// header. If this is found, we could have a optional shared_ptr<net::ip::address> argument or something
-			// that overrides what IP address the server will treat the user as using
-
-			if (ws::is_upgrade(req)) {
-
-				auto subprotocols = http::token_list(req[http::field::sec_websocket_protocol]);
-				auto session = std::make_shared<WSSession>(stream.release_socket(), server, subprotocols);
-
-				// At this point, there is no actual Websocket connection handshaked,
-				// but we can have the server verify if this connection should be accepted.
-				//
-				// If the verify callback returns false, then we should close the session
-				// and wait for another accept.
-				if (!server->OnVerify(session)) {
-					beast::error_code ec;
-					stream.socket().shutdown(tcp::socket::shutdown_send, ec);
-					return;
-				}
-
-				session->Run(req);
-			} else {
-				// TODO I need to see why http request bombing breaks the server
-				auto target = req.target();
-				auto address = stream.socket().remote_endpoint().address().to_string();
-				http::response<http::string_body> res;
-
-				res.set(http::field::server, "collab-vm-server/2.0");
-				
-				logger.info(address, " Requested (", req.method_string() , ") ", target);
-
-				switch(req.method()) {
-					case http::verb::get:
-						res.result(http::status::ok);
-						res.body() = "CollabVM 2.0";
-						break;
-
-					case http::verb::head:
-						res.result(http::status::ok);
-						break;
-
-					default: {
-						res.result(http::status::bad_request);
-						res.body() = "Bad Request";
-					} break;
-				}
-
-				Write(res);
-			}
-
-			// Session stops existing after this
-		}
-		
-		void Write(http::response<http::string_body>& response) {
-			beast::error_code ec;
-			http::write(stream.socket(), response, ec);
-			
-			if(ec)
-				return;
-
-			if(req.need_eof()) {
-				beast::error_code ec;
-				stream.socket().shutdown(tcp::socket::shutdown_send, ec);
-			}
-		}
-
-		// Handle to the WebsocketServer
-		// that created us.
-		WebsocketServer* server;
-		
-		beast::tcp_stream stream;
-
-		// HTTP request buffer
-		beast::flat_buffer request_buffer;
-
-		http::request<http::string_body> req;
-
-		Logger logger = Logger::GetLogger("HTTP");
-	};
-
-	struct Listener : public std::enable_shared_from_this<Listener> {
-
-		Listener(net::io_service& ioc, tcp::endpoint& ep, WebsocketServer* srv)
-			: ioc(ioc),
-			acceptor(ioc), server(srv) {
-			beast::error_code ec;
-
-			acceptor.open(ep.protocol(), ec);
-			acceptor.set_option(net::socket_base::reuse_address(true), ec);
-			acceptor.bind(ep, ec);
-			acceptor.listen(net::socket_base::max_listen_connections, ec);
-		}
-
-		void Run() {
-			DoAccept();
-		}
-
-	private:
-
-		void DoAccept() {
-			// new connection runs on its own strand
-			acceptor.async_accept(net::make_strand(ioc), beast::bind_front_handler(&Listener::OnAccept, shared_from_this()));
-		}
-
-
-		void OnAccept(beast::error_code ec, tcp::socket socket_) {
-			if(ec)
-				return;
-			
-			auto session = std::make_shared<HTTPSession>(server, std::move(socket_));
-			session->Run();
-
-			// accept another connection after we start the HTTP session
-			DoAccept();
-
-		}
-
-		// pointer to server
-		WebsocketServer* server;
-
-		tcp::acceptor acceptor;
-		net::io_service& ioc;
-	};
-
-	// WebsocketServer
-
-	void WebsocketServer::Start(tcp::endpoint& ep) {
-		using namespace std::placeholders;
-
-		wsLogger.info("Starting server on ", ep.address().to_string() ,":", ep.port());
-
-		// The listener doesn't have to worry about freeing,
-		// the WebsocketServer will handle that
-		listener = std::make_shared<Listener>(*io_service, ep, this);
-		listener->Run();
-		io_service->run();
-	}
-
-
-	void WebsocketServer::Stop() {
-		listener.reset();
-	}
-
-}
+#include "WebsocketServer.h"
+#include "Metrics.h"
+
+using namespace std::placeholders;
+
+namespace CollabVM {
+
+	// Ingest metrics. allocations / received is the amount of heap allocations per incoming message
+	// the read path makes itself; it should be close to 0 once the message pool has warmed up.
+	static Metrics::Metric& ReceivedMetric = Metrics::Get("ws_messages_received_total");
+	static Metrics::Metric& AllocationsMetric = Metrics::Get("ws_message_allocations_total");
+	static Metrics::Metric& PooledMetric = Metrics::Get("ws_message_pool_messages");
+
+	// Send backlog metrics
+	static Metrics::Metric& DroppedMetric = Metrics::Get("ws_messages_dropped_total");
+	static Metrics::Metric& BacklogClosedMetric = Metrics::Get("ws_sessions_closed_backlog_total");
+
+	void WSMessageRecycler::operator()(WSMessage* message) const {
+		WSMessagePool::Get().Release(message);
+	}
+
+	WSMessagePool& WSMessagePool::Get() {
+		static WSMessagePool pool;
+		return pool;
+	}
+
+	WSMessagePool::WSMessagePool() {
+		messages.reserve(MaxMessages);
+	}
+
+	WSMessagePool::handle_type WSMessagePool::Acquire() {
+		{
+			std::lock_guard<std::mutex> l(lock);
+
+			if(!messages.empty()) {
+				auto message = messages.back();
+				messages.pop_back();
+				PooledMetric.Set(messages.size());
+				return handle_type(message);
+			}
+		}
+
+		AllocationsMetric.Add();
+		return handle_type(new WSMessage());
+	}
+
+	void WSMessagePool::Release(WSMessage* message) {
+		if(!message)
+			return;
+
+		if(message->buffer.capacity() <= MaxPooledCapacity) {
+			// clear() keeps the buffer's memory around for the next message
+			message->buffer.clear();
+
+			std::lock_guard<std::mutex> l(lock);
+
+			if(messages.size() < MaxMessages) {
+				messages.push_back(message);
+				PooledMetric.Set(messages.size());
+				return;
+			}
+		}
+
+		delete message;
+	}
+
+	inline void ConfigureStream(ws::stream<beast::tcp_stream>& stream, std::size_t max_message_size) {
+		// Enable the WebSocket permessage deflate extension.
+		ws::permessage_deflate pmd;
+		pmd.client_enable = true;
+		pmd.server_enable = true;
+		pmd.compLevel = 3;
+		stream.set_option(pmd);
+
+		stream.auto_fragment(false);
+
+		// Don't buffer more of a message than the protocol would accept anyway
+		stream.read_message_max(max_message_size);
+	}
+
+	// return a mime type for the specific file
+	inline beast::string_view MimeType(beast::string_view path) {
+		auto ext = [&path] {
+			auto const pos = path.rfind(".");
+			if(pos == beast::string_view::npos)
+				return beast::string_view{};
+			return path.substr(pos);
+		}();
+#define EXT(extension, mime) if(beast::iequals(ext, extension)) return mime;
+		// Subset that should be "good" enough
+		EXT(".htm", "text/html")
+		EXT(".html", "text/html")
+		EXT(".css", "text/css")
+		EXT(".txt", "text/plain")
+		EXT(".js", "application/javascript")
+		EXT(".json", "application/json")
+		EXT(".png", "image/png")
+		EXT(".ico", "image/vnd.microsoft.icon")
+#undef EXT
+		return "application/text";
+	}
+
+
+	// WSSession
+
+	void WSSession::Run(http::request<http::string_body> req) {
+		// already running on the right strand
+		SessionStart(req);
+	}
+
+	void WSSession::SessionStart(http::request<http::string_body> req) {
+		ConfigureStream(stream, server->max_message_size);
+
+		stream.set_option(ws::stream_base::timeout::suggested(beast::role_type::server));
+
+		stream.set_option(ws::stream_base::decorator([&](ws::response_type& res) {
+			// Set the subprotocol if we need to
+			if(!subprotocol.empty())
+				res.set(http::field::sec_websocket_protocol, subprotocol);
+
+			
+			// TODO(maybe): Add version information
+			res.set(http::field::server, "collab-vm-server/2.0");
+		}));
+
+		// Pongs answer the pings we use to measure round-trip time
+		stream.control_callback(std::bind(&WSSession::OnControl, this, _1, _2));
+
+		stream.async_accept(req, beast::bind_front_handler(&WSSession::OnAccept, shared_from_this()));
+	}
+
+	ws::stream<beast::tcp_stream>& WSSession::GetStream() {
+		return stream;
+	}
+
+	void WSSession::OnAccept(beast::error_code ec) {
+		if(ec)
+			return;
+
+		logger.verbose("Accepted session for ", GetAddress().to_string());
+
+		server->OnOpen(shared_from_this());
+
+		Read();
+	}
+
+	void WSSession::Read() {
+		// take a message from the pool
+		reading = WSMessagePool::Get().Acquire();
+		reading_capacity = reading->buffer.capacity();
+
+		stream.async_read(reading->buffer, beast::bind_front_handler(&WSSession::OnRead, shared_from_this()));
+	}
+
+	void WSSession::OnRead(beast::error_code ec, std::size_t bytes_transferred) {
+		auto message = std::move(reading);
+
+		if(ec == ws::error::closed) {
+			message.reset();
+			server->OnClose(shared_from_this());
+			return;
+		}
+
+		if(ec)
+			return;
+
+		ReceivedMetric.Add();
+
+		// The pooled buffer had to grow to fit
+		if(message->buffer.capacity() > reading_capacity)
+			AllocationsMetric.Add();
+
+		message->binary = stream.got_binary();
+
+		server->OnMessage(shared_from_this(), std::move(message));
+
+		Read();
+	}
+
+	void WSSession::Send(WebsocketServer::message_type message) {
+		if(!message) {
+			// NOTE: If this happens, there's probably a lot more wrong, but instead of crashing on this
+			// we'll crash on what might actually be breaking
+			logger.verbose("message is null!");
+			return;
+		}
+
+		if(message->buffer.size() == 0) {
+			logger.verbose("Refusing to send empty message");
+			return;
+		}
+
+		Queue({ std::move(message), nullptr });
+	}
+
+	void WSSession::Send(WebsocketServer::shared_message_type message) {
+		if(!message) {
+			logger.verbose("message is null!");
+			return;
+		}
+
+		if(message->Size() == 0) {
+			logger.verbose("Refusing to send empty message");
+			return;
+		}
+
+		Queue({ nullptr, message });
+	}
+
+	void WSSession::Queue(Outgoing outgoing) {
+		queued_bytes += outgoing.shared ? outgoing.shared->Size() : outgoing.message->buffer.size();
+
+		// Beast only allows one write in flight at a time,
+		// so messages are queued on our strand and written one after another.
+		net::post(stream.get_executor(), [self = shared_from_this(), outgoing = std::move(outgoing)]() mutable {
+			if(self->backlog_closing) {
+				self->queued_bytes -= outgoing.shared ? outgoing.shared->Size() : outgoing.message->buffer.size();
+				return;
+			}
+
+			self->send_queue.push_back(std::move(outgoing));
+			self->CheckBacklog();
+
+			// If this is the only message, nothing is being written right now
+			if(self->send_queue.size() == 1)
+				self->Write();
+		});
+	}
+
+	void WSSession::DropQueued() {
+		net::post(stream.get_executor(), [self = shared_from_this()]() {
+			auto& queue = self->send_queue;
+
+			// The message at the front is being written
+			for(auto it = queue.empty() ? queue.end() : queue.begin() + 1; it != queue.end();) {
+				if(!it->shared || !it->shared->droppable) {
+					++it;
+					continue;
+				}
+
+				self->queued_bytes -= it->shared->Size();
+				DroppedMetric.Add();
+				it = queue.erase(it);
+			}
+		});
+	}
+
+	void WSSession::CheckBacklog() {
+		auto now = std::chrono::steady_clock::now();
+
+		if(queued_bytes.load(std::memory_order_relaxed) <= MaxQueuedBytes) {
+			backlogged_since.reset();
+			return;
+		}
+
+		if(!backlogged_since) {
+			backlogged_since = now;
+			return;
+		}
+
+		if(now - *backlogged_since < MaxBacklogTime || backlog_closing)
+			return;
+
+		// Screen updates are dropped well before this,
+		// so the peer isn't reading at all, or keeps up with nothing.
+		logger.info("Closing a session which stayed ", queued_bytes.load(std::memory_order_relaxed), " bytes behind");
+		BacklogClosedMetric.Add();
+
+		backlog_closing = true;
+
+		// Keep only the message being written
+		while(send_queue.size() > 1) {
+			auto& last = send_queue.back();
+			queued_bytes -= last.shared ? last.shared->Size() : last.message->buffer.size();
+			send_queue.pop_back();
+		}
+
+		Close(ws::close_reason(ws::close_code::try_again_later));
+	}
+
+	void WSSession::Write() {
+		auto& outgoing = send_queue.front();
+
+		write_start = std::chrono::steady_clock::now();
+		MaybePing();
+
+		if(outgoing.shared) {
+			stream.binary(outgoing.shared->binary);
+			stream.async_write(outgoing.shared->Buffers(), beast::bind_front_handler(&WSSession::OnSend, shared_from_this()));
+		} else {
+			stream.binary(outgoing.message->binary);
+			stream.async_write(outgoing.message->buffer.data(), beast::bind_front_handler(&WSSession::OnSend, shared_from_this()));
+		}
+	}
+
+	void WSSession::OnSend(beast::error_code ec, std::size_t bytes_transferred) {
+		using namespace std::chrono;
+
+		auto& sent = send_queue.front();
+		queued_bytes -= sent.shared ? sent.shared->Size() : sent.message->buffer.size();
+		send_queue.pop_front();
+
+		if(!ec && bytes_transferred >= MinBandwidthSample) {
+			const uint64 elapsed = std::max<uint64>(duration_cast<microseconds>(steady_clock::now() - write_start).count(), 1);
+			const uint64 sample = (bytes_transferred * 1000000) / elapsed;
+			const uint64 current = bandwidth.load(std::memory_order_relaxed);
+
+			// exponential moving average, weighing the newest sample 1/8
+			bandwidth.store(current == 0 ? sample : (current * 7 + sample) / 8, std::memory_order_relaxed);
+		}
+
+		if(ec == ws::error::closed) {
+			send_queue.clear();
+			server->OnClose(shared_from_this());
+			return;
+		}
+
+		if(ec) {
+			send_queue.clear();
+			return;
+		}
+
+		if(!send_queue.empty())
+			Write();
+	}
+
+	void WSSession::MaybePing() {
+		auto now = std::chrono::steady_clock::now();
+
+		if(ping_in_flight || now - ping_sent < PingInterval)
+			return;
+
+		ping_in_flight = true;
+		ping_sent = now;
+
+		// Beast allows a ping to be in flight alongside a write
+		stream.async_ping({}, [self = shared_from_this()](beast::error_code ec) {
+			if(ec)
+				self->ping_in_flight = false;
+		});
+	}
+
+	void WSSession::OnControl(ws::frame_type kind, beast::string_view payload) {
+		using namespace std::chrono;
+
+		if(kind != ws::frame_type::pong || !ping_in_flight)
+			return;
+
+		ping_in_flight = false;
+
+		const uint32 sample = std::max<uint32>(duration_cast<milliseconds>(steady_clock::now() - ping_sent).count(), 1);
+		const uint32 current = rtt.load(std::memory_order_relaxed);
+
+		// exponential moving average, weighing the newest sample 1/4
+		rtt.store(current == 0 ? sample : (current * 3 + sample) / 4, std::memory_order_relaxed);
+	}
+
+	// http session
+	struct HTTPSession : public std::enable_shared_from_this<HTTPSession> {
+		
+		explicit HTTPSession(WebsocketServer* server, tcp::socket&& socket)
+			: server(server), stream(std::move(socket)) {
+		
+		}
+
+		void Run() {
+			// Ensure we're on the right strand
+			net::dispatch(stream.get_executor(), beast::bind_front_handler(&HTTPSession::Read, shared_from_this()));
+		}
+
+
+	private:
+
+		void Read() {
+			req = {};
+
+			http::async_read(stream, request_buffer, req, beast::bind_front_handler(&HTTPSession::OnRead, shared_from_this()));
+		}
+
+		void OnRead(beast::error_code ec, size_t bytes_written) {
+			if (ec == http::error::end_of_stream) {
+				beast::error_code ec;
+				stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+			}
+
+			if (ec)
+				return;
+
+			// TODO: here would be a good place to add code to check for the X-Forwarded-For
+			// header. If this is found, we could have a optional shared_ptr<net::ip::address> argument or something
+			// that overrides what IP address the server will treat the user as using
+
+			if (ws::is_upgrade(req)) {
+
+				auto subprotocols = http::token_list(req[http::field::sec_websocket_protocol]);
+				auto session = std::make_shared<WSSession>(stream.release_socket(), server, subprotocols);
+
+				// At this point, there is no actual Websocket connection handshaked,
+				// but we can have the server verify if this connection should be accepted.
+				//
+				// If the verify callback returns false, then we should close the session
+				// and wait for another accept.
+				if (!server->OnVerify(session)) {
+					beast::error_code ec;
+					stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+					return;
+				}
+
+				session->Run(req);
+			} else {
+				// TODO I need to see why http request bombing breaks the server
+				auto target = req.target();
+				auto address = stream.socket().remote_endpoint().address().to_string();
+				http::response<http::string_body> res;
+
+				res.set(http::field::server, "collab-vm-server/2.0");
+				
+				logger.info(address, " Requested (", req.method_string() , ") ", target);
+
+				switch(req.method()) {
+					case http::verb::get:
+						res.result(http::status::ok);
+
+						if(target == "/metrics") {
+							res.set(http::field::content_type, "text/plain");
+							res.body() = Metrics::Dump();
+						} else if(!server->OnHttpGet(target, res)) {
+							res.body() = "CollabVM 2.0";
+						}
+						break;
+
+					case http::verb::head:
+						res.result(http::status::ok);
+						break;
+
+					default: {
+						res.result(http::status::bad_request);
+						res.body() = "Bad Request";
+					} break;
+				}
+
+				Write(res);
+			}
+
+			// Session stops existing after this
+		}
+		
+		void Write(http::response<http::string_body>& response) {
+			beast::error_code ec;
+			http::write(stream.socket(), response, ec);
+			
+			if(ec)
+				return;
+
+			if(req.need_eof()) {
+				beast::error_code ec;
+				stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+			}
+		}
+
+		// Handle to the WebsocketServer
+		// that created us.
+		WebsocketServer* server;
+		
+		beast::tcp_stream stream;
+
+		// HTTP request buffer
+		beast::flat_buffer request_buffer;
+
+		http::request<http::string_body> req;
+
+		Logger logger = Logger::GetLogger("HTTP");
+	};
+
+	struct Listener : public std::enable_shared_from_this<Listener> {
+
+		Listener(net::io_service& ioc, tcp::endpoint& ep, WebsocketServer* srv)
+			: ioc(ioc),
+			acceptor(ioc), server(srv) {
+			beast::error_code ec;
+
+			acceptor.open(ep.protocol(), ec);
+			acceptor.set_option(net::socket_base::reuse_address(true), ec);
+			acceptor.bind(ep, ec);
+			acceptor.listen(net::socket_base::max_listen_connections, ec);
+		}
+
+		void Run() {
+			DoAccept();
+		}
+
+	private:
+
+		void DoAccept() {
+			// new connection runs on its own strand
+			acceptor.async_accept(net::make_strand(ioc), beast::bind_front_handler(&Listener::OnAccept, shared_from_this()));
+		}
+
+
+		void OnAccept(beast::error_code ec, tcp::socket socket_) {
+			if(ec)
+				return;
+			
+			auto session = std::make_shared<HTTPSession>(server, std::move(socket_));
+			session->Run();
+
+			// accept another connection after we start the HTTP session
+			DoAccept();
+
+		}
+
+		// pointer to server
+		WebsocketServer* server;
+
+		tcp::acceptor acceptor;
+		net::io_service& ioc;
+	};
+
+	// WebsocketServer
+
+	void WebsocketServer::Start(tcp::endpoint& ep) {
+		using namespace std::placeholders;
+
+		wsLogger.info("Starting server on ", ep.address().to_string() ,":", ep.port());
+
+		// The listener doesn't have to worry about freeing,
+		// the WebsocketServer will handle that
+		listener = std::make_shared<Listener>(*io_service, ep, this);
+		listener->Run();
+		io_service->run();
+	}
+
+
+	void WebsocketServer::Stop() {
+		listener.reset();
+	}
+
+}
@@ -1,140 +1,310 @@
-#pragma once
-#include "Common.h"
-#include "Logger.h"
-
-namespace CollabVM {
-
-	struct WSSession;
-	struct HTTPSession;
-	struct Listener;
-
-	// basic wrapper over beast::flat_buffer
-	struct WSMessage {
-
-		inline ~WSMessage() {
-			buffer.clear();
-		}
-
-		bool binary;
-		beast::flat_buffer buffer;
-	};
-
-	// WebSocket server using Boost.Beast.
-	struct WebsocketServer : public std::enable_shared_from_this<WebsocketServer> {
-		friend struct WSSession;
-		friend struct HTTPSession;
-		friend struct Listener;
-
-		// message type
-		typedef std::shared_ptr<WSMessage> message_type;
-
-		// handle type
-		// The handle type is a shared_ptr to the session.
-		typedef std::shared_ptr<WSSession> handle_type;
-
-		// TODO
-		typedef std::shared_ptr<HTTPSession> http_handle_type;
-
-		inline WebsocketServer(net::io_service& ioc)
-			: io_service(&ioc) {
-			
-		}
-
-
-		void Start(tcp::endpoint& ep);
-
-		void Stop();
-
-		// Callbacks run where the io service runs
-		
-		virtual bool OnVerify(handle_type handle) = 0;
-
-		// TODO: OnHttp?
-
-		virtual void OnOpen(handle_type handle) = 0;
-
-		virtual void OnMessage(handle_type handle, message_type message) = 0;
-
-		virtual void OnClose(handle_type handle) = 0;
-
-	protected:
-
-		net::io_service* io_service;
-
-		// listener
-		std::shared_ptr<Listener> listener;
-	private:
-		Logger wsLogger = Logger::GetLogger("WebSocketServer");
-	};
-
-	// WebSocket session
-	struct WSSession : public std::enable_shared_from_this<WSSession> {
-	
-		explicit WSSession(tcp::socket&& socket, WebsocketServer* server, http::token_list& subprotocols) 
-		 : stream(std::move(socket)), server(server), subprotocols(subprotocols) {
-		
-		}
-
-		void Run(http::request<http::string_body> req);
-
-		void SessionStart(http::request<http::string_body> req);
-
-		// Get the stream this session object is managing
-		ws::stream<beast::tcp_stream>& GetStream();
-
-		void OnAccept(beast::error_code ec);
-
-		void Read();
-
-		void OnRead( WebsocketServer::message_type message, beast::error_code ec, std::size_t bytes_transferred);
-
-		// send a message
-		void Send(WebsocketServer::message_type message);
-
-		void OnSend(beast::error_code ec, std::size_t bytes_transferred);
-
-		// Close connection and session
-		inline void Close(ws::close_reason reason = ws::close_reason(ws::close_code::normal)) {
-			stream.async_close(reason, [&](beast::error_code ec) {
-				if (ec)
-					return;
-			});
-		}
-
-		// Get address
-		inline net::ip::address GetAddress() {
-			// TODO: read todo in .cpp
-			return stream.next_layer().socket().remote_endpoint().address();
-		}
-
-		inline http::token_list GetSubprotocols() {
-			return subprotocols;
-		}		
-
-		inline std::string GetHandshakeSubprotocol() {
-			return subprotocol;
-		}
-
-		inline void SetSubprotocol(std::string protocol) {
-			subprotocol = protocol;
-		}
-
-		// All subprotocols, valid until OnVerify() returns.
-		http::token_list& subprotocols;
-
-		// Currently-handshaked subprotocol
-		std::string subprotocol;
-
-	private:
-		// Handle to the WebsocketServer
-		// that created us (by creating the Listener...)
-		// Used to call callbacks.
-		WebsocketServer* server;
-
-		// this session's stream
-		ws::stream<beast::tcp_stream> stream;
-
-		Logger logger = Logger::GetLogger("WebsocketSession");
-	};
-
+#pragma once
+#include "Common.h"
+#include "Logger.h"
+#include "VMControllers/Common/QualityTier.h"
+#include <atomic>
+#include <optional>
+
+namespace CollabVM {
+
+	struct WSSession;
+	struct HTTPSession;
+	struct Listener;
+
+	// basic wrapper over beast::flat_buffer
+	struct WSMessage {
+
+		inline ~WSMessage() {
+			buffer.clear();
+		}
+
+		bool binary;
+		beast::flat_buffer buffer;
+	};
+
+	// Gives messages back to the WSMessagePool instead of deleting them.
+	struct WSMessageRecycler {
+		void operator()(WSMessage* message) const;
+	};
+
+	// Pool of incoming messages, so reading a message doesn't allocate one,
+	// nor a buffer for it once the pooled buffers have grown to fit.
+	//
+	// Messages are read on io threads and released on work threads,
+	// so the pool is shared by every thread rather than per thread.
+	struct WSMessagePool {
+		typedef std::unique_ptr<WSMessage, WSMessageRecycler> handle_type;
+
+		// Most messages the pool will hold on to
+		constexpr static std::size_t MaxMessages = 1024;
+
+		// Buffers which grew larger than this (e.g for a large upload) are freed instead
+		constexpr static std::size_t MaxPooledCapacity = 64 * 1024;
+
+		// Get the process-wide message pool.
+		static WSMessagePool& Get();
+
+		// Get an empty message.
+		handle_type Acquire();
+
+		// Give a message back to the pool.
+		void Release(WSMessage* message);
+
+	private:
+		WSMessagePool();
+
+		std::mutex lock;
+
+		// Locked by lock. Never grows past MaxMessages, so releasing doesn't allocate.
+		std::vector<WSMessage*> messages;
+	};
+
+	// Immutable, reference-counted message.
+	// Built once, it can be sent to any amount of sessions
+	// without being copied or serialized again.
+	struct WSSharedMessage {
+		bool binary = true;
+
+		// Set for screen updates, which a session that fell too far behind may drop
+		// (see WSSession::DropQueued()), since a refresh supersedes them.
+		bool droppable = false;
+
+		// The message, or its header if there is a payload.
+		// Points into a buffer owned by whatever made the message.
+		net::const_buffer data;
+
+		// Optional payload sent right after data, in the same WebSocket message.
+		// This lets large buffers (e.g an encoded region) be sent without copying them into data.
+		// Like data, it must be kept alive by whatever made the message.
+		net::const_buffer payload;
+
+		// Buffer sequence to write
+		inline std::array<net::const_buffer, 2> Buffers() const {
+			return { data, payload };
+		}
+
+		inline std::size_t Size() const {
+			return data.size() + payload.size();
+		}
+	};
+
+	// WebSocket server using Boost.Beast.
+	struct WebsocketServer : public std::enable_shared_from_this<WebsocketServer> {
+		friend struct WSSession;
+		friend struct HTTPSession;
+		friend struct Listener;
+
+		// message type.
+		// Messages are owned by one thing at a time, and go back to the WSMessagePool when released.
+		typedef WSMessagePool::handle_type message_type;
+
+		// shared message type
+		typedef std::shared_ptr<const WSSharedMessage> shared_message_type;
+
+		// handle type
+		// The handle type is a shared_ptr to the session.
+		typedef std::shared_ptr<WSSession> handle_type;
+
+		// TODO
+		typedef std::shared_ptr<HTTPSession> http_handle_type;
+
+		inline WebsocketServer(net::io_service& ioc)
+			: io_service(&ioc) {
+			
+		}
+
+
+		void Start(tcp::endpoint& ep);
+
+		void Stop();
+
+		// Set the largest message read from a client, in bytes.
+		// Sessions sending anything larger are closed. Call before Start().
+		inline void SetMaxMessageSize(std::size_t size) {
+			max_message_size = size;
+		}
+
+		// Callbacks run where the io service runs
+		
+		virtual bool OnVerify(handle_type handle) = 0;
+
+		// Called for HTTP GET requests the server doesn't handle itself.
+		// Fill in the response and return true, or return false to send the default page.
+		virtual bool OnHttpGet(beast::string_view target, http::response<http::string_body>& response) {
+			return false;
+		}
+
+		virtual void OnOpen(handle_type handle) = 0;
+
+		virtual void OnMessage(handle_type handle, message_type message) = 0;
+
+		virtual void OnClose(handle_type handle) = 0;
+
+	protected:
+
+		net::io_service* io_service;
+
+		// listener
+		std::shared_ptr<Listener> listener;
+
+		std::size_t max_message_size = 64 * 1024;
+	private:
+		Logger wsLogger = Logger::GetLogger("WebSocketServer");
+	};
+
+	// WebSocket session
+	struct WSSession : public std::enable_shared_from_this<WSSession> {
+	
+		explicit WSSession(tcp::socket&& socket, WebsocketServer* server, http::token_list& subprotocols) 
+		 : stream(std::move(socket)), server(server), subprotocols(subprotocols) {
+		
+		}
+
+		void Run(http::request<http::string_body> req);
+
+		void SessionStart(http::request<http::string_body> req);
+
+		// Get the stream this session object is managing
+		ws::stream<beast::tcp_stream>& GetStream();
+
+		void OnAccept(beast::error_code ec);
+
+		void Read();
+
+		void OnRead(beast::error_code ec, std::size_t bytes_transferred);
+
+		// send a message
+		// These can be called from any thread; the message is queued
+		// and written once every message queued before it has been written.
+		void Send(WebsocketServer::message_type message);
+
+		// send a shared message.
+		// The session only keeps a reference, so the same message can be sent to many sessions.
+		void Send(WebsocketServer::shared_message_type message);
+
+		// Drop every droppable message which is queued but not being written yet.
+		// Messages sent after this call are kept.
+		void DropQueued();
+
+		// Past this many queued bytes, a session is too far behind:
+		// screen updates should be dropped (see ClientTileCache::Send()) instead of queued.
+		constexpr static std::size_t MaxQueuedBytes = 4 * 1024 * 1024;
+
+		// Once a session drops screen updates, it has to catch up to this many queued bytes before it's sent any again.
+		constexpr static std::size_t ResumeQueuedBytes = 512 * 1024;
+
+		// Sessions which stay past MaxQueuedBytes for this long are closed
+		constexpr static std::chrono::seconds MaxBacklogTime = std::chrono::seconds(10);
+
+		void OnSend(beast::error_code ec, std::size_t bytes_transferred);
+
+		// Close connection and session
+		inline void Close(ws::close_reason reason = ws::close_reason(ws::close_code::normal)) {
+			stream.async_close(reason, [&](beast::error_code ec) {
+				if (ec)
+					return;
+			});
+		}
+
+		// Get address
+		inline net::ip::address GetAddress() {
+			// TODO: read todo in .cpp
+			return stream.next_layer().socket().remote_endpoint().address();
+		}
+
+		inline http::token_list GetSubprotocols() {
+			return subprotocols;
+		}		
+
+		inline std::string GetHandshakeSubprotocol() {
+			return subprotocol;
+		}
+
+		inline void SetSubprotocol(std::string protocol) {
+			subprotocol = protocol;
+		}
+
+		// Get the measured statistics of this session's link.
+		// Safe to call from any thread.
+		inline LinkStats GetLinkStats() const {
+			LinkStats stats;
+			stats.bandwidth = bandwidth.load(std::memory_order_relaxed);
+			stats.rtt = rtt.load(std::memory_order_relaxed);
+			stats.queued_bytes = queued_bytes.load(std::memory_order_relaxed);
+			return stats;
+		}
+
+		// All subprotocols, valid until OnVerify() returns.
+		http::token_list& subprotocols;
+
+		// Currently-handshaked subprotocol
+		std::string subprotocol;
+
+	private:
+
+		// A queued outgoing message.
+		// Exactly one of these is set.
+		struct Outgoing {
+			WebsocketServer::message_type message;
+			WebsocketServer::shared_message_type shared;
+		};
+
+		// Queue a message on the session's strand
+		void Queue(Outgoing outgoing);
+
+		// Write the message at the front of the send queue
+		void Write();
+
+		// Close the session if it has been past MaxQueuedBytes for too long
+		void CheckBacklog();
+
+		// Send a ping to measure round-trip time, if it's time to
+		void MaybePing();
+
+		// Called with control frames the peer sends us
+		void OnControl(ws::frame_type kind, beast::string_view payload);
+
+		// Handle to the WebsocketServer
+		// that created us (by creating the Listener...)
+		// Used to call callbacks.
+		WebsocketServer* server;
+
+		// Messages waiting to be written.
+		// Only touched on the session's strand
+		std::deque<Outgoing> send_queue;
+
+		// When the session went past MaxQueuedBytes, and whether it's closing because of it.
+		// Only touched on the session's strand
+		std::optional<std::chrono::steady_clock::time_point> backlogged_since;
+		bool backlog_closing = false;
+
+		// Message being read, and the capacity its buffer had before
+		WebsocketServer::message_type reading;
+		std::size_t reading_capacity = 0;
+
+		// Link measurement.
+		// The atomics are read by other threads, everything else is only touched on the session's strand.
+
+		// Smallest write which is used to sample throughput.
+		// Smaller writes are dominated by latency and socket buffering.
+		constexpr static std::size_t MinBandwidthSample = 8 * 1024;
+
+		// How often to ping the peer to measure round-trip time
+		constexpr static std::chrono::seconds PingInterval = std::chrono::seconds(2);
+
+		std::atomic<uint64> bandwidth { 0 };
+		std::atomic<uint32> rtt { 0 };
+		std::atomic<uint64> queued_bytes { 0 };
+
+		std::chrono::steady_clock::time_point write_start;
+
+		bool ping_in_flight = false;
+		std::chrono::steady_clock::time_point ping_sent;
+
+		// this session's stream
+		ws::stream<beast::tcp_stream> stream;
+
+		Logger logger = Logger::GetLogger("WebsocketSession");
+	};
+
 }
\ No newline at end of file
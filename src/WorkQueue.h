@@ -0,0 +1,169 @@
+#pragma once
+#include "Common.h"
+#include "Metrics.h"
+#include <atomic>
+#include <condition_variable>
+
+namespace CollabVM {
+
+	// A bounded, lock-free multi-producer single-consumer queue.
+	//
+	// Any thread can Push() without taking a lock; one thread Drain()s everything
+	// waiting at once, and parks in Wait() only while the queue is empty.
+	// Producers only touch the mutex to wake the consumer if it is parked.
+	//
+	// The ring is the bounded queue of Dmitry Vyukov:
+	// every cell has a sequence number telling whether it is free to write (== position)
+	// or holds an item for that position (== position + 1).
+	template<class T>
+	struct WorkQueue {
+
+		// capacity is rounded up to a power of two.
+		// metric_name names the exported depth and high water metrics,
+		// and metric_labels (e.g {shard="0"}) is appended to each.
+		explicit WorkQueue(std::size_t capacity, const std::string& metric_name, const std::string& metric_labels = "")
+			: depth_metric(Metrics::Get(metric_name + "_depth" + metric_labels)),
+			high_water_metric(Metrics::Get(metric_name + "_high_water" + metric_labels)),
+			full_metric(Metrics::Get(metric_name + "_full_total" + metric_labels)) {
+			std::size_t size = 2;
+			while(size < capacity)
+				size *= 2;
+
+			mask = size - 1;
+			cells = std::make_unique<Cell[]>(size);
+
+			for(std::size_t i = 0; i < size; ++i)
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		WorkQueue(const WorkQueue&) = delete;
+		WorkQueue& operator=(const WorkQueue&) = delete;
+
+		// Add an item. Safe to call from any thread.
+		// If the queue is full, this yields until the consumer makes room,
+		// pushing back on producers instead of growing without bound.
+		void Push(T item) {
+			std::size_t pos = tail.load(std::memory_order_relaxed);
+			Cell* cell;
+
+			while(true) {
+				cell = &cells[pos & mask];
+				const std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				const auto diff = (std::intptr_t)sequence - (std::intptr_t)pos;
+
+				if(diff == 0) {
+					if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				} else if(diff < 0) {
+					// Full; the consumer hasn't freed this cell from the last lap yet
+					full_metric.Add();
+					Wake();
+					std::this_thread::yield();
+					pos = tail.load(std::memory_order_relaxed);
+				} else {
+					// Another producer took this position
+					pos = tail.load(std::memory_order_relaxed);
+				}
+			}
+
+			cell->item = std::move(item);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+
+			// head may be stale here, so this can overestimate; never past the capacity though.
+			// The consumer may also have drained past this item already, leaving nothing to count.
+			const std::size_t consumed = head.load(std::memory_order_relaxed);
+			if(consumed <= pos + 1)
+				high_water_metric.Max(std::min(pos + 1 - consumed, mask + 1));
+
+			// Pairs with the fence in Wait(): either the consumer sees the item,
+			// or we see that it's parked.
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(parked.load(std::memory_order_relaxed))
+				Wake();
+		}
+
+		// Move every item that's ready into out, in order.
+		// Only called by the consumer. Returns the amount of items taken.
+		std::size_t Drain(std::vector<T>& out) {
+			std::size_t pos = head.load(std::memory_order_relaxed);
+			const std::size_t start = pos;
+
+			while(true) {
+				Cell& cell = cells[pos & mask];
+
+				if(cell.sequence.load(std::memory_order_acquire) != pos + 1)
+					break;
+
+				out.push_back(std::move(cell.item));
+				cell.item = T();
+				cell.sequence.store(pos + mask + 1, std::memory_order_release);
+				pos++;
+			}
+
+			head.store(pos, std::memory_order_relaxed);
+			depth_metric.Set(tail.load(std::memory_order_relaxed) - pos);
+			return pos - start;
+		}
+
+		// Park the consumer until an item is ready, or Interrupt() is called.
+		// Only called by the consumer.
+		void Wait() {
+			std::unique_lock<std::mutex> l(lock);
+
+			parked.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			ready.wait(l, [&]() { return Ready() || interrupted; });
+
+			parked.store(false, std::memory_order_relaxed);
+			interrupted = false;
+		}
+
+		// Wake the consumer from Wait(), even if nothing is queued.
+		void Interrupt() {
+			std::lock_guard<std::mutex> l(lock);
+			interrupted = true;
+			ready.notify_one();
+		}
+
+	private:
+
+		struct Cell {
+			std::atomic<std::size_t> sequence;
+			T item;
+		};
+
+		// Is the next item ready for the consumer?
+		inline bool Ready() const {
+			const std::size_t pos = head.load(std::memory_order_relaxed);
+			return cells[pos & mask].sequence.load(std::memory_order_acquire) == pos + 1;
+		}
+
+		inline void Wake() {
+			// Taking the lock makes sure the consumer is either
+			// not parked yet (and will see the item), or already waiting.
+			std::lock_guard<std::mutex> l(lock);
+			ready.notify_one();
+		}
+
+		std::unique_ptr<Cell[]> cells;
+		std::size_t mask;
+
+		// Producers and the consumer each get their own cache line
+		alignas(64) std::atomic<std::size_t> tail { 0 };
+		alignas(64) std::atomic<std::size_t> head { 0 };
+
+		alignas(64) std::atomic<bool> parked { false };
+
+		std::mutex lock;
+		std::condition_variable ready;
+
+		// Locked by lock
+		bool interrupted = false;
+
+		Metrics::Metric& depth_metric;
+		Metrics::Metric& high_water_metric;
+		Metrics::Metric& full_metric;
+	};
+
+}
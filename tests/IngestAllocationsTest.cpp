@@ -0,0 +1,107 @@
+// Counts the heap allocations made per incoming WebSocket message on the ingest path:
+// taking a message from the WSMessagePool, reading into it, queueing it as a work record,
+// draining it on the work thread and giving the message back to the pool.
+// Once the pool has warmed up, this should allocate nothing.
+#include <WebsocketServer.h>
+#include <WorkQueue.h>
+#include <atomic>
+#include <cstdio>
+#include <new>
+#include <variant>
+
+using namespace CollabVM;
+
+static std::atomic<uint64> allocations { 0 };
+
+void* operator new(std::size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+
+	if(void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+// The same shape as the work records in Server.h.
+// Server.h itself pulls in the VM controllers, which this test doesn't need.
+struct ConnectionAddWork {
+	WebsocketServer::handle_type handle;
+};
+
+struct ConnectionRemoveWork {
+	WebsocketServer::handle_type handle;
+};
+
+struct WSMessageWork {
+	WebsocketServer::handle_type handle;
+	WebsocketServer::message_type message;
+};
+
+typedef std::variant<std::monostate, ConnectionAddWork, ConnectionRemoveWork, WSMessageWork> Work;
+
+// The same as WorkShard::QueueSize
+constexpr std::size_t QueueSize = 64 * 1024;
+
+// How many messages arrive between each time the work thread drains its queue
+constexpr std::size_t Batch = 32;
+
+// Most allocations per message allowed once warmed up
+constexpr double MaxAllocationsPerMessage = 0.001;
+
+static void Ingest(WorkQueue<Work>& queue, std::vector<Work>& drained, std::size_t count) {
+	for(std::size_t i = 0; i < count; ++i) {
+		// What WSSession::Read() and OnRead() do
+		auto message = WSMessagePool::Get().Acquire();
+
+		// Sizes like those of chat messages and mouse moves
+		const std::size_t size = 16 + (i * 37) % 512;
+		auto buffer = message->buffer.prepare(size);
+		std::memset(buffer.data(), (int)i, size);
+		message->buffer.commit(size);
+		message->binary = true;
+
+		// What Server::OnMessage() and ProcessActions() do
+		queue.Push(WSMessageWork { nullptr, std::move(message) });
+
+		if(i % Batch == Batch - 1) {
+			drained.clear();
+			queue.Drain(drained);
+
+			// Done with the work; the messages go back to the pool
+			for(auto& work : drained)
+				work = std::monostate();
+		}
+	}
+}
+
+int main() {
+	WorkQueue<Work> queue(QueueSize, "ingest_test_queue");
+
+	std::vector<Work> drained;
+	drained.reserve(Batch);
+
+	// Warm up the message pool and its buffers
+	Ingest(queue, drained, 320 * Batch);
+
+	constexpr std::size_t Messages = 200000;
+	const auto before = allocations.load();
+	Ingest(queue, drained, Messages);
+	const auto made = allocations.load() - before;
+
+	const double perMessage = (double)made / Messages;
+	std::printf("%llu allocations for %zu messages (%.5f per message)\n", (unsigned long long)made, Messages, perMessage);
+
+	if(perMessage > MaxAllocationsPerMessage) {
+		std::fprintf(stderr, "ingest path allocates more than %g times per message\n", MaxAllocationsPerMessage);
+		return 1;
+	}
+
+	return 0;
+}
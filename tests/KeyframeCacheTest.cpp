@@ -0,0 +1,140 @@
+// Tests that joining users are given the keyframe right away,
+// even while the screen never stops changing.
+#include <Common.h>
+#include <VMControllers/Common/KeyframeCache.h>
+#include <VMControllers/Common/VNCClient.h>
+#include <atomic>
+#include <iostream>
+
+using namespace CollabVM;
+
+#define CHECK(expr) \
+	if(!(expr)) { \
+		std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #expr "\n"; \
+		return 1; \
+	}
+
+constexpr uint16 Width = 1000;
+constexpr uint16 Height = 700;
+
+// 4x3 blocks of at most 256x256
+constexpr std::size_t BlockCount = 12;
+
+// Encode every stale block, like VNCClient::FlushKeyframe() would
+static std::size_t EncodeStale(KeyframeCache& cache) {
+	auto stale = cache.TakeStale();
+
+	for(auto& block : stale) {
+		auto region = std::make_shared<VNCRegion>();
+		region->x = block.rect.x;
+		region->y = block.rect.y;
+		region->width = block.rect.width;
+		region->height = block.rect.height;
+		region->region_type = VNCClientOptions::OutputRegionType::QoiRegion;
+		region->keyframe = true;
+		region->keyframe_generation = block.generation;
+		cache.Store(region);
+	}
+
+	return stale.size();
+}
+
+static uint32 Area(const std::vector<Rect>& rects) {
+	uint32 area = 0;
+
+	for(auto& rect : rects)
+		area += rect.Area();
+
+	return area;
+}
+
+int main() {
+	KeyframeCache cache;
+	cache.Resize(Width, Height);
+
+	// Nothing is cached yet, so the whole screen is stale
+	{
+		std::vector<Rect> stale;
+		CHECK(cache.Get(stale).empty());
+		CHECK(stale.size() == BlockCount);
+		CHECK(Area(stale) == (uint32)Width * Height);
+	}
+
+	// The screen was quiet, so every block gets cached
+	std::this_thread::sleep_for(KeyframeCache::QuietTime + std::chrono::milliseconds(50));
+	CHECK(EncodeStale(cache) == BlockCount);
+
+	{
+		std::vector<Rect> stale;
+		CHECK(cache.Get(stale).size() == BlockCount);
+		CHECK(stale.empty());
+	}
+
+	// A block damaged while it was being encoded keeps its old encoding
+	{
+		std::this_thread::sleep_for(KeyframeCache::QuietTime + std::chrono::milliseconds(50));
+		cache.Invalidate({ 0, 0, 16, 16 });
+		std::this_thread::sleep_for(KeyframeCache::QuietTime + std::chrono::milliseconds(50));
+
+		auto taken = cache.TakeStale();
+		CHECK(taken.size() == 1);
+
+		cache.Invalidate({ 0, 0, 16, 16 });
+
+		auto region = std::make_shared<VNCRegion>();
+		region->x = 0;
+		region->y = 0;
+		region->keyframe_generation = taken[0].generation;
+		cache.Store(region);
+
+		std::vector<Rect> stale;
+		auto keyframe = cache.Get(stale);
+		CHECK(keyframe.size() == BlockCount);
+		CHECK(keyframe[0] != region);
+		CHECK(stale.size() == 1);
+	}
+
+	// Now the screen changes all the time, so the cache is never refreshed.
+	// Users joining meanwhile must still get the keyframe right away,
+	// with the damaged blocks reported so they can be sent as damage.
+	std::atomic<bool> running { true };
+
+	std::thread screen([&]() {
+		uint32 i = 0;
+
+		while(running) {
+			cache.Invalidate({ (uint16)((i * 97) % (Width - 64)), (uint16)((i * 53) % (Height - 64)), 64, 64 });
+			EncodeStale(cache);
+			i++;
+		}
+	});
+
+	for(int join = 0; join < 50; ++join) {
+		// The whole left column is damaged right before this user joins
+		cache.Invalidate({ 0, 0, 1, Height });
+
+		std::vector<Rect> stale;
+		auto start = std::chrono::steady_clock::now();
+		auto keyframe = cache.Get(stale);
+		auto took = std::chrono::steady_clock::now() - start;
+
+		CHECK(took < std::chrono::milliseconds(100));
+		CHECK(keyframe.size() == BlockCount);
+		CHECK(stale.size() >= 3);
+
+		std::size_t leftColumn = 0;
+		for(auto& rect : stale)
+			if(rect.x == 0)
+				leftColumn++;
+
+		CHECK(leftColumn == 3);
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	running = false;
+	screen.join();
+
+	std::cout << "KeyframeCache tests passed\n";
+	return 0;
+}
@@ -0,0 +1,120 @@
+// Tests that every SIMD pixel kernel this CPU supports gives the same results as the scalar one,
+// on odd widths, odd strides and unaligned buffers, and never writes past what it should.
+#include <Common.h>
+#include <VMControllers/Common/PixelKernels.h>
+#include <iostream>
+#include <random>
+
+using namespace CollabVM;
+using namespace CollabVM::PixelKernels;
+
+// Wide enough for every vector loop and its scalar tail
+constexpr uint32 MaxWidth = 70;
+
+// Bytes around each buffer which must stay untouched
+constexpr uint32 Guard = 64;
+constexpr byte GuardByte = 0xcc;
+
+static std::mt19937 generator(1234);
+
+static std::vector<byte> RandomBytes(std::size_t size) {
+	std::vector<byte> bytes(size);
+
+	for(auto& b : bytes)
+		b = (byte)generator();
+
+	return bytes;
+}
+
+static int failures = 0;
+
+static void Fail(const char* isa, const char* kernel, uint32 width, uint32 offset, const char* what) {
+	std::cerr << isa << " " << kernel << " (width " << width << ", offset " << offset << "): " << what << "\n";
+	failures++;
+}
+
+static void TestRGB565ToXRGB(const char* isa, const Kernels& scalar, const Kernels& simd, uint32 width, uint32 offset) {
+	const auto src = RandomBytes(offset + width * 2);
+	std::vector<byte> expected(Guard + width * 4 + Guard, GuardByte);
+	std::vector<byte> got(offset + Guard + width * 4 + Guard, GuardByte);
+
+	scalar.RGB565ToXRGB(src.data() + offset, expected.data() + Guard, width);
+	simd.RGB565ToXRGB(src.data() + offset, got.data() + offset + Guard, width);
+
+	if(!std::equal(expected.begin(), expected.end(), got.begin() + offset))
+		Fail(isa, "RGB565ToXRGB", width, offset, "differs from scalar");
+}
+
+static void TestXRGBToRGB24(const char* isa, const Kernels& scalar, const Kernels& simd, uint32 width, uint32 offset) {
+	const auto src = RandomBytes(offset + width * 4);
+	std::vector<byte> expected(Guard + width * 3 + Guard, GuardByte);
+	std::vector<byte> got(offset + Guard + width * 3 + Guard, GuardByte);
+
+	scalar.XRGBToRGB24(src.data() + offset, expected.data() + Guard, width);
+	simd.XRGBToRGB24(src.data() + offset, got.data() + offset + Guard, width);
+
+	if(!std::equal(expected.begin(), expected.end(), got.begin() + offset))
+		Fail(isa, "XRGBToRGB24", width, offset, "differs from scalar");
+
+	// In place, as encoders use it
+	auto inPlace = src;
+	simd.XRGBToRGB24(inPlace.data() + offset, inPlace.data() + offset, width);
+
+	if(!std::equal(expected.begin() + Guard, expected.begin() + Guard + width * 3, inPlace.begin() + offset))
+		Fail(isa, "XRGBToRGB24", width, offset, "differs from scalar in place");
+}
+
+static void TestDownscale2x(const char* isa, const Kernels& scalar, const Kernels& simd, uint32 width, uint32 offset) {
+	constexpr uint32 Height = 5;
+
+	// Odd strides, so rows after the first are unaligned too
+	const uint32 srcStride = width * 8 + 4 * offset + 3;
+	const uint32 dstStride = width * 4 + 5;
+
+	const auto src = RandomBytes(offset + srcStride * Height * 2);
+	std::vector<byte> expected(Guard + dstStride * Height + Guard, GuardByte);
+	std::vector<byte> got(offset + Guard + dstStride * Height + Guard, GuardByte);
+
+	scalar.Downscale2x(src.data() + offset, srcStride, expected.data() + Guard, dstStride, width, Height);
+	simd.Downscale2x(src.data() + offset, srcStride, got.data() + offset + Guard, dstStride, width, Height);
+
+	// This includes the padding at the end of each row, which must be left alone
+	if(!std::equal(expected.begin(), expected.end(), got.begin() + offset))
+		Fail(isa, "Downscale2x", width, offset, "differs from scalar");
+}
+
+int main() {
+	const Kernels* scalar = GetKernels(InstructionSet::Scalar);
+
+	if(!scalar) {
+		std::cerr << "No scalar kernels\n";
+		return 1;
+	}
+
+	for(auto isa : { InstructionSet::SSE2, InstructionSet::SSSE3, InstructionSet::AVX2 }) {
+		const Kernels* simd = GetKernels(isa);
+
+		if(!simd) {
+			std::cout << "Skipping " << GetName(isa) << ", which this CPU or build doesn't support\n";
+			continue;
+		}
+
+		for(uint32 width = 0; width <= MaxWidth; ++width) {
+			for(uint32 offset = 0; offset < 4; ++offset) {
+				TestRGB565ToXRGB(GetName(isa), *scalar, *simd, width, offset);
+				TestXRGBToRGB24(GetName(isa), *scalar, *simd, width, offset);
+				TestDownscale2x(GetName(isa), *scalar, *simd, width, offset);
+			}
+		}
+
+		std::cout << "Tested " << GetName(isa) << " kernels\n";
+	}
+
+	if(failures) {
+		std::cerr << failures << " failures\n";
+		return 1;
+	}
+
+	std::cout << "PixelKernels tests passed\n";
+	return 0;
+}